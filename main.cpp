@@ -2,466 +2,7551 @@
 #include <memory>
 #include <fstream>
 #include <vector>
-#include <random>
 #include <thread>
+#include <mutex>
+#include <deque>
+#include <atomic>
 #include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <string>
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cfloat>
+#include <functional>
+#include <variant>
+#include <utility>
+#include <charconv>
+#include <string_view>
 #include "external/glm/glm/vec3.hpp"
 #include "external/glm/glm/glm.hpp"
 #include "external/glm/glm/gtx/norm.hpp"
+#include "external/glm/glm/gtc/constants.hpp"
+#include "external/glm/glm/gtc/matrix_transform.hpp"
 
-inline float randomFloat()
-{
-   static std::uniform_real_distribution<double> distribution(0.0f, 1.0f);
-   static std::mt19937 generator;
-   return distribution(generator);
-}
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#include <immintrin.h>
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define SIMD_X86 0
+#endif
 
-inline float randomFloat(float min, float max)
+#if defined(_WIN32)
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+enum class SimdLevel
 {
-   return min + (max - min) * randomFloat();
-}
+   Scalar,
+   SSE41,
+   AVX2
+};
 
-glm::vec3 randomPointInUnitSphere()
+// Detected once, kernels are compiled for every level and picked at runtime
+SimdLevel getSimdLevel()
 {
-   while (true)
+   static SimdLevel level = []()
    {
-      glm::vec3 point = glm::vec3(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f));
-      if (glm::length(point) < 1.0f)
-         return point;
-   }
+#if SIMD_X86 && defined(_MSC_VER)
+      int info[4];
+      __cpuid(info, 1);
+      bool sse41 = (info[2] & (1 << 19)) != 0;
+      bool osAvx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+      __cpuidex(info, 7, 0);
+      bool avx2 = osAvx && (info[1] & (1 << 5)) != 0;
+      return avx2 ? SimdLevel::AVX2 : (sse41 ? SimdLevel::SSE41 : SimdLevel::Scalar);
+#elif SIMD_X86
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2"))
+         return SimdLevel::AVX2;
+      return __builtin_cpu_supports("sse4.1") ? SimdLevel::SSE41 : SimdLevel::Scalar;
+#else
+      return SimdLevel::Scalar;
+#endif
+   }();
+   return level;
 }
 
-glm::vec3 randomPointInUnitDisc()
+inline uint32_t countTrailingZeros(uint32_t value)
 {
-   while (true)
-   {
-      glm::vec3 point = glm::vec3(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), 0.0f);
-      if (glm::length2(point) < 1.0f)
-         return point;
-   }
+#if defined(_MSC_VER)
+   unsigned long index;
+   _BitScanForward(&index, value);
+   return index;
+#else
+   return __builtin_ctz(value);
+#endif
 }
 
-glm::vec3 refract(const glm::vec3& uv, const glm::vec3& n, float etaiOverEtat)
+inline uint32_t countLeadingZeros(uint32_t value)
 {
-   float cosTheta = glm::min<float>(glm::dot(-uv, n), 1.0f);
-   glm::vec3 rOutPerp = etaiOverEtat * (uv + cosTheta * n);
-   glm::vec3 rOutParallel = -glm::sqrt(glm::abs<float>(1.0f - glm::length2(rOutPerp))) * n;
-   return rOutPerp + rOutParallel;
+#if defined(_MSC_VER)
+   unsigned long index;
+   _BitScanReverse(&index, value);
+   return 31 - index;
+#else
+   return __builtin_clz(value);
+#endif
 }
 
-struct Image
+// Splits [0, count) into one contiguous chunk per thread and runs func(begin, end, thread) on
+// each. The split only depends on the arguments, so passes over the same data line up.
+template<typename Func>
+void parallelFor(uint32_t numThreads, size_t count, Func&& func, size_t minChunkSize = 4096)
 {
-   Image(uint32_t width, uint32_t height) 
+   numThreads = (uint32_t)glm::max<size_t>(1, glm::min<size_t>(numThreads, count / minChunkSize));
+   if (numThreads == 1)
    {
-      this->width = width;
-      this->height = height;
-      pixels.resize(width * height);
+      func((size_t)0, count, 0u);
+      return;
    }
 
-   std::vector<glm::vec3> pixels;
-   uint32_t width;
-   uint32_t height;
-};
+   std::vector<std::thread> threads;
+   for (uint32_t thread = 0; thread < numThreads; thread++)
+      threads.push_back(std::thread(func, count * thread / numThreads, count * (thread + 1) / numThreads, thread));
+   std::for_each(threads.begin(), threads.end(), [](std::thread& t) { t.join(); });
+}
 
-struct Ray
+// Allocator for std::vector storage that SIMD kernels stream through
+template<typename T, size_t Alignment = 64>
+struct AlignedAllocator
 {
-   Ray() {}
-   Ray(glm::vec3 origin, glm::vec3 dir)
+   typedef T value_type;
+
+   AlignedAllocator() {}
+   template<typename U> AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+   template<typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+   T* allocate(size_t count)
    {
-      this->origin = origin;
-      this->dir = dir;
+      return (T*)::operator new(count * sizeof(T), std::align_val_t(Alignment));
    }
 
-   glm::vec3 at(float t) const
+   void deallocate(T* pointer, size_t)
    {
-      return origin + t * dir;
+      ::operator delete(pointer, std::align_val_t(Alignment));
    }
 
-   glm::vec3 origin;
-   glm::vec3 dir;
+   bool operator==(const AlignedAllocator&) const { return true; }
+   bool operator!=(const AlignedAllocator&) const { return false; }
 };
 
-class Camera
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// 64-bit FNV-1a, chain calls by passing the previous result as hash
+inline uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+   const uint8_t* bytes = (const uint8_t*)data;
+   for (size_t i = 0; i < size; i++)
+      hash = (hash ^ bytes[i]) * 1099511628211ull;
+   return hash;
+}
+
+// Read-only memory mapping of a whole file. Pages are loaded on first access, so opening
+// costs the same no matter how large the file is.
+class MappedFile
 {
 public:
-   Camera(glm::vec3 lookFrom, glm::vec3 lookAt, float verticalFov, float aspectRatio, float aperture, float focusDist)
+   MappedFile() {}
+   MappedFile(const MappedFile&) = delete;
+   MappedFile& operator=(const MappedFile&) = delete;
+   ~MappedFile() { close(); }
+
+   bool open(const std::string& filename)
    {
-      float theta = glm::radians(verticalFov);
-      float h = glm::tan(theta / 2.0f);
-      float viewportHeight = 2.0f * h;
-      float viewportWidth = viewportHeight * aspectRatio;
+      close();
+#if defined(_WIN32)
+      file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+         return false;
 
-      float focalLength = 1.0f;
-      glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
-      w = glm::normalize(lookFrom - lookAt);
-      u = glm::normalize(glm::cross(up, w));
-      v = glm::cross(w, u);
+      LARGE_INTEGER fileSize;
+      mapping = GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+      data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+      size = data ? (size_t)fileSize.QuadPart : 0;
+#else
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd < 0)
+         return false;
 
-      origin = lookFrom;
-      horizontal = focusDist * u * viewportWidth;
-      vertical = focusDist * v * viewportHeight;
-      lowerLeftCorner = origin - (horizontal / 2.0f) - (vertical / 2.0f) - (focusDist * w);
-      lensRadius = aperture / 2.0f;
+      struct stat status;
+      if (fstat(fd, &status) == 0 && status.st_size > 0)
+      {
+         void* address = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (address != MAP_FAILED)
+         {
+            data = address;
+            size = (size_t)status.st_size;
+         }
+      }
+      ::close(fd);
+#endif
+      if (!data)
+         close();
+      return data != nullptr;
    }
 
-   Ray getRay(float s, float t) const
+   void close()
    {
-      glm::vec3 rd = lensRadius * randomPointInUnitDisc();
-      glm::vec3 offset = u * rd.x + v * rd.y;
-      return Ray(origin + offset, lowerLeftCorner + s * horizontal + t * vertical - origin - offset);
+#if defined(_WIN32)
+      if (data)
+         UnmapViewOfFile(data);
+      if (mapping)
+         CloseHandle(mapping);
+      if (file != INVALID_HANDLE_VALUE)
+         CloseHandle(file);
+      mapping = nullptr;
+      file = INVALID_HANDLE_VALUE;
+#else
+      if (data)
+         munmap(data, size);
+#endif
+      data = nullptr;
+      size = 0;
    }
 
-   glm::vec3 origin;
-   glm::vec3 horizontal;
-   glm::vec3 vertical;
-   glm::vec3 lowerLeftCorner;
-   glm::vec3 u, v, w;
-   float lensRadius;
-};
+   const uint8_t* bytes() const { return (const uint8_t*)data; }
+   size_t fileSize() const { return size; }
 
-struct Material;
+private:
+   void* data = nullptr;
+   size_t size = 0;
+#if defined(_WIN32)
+   HANDLE file = INVALID_HANDLE_VALUE;
+   HANDLE mapping = nullptr;
+#endif
+};
 
-struct HitRecord
+// PCG32 generator (pcg-random.org). Cheap enough to create one per sample, which
+// keeps renders reproducible regardless of thread count and scheduling.
+struct RandomGenerator
 {
-   inline void setFaceNormal(const Ray& ray, glm::vec3 outwardNormal)
+   RandomGenerator(uint64_t seed, uint64_t sequence = 0)
    {
-      frontFace = glm::dot(ray.dir, outwardNormal) < 0.0f;
-      normal = frontFace ? outwardNormal : -outwardNormal;
+      state = 0;
+      increment = (sequence << 1) | 1;
+      nextUint();
+      state += seed;
+      nextUint();
    }
 
-   std::shared_ptr<Material> material;
-   glm::vec3 pos;
-   glm::vec3 normal;
-   float t;
-   bool frontFace;
+   // Seeds a generator for one sample of one pixel, frame allows decorrelating successive renders
+   static RandomGenerator forSample(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t frameIndex)
+   {
+      return RandomGenerator(mix(((uint64_t)frameIndex << 32) | pixelIndex), sampleIndex);
+   }
+
+   // splitmix64 finalizer, spreads neighbouring pixel indices over the whole state space
+   static uint64_t mix(uint64_t value)
+   {
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+      return value ^ (value >> 31);
+   }
+
+   uint32_t nextUint()
+   {
+      uint64_t oldState = state;
+      state = oldState * 6364136223846793005ull + increment;
+      uint32_t xorShifted = (uint32_t)(((oldState >> 18u) ^ oldState) >> 27u);
+      uint32_t rotation = (uint32_t)(oldState >> 59u);
+      return (xorShifted >> rotation) | (xorShifted << ((~rotation + 1u) & 31));
+   }
+
+   // Uniform in [0, 1)
+   float nextFloat()
+   {
+      return (nextUint() >> 8) * (1.0f / 16777216.0f);
+   }
+
+   uint64_t state;
+   uint64_t increment;
 };
 
-class Material
+inline float randomFloat(RandomGenerator& rng)
 {
-public:
-   virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay) const = 0;
-};
+   return rng.nextFloat();
+}
 
-class Lambertian : public Material
+inline float randomFloat(RandomGenerator& rng, float min, float max)
 {
-public:
-   Lambertian(glm::vec3 color) : albedo(color) {}
+   return min + (max - min) * randomFloat(rng);
+}
 
-   virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay) const override
-   {
-      // Note: randomPointInUnitSphere() can be replaced by other distributions,
-      // see chapter 8.5 in the tutorial.
-      glm::vec3 scatterDirection = hitRecord.normal + randomPointInUnitSphere();
+inline uint32_t reverseBits(uint32_t value)
+{
+   value = (value << 16) | (value >> 16);
+   value = ((value & 0x00ff00ffu) << 8) | ((value & 0xff00ff00u) >> 8);
+   value = ((value & 0x0f0f0f0fu) << 4) | ((value & 0xf0f0f0f0u) >> 4);
+   value = ((value & 0x33333333u) << 2) | ((value & 0xccccccccu) >> 2);
+   value = ((value & 0x55555555u) << 1) | ((value & 0xaaaaaaaau) >> 1);
+   return value;
+}
 
-      if (glm::length(scatterDirection) < FLT_EPSILON)
-         scatterDirection = hitRecord.normal;
+inline uint32_t hashCombine(uint32_t a, uint32_t b)
+{
+   return (uint32_t)RandomGenerator::mix(((uint64_t)a << 32) | b);
+}
 
-      scatteredRay = Ray(hitRecord.pos, scatterDirection);
-      attenuation = albedo;
-      return true;
-   }
+// Maps 32 random bits to [0, 1) without rounding up to 1
+inline float bitsToFloat(uint32_t bits)
+{
+   return (bits >> 8) * (1.0f / 16777216.0f);
+}
 
-   glm::vec3 albedo;
+enum class SamplerType
+{
+   Random,     // Independent uniform numbers from the per-sample generator
+   Stratified, // Correlated multi-jittered, stratified in 2D and in both 1D projections
+   Halton,     // Halton sequence with a per pixel Cranley-Patterson rotation
+   Sobol,      // Owen-scrambled and shuffled Sobol (0,2) sequence
+   BlueNoise   // Rank-1 lattice sequence, shifted per pixel by a blue noise dither mask
+};
+
+// The pixel sample a sampler is asked about. The seed decorrelates pixels and frames.
+struct PixelSample
+{
+   uint32_t x;
+   uint32_t y;
+   uint32_t sampleIndex;
+   uint32_t seed;
 };
 
-class Metal : public Material
+// A sampler turns (pixel sample, dimension) into a point in [0, 1)^2. Dimensions are counted
+// per draw, a 1D draw takes the first component of its own dimension. The generator of the
+// sample is passed in for samplers that need random numbers or run out of dimensions.
+class Sampler
 {
 public:
-   Metal(glm::vec3 color, float f) : albedo(color), fuzz(f) {}
+   virtual ~Sampler() {}
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const = 0;
 
-   virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay) const override
+   virtual float sample1D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const
    {
-      glm::vec3 reflected = glm::reflect(glm::normalize(inputRay.dir), hitRecord.normal);
-      scatteredRay = Ray(hitRecord.pos, reflected + fuzz * randomPointInUnitSphere());
-      attenuation = albedo;
-      return (glm::dot(scatteredRay.dir, hitRecord.normal) > 0);
+      return sample2D(pixel, dimension, rng).x;
    }
-
-   glm::vec3 albedo;
-   float fuzz;
 };
 
-class Dielectric : public Material
+class RandomSampler : public Sampler
 {
 public:
-   Dielectric(float indexOfRefraction) : ir(indexOfRefraction) {}
-
-   virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay) const override
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      attenuation = glm::vec3(1.0f);
-      float refractionRatio = hitRecord.frontFace ? (1.0f / ir) : ir;
-
-      glm::vec3 normalizedDirection = glm::normalize(inputRay.dir);
-      float cosTheta = glm::min<float>(glm::dot(-normalizedDirection, hitRecord.normal), 1.0f);
-      float sinTheta = glm::sqrt(1.0f - cosTheta * cosTheta);
-
-      bool cannotRefract = ((refractionRatio * sinTheta) > 1.0f);
-      glm::vec3 direction;
-
-      if (cannotRefract || (calcReflectance(cosTheta, refractionRatio) > randomFloat()))
-         direction = reflect(normalizedDirection, hitRecord.normal);
-      else
-         direction = refract(normalizedDirection, hitRecord.normal, refractionRatio);
-
-      scatteredRay = Ray(hitRecord.pos, direction);
-      return true;
+      float x = randomFloat(rng);
+      float y = randomFloat(rng);
+      return glm::vec2(x, y);
    }
 
-   float calcReflectance(float cosine, float refIdx) const
+   virtual float sample1D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      // Schlick's approximation
-      float r0 = (1.0f - refIdx) / (1.0f + refIdx);
-      r0 = r0 * r0;
-      return r0 + (1.0f - r0) * glm::pow((1.0f - cosine), 5.0f);
+      return randomFloat(rng);
    }
-
-   float ir;
-};
-
-class Object
-{
-public:
-   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) = 0;
 };
 
-class Sphere : public Object
+// Correlated multi-jittered sampling (Kensler 2013). Every dimension uses its own permutation of
+// an m x n grid of samplesPerPixel or more cells, sample indices are shuffled so that the first
+// samples of a pixel stay well spread when adaptive sampling stops early.
+class StratifiedSampler : public Sampler
 {
 public:
-   Sphere(glm::vec3 center, float radius, std::shared_ptr<Material> material)
+   StratifiedSampler(uint32_t samplesPerPixel)
    {
-      this->center = center;
-      this->radius = radius;
-      this->material = material;
+      columns = glm::max(1u, (uint32_t)glm::sqrt((float)samplesPerPixel));
+      rows = (samplesPerPixel + columns - 1) / columns;
    }
 
-   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) override
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      glm::vec3 originToCenter = ray.origin - center;
-      float a = glm::length2(ray.dir);
-      float half_b = glm::dot(originToCenter, ray.dir);
-      float c = glm::length2(originToCenter) - radius * radius;
-      float discriminant = half_b * half_b - a * c;
+      const uint32_t cells = columns * rows;
+      uint32_t pattern = hashCombine(hashCombine(pixel.seed, dimension), pixel.sampleIndex / cells);
+      uint32_t index = permute(pixel.sampleIndex % cells, cells, pattern * 0x51633e2du);
 
-      if (discriminant < 0)
-         return false;
+      uint32_t column = index % columns;
+      uint32_t row = index / columns;
+      uint32_t shuffledColumn = permute(column, columns, pattern * 0x68bc21ebu);
+      uint32_t shuffledRow = permute(row, rows, pattern * 0x02e5be93u);
+      float jitterX = randomUnit(index, pattern * 0x967a889bu);
+      float jitterY = randomUnit(index, pattern * 0x368cc8b7u);
 
-      float sqrtd = glm::sqrt(discriminant);
+      float x = (column + (shuffledRow + jitterX) / rows) / columns;
+      float y = (row + (shuffledColumn + jitterY) / columns) / rows;
+      return glm::vec2(glm::min(x, 0.99999994f), glm::min(y, 0.99999994f));
+   }
 
-      // Find nearest root in the acceptable range
-      float root = (-half_b - sqrtd) / a;
-      if (root < t_min || root > t_max)
+private:
+   // Pseudo-random permutation of [0, length) selected by pattern
+   static uint32_t permute(uint32_t i, uint32_t length, uint32_t pattern)
+   {
+      uint32_t mask = length - 1;
+      mask |= mask >> 1;
+      mask |= mask >> 2;
+      mask |= mask >> 4;
+      mask |= mask >> 8;
+      mask |= mask >> 16;
+
+      // Bijection on [0, mask], walked until it lands inside [0, length)
+      do
       {
-         root = (-half_b + sqrtd) / a;
-         if (root < t_min || root > t_max)
-            return false;
-      }
+         i ^= pattern; i *= 0xe170893du;
+         i ^= pattern >> 16;
+         i ^= (i & mask) >> 4;
+         i ^= pattern >> 8; i *= 0x0929eb3fu;
+         i ^= pattern >> 23;
+         i ^= (i & mask) >> 1; i *= 1 | pattern >> 27;
+         i *= 0x6935fa69u;
+         i ^= (i & mask) >> 11; i *= 0x74dcb303u;
+         i ^= (i & mask) >> 2; i *= 0x9e501cc3u;
+         i ^= (i & mask) >> 2; i *= 0xc860a3dfu;
+         i &= mask;
+         i ^= i >> 5;
+      } while (i >= length);
 
-      hitRecord.t = root;
-      hitRecord.pos = ray.at(hitRecord.t);
-      glm::vec3 outwardNormal = (hitRecord.pos - center) / radius;
-      hitRecord.setFaceNormal(ray, outwardNormal);
-      hitRecord.material = material;
+      return (i + pattern) % length;
+   }
 
-      return true;
+   static float randomUnit(uint32_t i, uint32_t pattern)
+   {
+      i ^= pattern;
+      i ^= i >> 17; i ^= i >> 10; i *= 0xb36534e5u;
+      i ^= i >> 12; i ^= i >> 21; i *= 0x93fc4795u;
+      i ^= 0xdf6e307fu; i ^= i >> 17; i *= 1 | pattern >> 18;
+      return bitsToFloat(i);
    }
 
-   std::shared_ptr<Material> material;
-   glm::vec3 center;
-   float radius;
+   uint32_t columns;
+   uint32_t rows;
 };
 
-class World
+// Halton sequence, dimension d uses the primes 2d and 2d + 1 as bases. Every pixel gets its own
+// toroidal shift so neighbours don't share their error pattern. The prime table covers the camera
+// and the first bounces, the generator takes over after that.
+class HaltonSampler : public Sampler
 {
 public:
-   void addObject(std::shared_ptr<Object> object)
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      objects.push_back(object);
+      if (2 * dimension + 1 >= numPrimes)
+      {
+         float x = randomFloat(rng);
+         float y = randomFloat(rng);
+         return glm::vec2(x, y);
+      }
+
+      uint32_t shift = hashCombine(pixel.seed, dimension);
+      float x = radicalInverse(pixel.sampleIndex, primes[2 * dimension]) + bitsToFloat(shift);
+      float y = radicalInverse(pixel.sampleIndex, primes[2 * dimension + 1]) + bitsToFloat(hashCombine(shift, 1));
+      x -= glm::floor(x);
+      y -= glm::floor(y);
+      return glm::vec2(glm::min(x, 0.99999994f), glm::min(y, 0.99999994f));
    }
 
-   bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) const
-   {
-      bool hitAnything = false;
-      float closestHit = t_max;
+private:
+   static const uint32_t numPrimes = 32;
+   static constexpr uint32_t primes[numPrimes] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+                                                   59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131 };
 
-      for (const auto& object : objects)
+   static float radicalInverse(uint32_t index, uint32_t base)
+   {
+      double inverseBase = 1.0 / base;
+      double scale = inverseBase;
+      double result = 0.0;
+      while (index > 0)
       {
-         HitRecord tempRecord;
-         if (object->hit(ray, t_min, closestHit, tempRecord))
-         {
-            hitAnything = true;
-            hitRecord = tempRecord;
-            closestHit = tempRecord.t;
-         }
+         result += (index % base) * scale;
+         index /= base;
+         scale *= inverseBase;
       }
-
-      return hitAnything;
+      return (float)result;
    }
-private:
-   std::vector<std::shared_ptr<Object>> objects;
 };
 
-void writeImage(std::string filename, Image& image)
+// Nested uniform scrambling of the bits of a base 2 digit sequence, an Owen scramble with hashed
+// flips (Burley 2020, "Practical Hash-based Owen Scrambling")
+inline uint32_t nestedUniformScramble(uint32_t value, uint32_t seed)
 {
-   std::ofstream fout = std::ofstream(filename);
-
-   fout << "P3" << std::endl;
-   fout << image.width << " " << image.height << std::endl;
-   fout << 255 << std::endl;
+   value = reverseBits(value);
+   value ^= value * 0x3d20adeau;
+   value += seed;
+   value *= (seed >> 16) | 1;
+   value ^= value * 0x05526c56u;
+   value ^= value * 0x53a22864u;
+   return reverseBits(value);
+}
 
-   for (int32_t y = image.height-1; y >= 0; y--)
+// The first two Sobol dimensions form a (0,2) sequence. Every dimension shuffles the sample
+// index and Owen-scrambles the points with its own seed (Burley 2020), which pads the sequence
+// to any number of dimensions without a direction number table.
+class SobolSampler : public Sampler
+{
+public:
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      for (uint32_t x = 0; x < image.width; x++)
+      uint32_t seed = hashCombine(pixel.seed, dimension);
+      uint32_t index = nestedUniformScramble(pixel.sampleIndex, seed);
+
+      uint32_t x = reverseBits(index);
+      uint32_t y = 0;
+      for (uint32_t direction = 1u << 31; index != 0; index >>= 1, direction ^= direction >> 1)
       {
-         glm::vec3 color = image.pixels[y * image.width + x];
-         glm::ivec3 colorInt = color * glm::vec3(256.0f);
-         fout << colorInt.x << " " << colorInt.y << " " << colorInt.z << " ";
+         if (index & 1)
+            y ^= direction;
       }
 
-      fout << std::endl;
+      return glm::vec2(bitsToFloat(nestedUniformScramble(x, hashCombine(seed, 0))), bitsToFloat(nestedUniformScramble(y, hashCombine(seed, 1))));
    }
+};
 
-   fout.close();
-}
-
-glm::vec3 rayColor(const Ray& ray, const World& world, int32_t depth)
+// Rank-1 lattice sequence with a Korobov generator, point i is frac(phi2(i) * (1, 182667)).
+// All pixels share the sequence of a dimension and are shifted by an R2 dither mask, which
+// has blue noise like spectral properties, so the remaining error of neighbouring pixels is
+// anti-correlated and reads as fine grain instead of clumps.
+class BlueNoiseSampler : public Sampler
 {
-   HitRecord hitRecord;
-
-   if (depth <= 0)
-      return glm::vec3(0.0f);
-
-   const float shadowAcneConstant = 0.001f;
-   if (world.hit(ray, shadowAcneConstant, 100.0f, hitRecord))
+public:
+   virtual glm::vec2 sample2D(const PixelSample& pixel, uint32_t dimension, RandomGenerator& rng) const override
    {
-      Ray scatteredRay;
-      glm::vec3 attenuation;
-
-      if (hitRecord.material->scatter(ray, hitRecord, attenuation, scatteredRay))
-         return attenuation * rayColor(scatteredRay, world, depth - 1);
+      uint32_t index = nestedUniformScramble(pixel.sampleIndex, hashCombine(dimension, 0x9e3779b9u));
+      double phi = reverseBits(index) * (1.0 / 4294967296.0);
 
-      return glm::vec3(0.0f);
+      double shiftX = 0.7548776662466927 * pixel.x + 0.5698402909980532 * pixel.y + bitsToFloat(hashCombine(dimension, 0));
+      double shiftY = 0.5698402909980532 * pixel.x + 0.7548776662466927 * pixel.y + bitsToFloat(hashCombine(dimension, 1));
+      double x = phi + shiftX;
+      double y = phi * 182667.0 + shiftY;
+      x -= glm::floor(x);
+      y -= glm::floor(y);
+      return glm::vec2(glm::min((float)x, 0.99999994f), glm::min((float)y, 0.99999994f));
    }
+};
 
-   glm::vec3 unitDir = glm::normalize(ray.dir);
-   float t = 0.5f * (unitDir.y + 1.0f);
+const SamplerType samplerTypes[] = { SamplerType::Random, SamplerType::Stratified, SamplerType::Halton, SamplerType::Sobol, SamplerType::BlueNoise };
+
+const char* samplerName(SamplerType type)
+{
+   switch (type)
+   {
+   case SamplerType::Stratified: return "stratified";
+   case SamplerType::Halton:     return "halton";
+   case SamplerType::Sobol:      return "sobol";
+   case SamplerType::BlueNoise:  return "bluenoise";
+   default:                      return "random";
+   }
+}
 
-   return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+std::unique_ptr<Sampler> createSampler(SamplerType type, uint32_t samplesPerPixel)
+{
+   switch (type)
+   {
+   case SamplerType::Stratified: return std::make_unique<StratifiedSampler>(samplesPerPixel);
+   case SamplerType::Halton:     return std::make_unique<HaltonSampler>();
+   case SamplerType::Sobol:      return std::make_unique<SobolSampler>();
+   case SamplerType::BlueNoise:  return std::make_unique<BlueNoiseSampler>();
+   default:                      return std::make_unique<RandomSampler>();
+   }
 }
 
-void render(Image& image, const World& world, const Camera& camera, uint32_t samplesPerPixel, int32_t maxDepth, uint32_t numThreads)
+// The sampling dimensions of one pixel sample, handed out in a fixed layout: image plane and
+// lens first, then a fixed budget per bounce for the light sample, the scattered direction
+// and Russian roulette. Draws beyond the budget of a bounce, e.g. the retries of rejection
+// sampling, come from the generator.
+class SampleStream
 {
-   std::cout << "Rendering using " << numThreads << " threads";
+public:
+   static const uint32_t cameraDimensions = 2;
+   static const uint32_t dimensionsPerBounce = 5;
 
-   auto work = [&](int32_t startRow, uint32_t numRows)
+   SampleStream(const Sampler& sampler, uint32_t x, uint32_t y, uint32_t width, uint32_t sampleIndex, uint32_t frameIndex)
+      : rng(RandomGenerator::forSample(y * width + x, sampleIndex, frameIndex)), sampler(&sampler)
    {
-      for (int32_t y = startRow; y < (startRow + numRows); y++)
-      {
-         for (uint32_t x = 0; x < image.width; x++)
-         {
-            glm::vec3 color = glm::vec3(0.0f);
-            for (uint32_t s = 0; s < samplesPerPixel; s++)
-            {
-               float u = ((float)x + randomFloat(0.0f, 1.0f)) / (image.width - 1);
-               float v = ((float)y + randomFloat(0.0f, 1.0f)) / (image.height - 1);
-               Ray ray = camera.getRay(u, v);
-               color += rayColor(ray, world, maxDepth);
-            }
+      pixel = { x, y, sampleIndex, hashCombine(frameIndex, y * width + x) };
+   }
 
-            color = color / glm::vec3(samplesPerPixel);
-            color = glm::sqrt(color); // Gamma correction
-            color = glm::clamp(color, glm::vec3(0.0f), glm::vec3(0.999f));
-            image.pixels[y * image.width + x] = color;
-         }
-         std::cout << "." << std::flush;
-      }
-   };
+   // Moves on to the dimensions of the given bounce
+   void startBounce(int32_t depth)
+   {
+      dimension = cameraDimensions + depth * dimensionsPerBounce;
+      dimensionLimit = dimension + dimensionsPerBounce;
+   }
 
-   const uint32_t rowsPerThread = image.height / numThreads;
-   std::vector<std::thread> workerThreads;
+   float next1D()
+   {
+      if (dimension < dimensionLimit)
+         return sampler->sample1D(pixel, dimension++, rng);
+      return randomFloat(rng);
+   }
 
-   for (uint32_t i = 0; i < numThreads; i++)
+   glm::vec2 next2D()
    {
-      uint32_t rowsToProcess = rowsPerThread;
-      if (i == (numThreads - 1))
-         rowsToProcess = image.height - ((numThreads - 1) * rowsToProcess);
+      if (dimension < dimensionLimit)
+         return sampler->sample2D(pixel, dimension++, rng);
 
-      workerThreads.push_back(std::thread(work, i * rowsPerThread, rowsToProcess));
+      float x = randomFloat(rng);
+      float y = randomFloat(rng);
+      return glm::vec2(x, y);
    }
 
-   // Wait for all workers to finish
-   std::for_each(workerThreads.begin(), workerThreads.end(), [](std::thread& t) { t.join(); });
+   RandomGenerator rng;
 
-   std::cout << std::endl << "Rendering done!" << std::endl;
-}
+private:
+   const Sampler* sampler;
+   PixelSample pixel;
+   uint32_t dimension = 0;
+   uint32_t dimensionLimit = cameraDimensions;
+};
 
-World createRandomScene()
+// Closed-form mappings from [0, 1)^2 to sphere, ball and disc. They are branch free and only use
+// multiplies, adds, divides and square roots, so the 8-wide versions below compute the very
+// same values for a batch of rays.
+inline float polynomialStep(float x2, float k, float inner)
 {
-   World world;
+   return 1.0f - x2 * k * inner;
+}
 
-   auto groundMaterial = std::make_shared<Lambertian>(glm::vec3(0.5f, 0.5f, 0.5f));
-   auto lambertianMaterial = std::make_shared<Lambertian>(glm::vec3(0.4f, 0.2f, 0.1f));
-   auto dielectricMaterial = std::make_shared<Dielectric>(1.5f);
-   auto metalMaterial = std::make_shared<Metal>(glm::vec3(0.7f, 0.6f, 0.5f), 0.0f);
+// sin and cos of x in [-pi/2, pi/2] from Taylor polynomials, within 5e-7 of the exact values
+inline void sinCos(float x, float& sine, float& cosine)
+{
+   float x2 = x * x;
+   sine = x * polynomialStep(x2, 1.0f / 6.0f, polynomialStep(x2, 1.0f / 20.0f, polynomialStep(x2, 1.0f / 42.0f, polynomialStep(x2, 1.0f / 72.0f, polynomialStep(x2, 1.0f / 110.0f, 1.0f)))));
+   cosine = polynomialStep(x2, 1.0f / 2.0f, polynomialStep(x2, 1.0f / 12.0f, polynomialStep(x2, 1.0f / 30.0f, polynomialStep(x2, 1.0f / 56.0f, polynomialStep(x2, 1.0f / 90.0f, 1.0f)))));
+}
+
+// Cube root of value in [0, 1) from an exponent estimate and two Newton steps
+inline float cubeRoot(float value)
+{
+   int32_t bits;
+   std::memcpy(&bits, &value, sizeof(bits));
+   bits = (int32_t)((float)bits * (1.0f / 3.0f)) + 709921077;
+   float root;
+   std::memcpy(&root, &bits, sizeof(root));
+
+   for (int32_t i = 0; i < 2; i++)
+      root = (2.0f * root + value / (root * root)) * (1.0f / 3.0f);
+   return root;
+}
+
+// Uniform direction, z is uniform in [-1, 1] and the azimuth comes from the half angle
+// identities so sinCos() only needs [-pi/2, pi/2]
+inline glm::vec3 uniformSphere(const glm::vec2& u)
+{
+   float z = 1.0f - 2.0f * u.x;
+   float r = glm::sqrt(glm::max(0.0f, 1.0f - z * z));
+   float halfSine, halfCosine;
+   sinCos(glm::pi<float>() * (u.y - 0.5f), halfSine, halfCosine);
+   return glm::vec3(r * (1.0f - 2.0f * halfSine * halfSine), r * (2.0f * halfSine * halfCosine), z);
+}
+
+// Shirley and Chiu's concentric mapping keeps the strata of the square intact on the disc
+inline glm::vec2 concentricDisc(const glm::vec2& u)
+{
+   float a = 2.0f * u.x - 1.0f;
+   float b = 2.0f * u.y - 1.0f;
+   bool horizontal = glm::abs(a) > glm::abs(b);
+   float r = horizontal ? a : b;
+   float ratio = (horizontal ? b : a) / (r != 0.0f ? r : 1.0f);
+
+   float sine, cosine;
+   sinCos(glm::pi<float>() / 4.0f * ratio, sine, cosine);
+   return horizontal ? glm::vec2(r * cosine, r * sine) : glm::vec2(r * sine, r * cosine);
+}
+
+// Uniform direction in the cone around z with the given opening, cosThetaMax close to 1 keeps
+// its precision through 1 - cosThetaMax = oneMinusCosThetaMax
+inline glm::vec3 uniformCone(const glm::vec2& u, float oneMinusCosThetaMax)
+{
+   float z = 1.0f - u.x * oneMinusCosThetaMax;
+   float r = glm::sqrt(glm::max(0.0f, 1.0f - z * z));
+   float halfSine, halfCosine;
+   sinCos(glm::pi<float>() * (u.y - 0.5f), halfSine, halfCosine);
+   return glm::vec3(r * (1.0f - 2.0f * halfSine * halfSine), r * (2.0f * halfSine * halfCosine), z);
+}
+
+// Rotates a direction given around z to the same direction around axis, using the branchless
+// orthonormal basis of Duff et al. 2017
+inline glm::vec3 alignToAxis(const glm::vec3& local, const glm::vec3& axis)
+{
+   float sign = axis.z >= 0.0f ? 1.0f : -1.0f;
+   float a = -1.0f / (sign + axis.z);
+   float b = axis.x * axis.y * a;
+   glm::vec3 tangent = glm::vec3(1.0f + sign * axis.x * axis.x * a, sign * b, -sign * axis.x);
+   glm::vec3 bitangent = glm::vec3(b, sign + axis.y * axis.y * a, -axis.y);
+   return local.x * tangent + local.y * bitangent + local.z * axis;
+}
+
+// Unit length, adding it to a normal gives a cosine distributed direction around the normal
+glm::vec3 randomUnitVector(SampleStream& stream)
+{
+   return uniformSphere(stream.next2D());
+}
+
+glm::vec3 randomPointInUnitSphere(SampleStream& stream)
+{
+   glm::vec3 direction = uniformSphere(stream.next2D());
+   return direction * cubeRoot(stream.next1D());
+}
+
+#if SIMD_X86
+TARGET_AVX2 inline __m256 polynomialStep8(__m256 x2, float k, __m256 inner)
+{
+   return _mm256_sub_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(_mm256_mul_ps(x2, _mm256_set1_ps(k)), inner));
+}
+
+TARGET_AVX2 inline void sinCos8(__m256 x, __m256& sine, __m256& cosine)
+{
+   const __m256 one = _mm256_set1_ps(1.0f);
+   __m256 x2 = _mm256_mul_ps(x, x);
+   sine = _mm256_mul_ps(x, polynomialStep8(x2, 1.0f / 6.0f, polynomialStep8(x2, 1.0f / 20.0f, polynomialStep8(x2, 1.0f / 42.0f, polynomialStep8(x2, 1.0f / 72.0f, polynomialStep8(x2, 1.0f / 110.0f, one))))));
+   cosine = polynomialStep8(x2, 1.0f / 2.0f, polynomialStep8(x2, 1.0f / 12.0f, polynomialStep8(x2, 1.0f / 30.0f, polynomialStep8(x2, 1.0f / 56.0f, polynomialStep8(x2, 1.0f / 90.0f, one)))));
+}
+
+// uniformSphere() for 8 points, inputs and outputs are structure of arrays
+TARGET_AVX2 void uniformSphere8(const float* u, const float* v, float* x, float* y, float* z)
+{
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 two = _mm256_set1_ps(2.0f);
+   __m256 cosTheta = _mm256_sub_ps(one, _mm256_mul_ps(two, _mm256_loadu_ps(u)));
+   __m256 r = _mm256_sqrt_ps(_mm256_max_ps(_mm256_setzero_ps(), _mm256_sub_ps(one, _mm256_mul_ps(cosTheta, cosTheta))));
+
+   __m256 halfSine, halfCosine;
+   sinCos8(_mm256_mul_ps(_mm256_set1_ps(glm::pi<float>()), _mm256_sub_ps(_mm256_loadu_ps(v), _mm256_set1_ps(0.5f))), halfSine, halfCosine);
+   __m256 cosPhi = _mm256_sub_ps(one, _mm256_mul_ps(_mm256_mul_ps(two, halfSine), halfSine));
+   __m256 sinPhi = _mm256_mul_ps(_mm256_mul_ps(two, halfSine), halfCosine);
+
+   _mm256_storeu_ps(x, _mm256_mul_ps(r, cosPhi));
+   _mm256_storeu_ps(y, _mm256_mul_ps(r, sinPhi));
+   _mm256_storeu_ps(z, cosTheta);
+}
+
+// concentricDisc() for 8 points, inputs and outputs are structure of arrays
+TARGET_AVX2 void concentricDisc8(const float* u, const float* v, float* x, float* y)
+{
+   const __m256 one = _mm256_set1_ps(1.0f);
+   const __m256 two = _mm256_set1_ps(2.0f);
+   const __m256 signMask = _mm256_set1_ps(-0.0f);
+   __m256 a = _mm256_sub_ps(_mm256_mul_ps(two, _mm256_loadu_ps(u)), one);
+   __m256 b = _mm256_sub_ps(_mm256_mul_ps(two, _mm256_loadu_ps(v)), one);
+   __m256 horizontal = _mm256_cmp_ps(_mm256_andnot_ps(signMask, a), _mm256_andnot_ps(signMask, b), _CMP_GT_OQ);
+   __m256 r = _mm256_blendv_ps(b, a, horizontal);
+   __m256 numerator = _mm256_blendv_ps(a, b, horizontal);
+   __m256 denominator = _mm256_blendv_ps(r, one, _mm256_cmp_ps(r, _mm256_setzero_ps(), _CMP_EQ_OQ));
+
+   __m256 sine, cosine;
+   sinCos8(_mm256_mul_ps(_mm256_set1_ps(glm::pi<float>() / 4.0f), _mm256_div_ps(numerator, denominator)), sine, cosine);
+   __m256 rCosine = _mm256_mul_ps(r, cosine);
+   __m256 rSine = _mm256_mul_ps(r, sine);
+   _mm256_storeu_ps(x, _mm256_blendv_ps(rSine, rCosine, horizontal));
+   _mm256_storeu_ps(y, _mm256_blendv_ps(rCosine, rSine, horizontal));
+}
+#endif
+
+// Maps count points, 8 at a time where the CPU supports AVX2
+void concentricDiscBatch(const float* u, const float* v, float* x, float* y, uint32_t count)
+{
+   uint32_t i = 0;
+#if SIMD_X86
+   if (getSimdLevel() == SimdLevel::AVX2)
+   {
+      for (; i + 8 <= count; i += 8)
+         concentricDisc8(u + i, v + i, x + i, y + i);
+   }
+#endif
+   for (; i < count; i++)
+   {
+      glm::vec2 point = concentricDisc(glm::vec2(u[i], v[i]));
+      x[i] = point.x;
+      y[i] = point.y;
+   }
+}
+
+void uniformSphereBatch(const float* u, const float* v, float* x, float* y, float* z, uint32_t count)
+{
+   uint32_t i = 0;
+#if SIMD_X86
+   if (getSimdLevel() == SimdLevel::AVX2)
+   {
+      for (; i + 8 <= count; i += 8)
+         uniformSphere8(u + i, v + i, x + i, y + i, z + i);
+   }
+#endif
+   for (; i < count; i++)
+   {
+      glm::vec3 direction = uniformSphere(glm::vec2(u[i], v[i]));
+      x[i] = direction.x;
+      y[i] = direction.y;
+      z[i] = direction.z;
+   }
+}
+
+glm::vec3 refract(const glm::vec3& uv, const glm::vec3& n, float etaiOverEtat)
+{
+   float cosTheta = glm::min<float>(glm::dot(-uv, n), 1.0f);
+   glm::vec3 rOutPerp = etaiOverEtat * (uv + cosTheta * n);
+   glm::vec3 rOutParallel = -glm::sqrt(glm::abs<float>(1.0f - glm::length2(rOutPerp))) * n;
+   return rOutPerp + rOutParallel;
+}
+
+struct Image
+{
+   Image(uint32_t width, uint32_t height) 
+   {
+      this->width = width;
+      this->height = height;
+      pixels.resize(width * height);
+      sampleCounts.resize(width * height);
+   }
+
+   std::vector<glm::vec3> pixels;
+   std::vector<uint32_t> sampleCounts; // Samples taken per pixel
+   uint32_t width;
+   uint32_t height;
+};
+
+struct Ray
+{
+   Ray() {}
+   Ray(glm::vec3 origin, glm::vec3 dir)
+   {
+      this->origin = origin;
+      this->dir = dir;
+   }
+
+   glm::vec3 at(float t) const
+   {
+      return origin + t * dir;
+   }
+
+   glm::vec3 origin;
+   glm::vec3 dir;
+};
+
+struct AABB
+{
+   AABB() : min(FLT_MAX), max(-FLT_MAX) {}
+   AABB(glm::vec3 min, glm::vec3 max) : min(min), max(max) {}
+
+   void grow(const glm::vec3& point)
+   {
+      min = glm::min(min, point);
+      max = glm::max(max, point);
+   }
+
+   void grow(const AABB& other)
+   {
+      min = glm::min(min, other.min);
+      max = glm::max(max, other.max);
+   }
+
+   glm::vec3 centroid() const
+   {
+      return 0.5f * (min + max);
+   }
+
+   float surfaceArea() const
+   {
+      glm::vec3 extent = max - min;
+      return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+   }
+
+   // Slab test, returns the entry distance or FLT_MAX on a miss. The exit distance is widened by
+   // the rounding error of the subtraction and multiplication (Ize, "Robust BVH Ray Traversal"),
+   // so a ray through a vertex on the box surface is never culled.
+   static constexpr float robustExit = 1.0f + 2.0f * 3.0f * FLT_EPSILON;
+
+   float intersect(const Ray& ray, const glm::vec3& invDir, float t_min, float t_max) const
+   {
+      glm::vec3 t0 = (min - ray.origin) * invDir;
+      glm::vec3 t1 = (max - ray.origin) * invDir;
+      glm::vec3 tNear = glm::min(t0, t1);
+      glm::vec3 tFar = glm::max(t0, t1);
+      float entry = glm::max(t_min, glm::max(tNear.x, glm::max(tNear.y, tNear.z)));
+      float exit = glm::min(t_max, robustExit * glm::min(tFar.x, glm::min(tFar.y, tFar.z)));
+      return entry <= exit ? entry : FLT_MAX;
+   }
+
+   glm::vec3 min;
+   glm::vec3 max;
+};
+
+class Camera
+{
+public:
+   Camera(glm::vec3 lookFrom, glm::vec3 lookAt, float verticalFov, float aspectRatio, float aperture, float focusDist)
+   {
+      float theta = glm::radians(verticalFov);
+      float h = glm::tan(theta / 2.0f);
+      float viewportHeight = 2.0f * h;
+      float viewportWidth = viewportHeight * aspectRatio;
+
+      float focalLength = 1.0f;
+      glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+      w = glm::normalize(lookFrom - lookAt);
+      u = glm::normalize(glm::cross(up, w));
+      v = glm::cross(w, u);
+
+      origin = lookFrom;
+      horizontal = focusDist * u * viewportWidth;
+      vertical = focusDist * v * viewportHeight;
+      lowerLeftCorner = origin - (horizontal / 2.0f) - (vertical / 2.0f) - (focusDist * w);
+      lensRadius = aperture / 2.0f;
+   }
+
+   Ray getRay(float s, float t, SampleStream& stream) const
+   {
+      return getRay(s, t, concentricDisc(stream.next2D()));
+   }
+
+   // lensPoint is a point on the unit disc
+   Ray getRay(float s, float t, const glm::vec2& lensPoint) const
+   {
+      glm::vec2 rd = lensRadius * lensPoint;
+      glm::vec3 offset = u * rd.x + v * rd.y;
+      return Ray(origin + offset, lowerLeftCorner + s * horizontal + t * vertical - origin - offset);
+   }
+
+   glm::vec3 origin;
+   glm::vec3 horizontal;
+   glm::vec3 vertical;
+   glm::vec3 lowerLeftCorner;
+   glm::vec3 u, v, w;
+   float lensRadius;
+};
+
+struct HitRecord
+{
+   inline void setFaceNormal(const Ray& ray, glm::vec3 outwardNormal)
+   {
+      frontFace = glm::dot(ray.dir, outwardNormal) < 0.0f;
+      normal = frontFace ? outwardNormal : -outwardNormal;
+   }
+
+   uint32_t materialId;  // Index into the material table of the World
+   uint32_t objectId;    // Top level object of the World that was hit, set by the World
+   uint32_t primitiveId; // Sphere of a SphereGroup or triangle of a mesh, zero for a single sphere
+   glm::vec3 pos;
+   glm::vec3 normal;
+   float t;
+   bool frontFace;
+};
+
+// Up to 64 coherent rays, e.g. the camera rays of an 8x8 pixel block, traced through the
+// acceleration structures together. tMax shrinks to the closest hit of every ray.
+struct RayPacket
+{
+   static const uint32_t maxSize = 64;
+
+   void clear()
+   {
+      size = 0;
+   }
+
+   void push(const Ray& ray, float t_max)
+   {
+      rays[size] = ray;
+      invDirs[size] = 1.0f / ray.dir;
+      tMax[size] = t_max;
+      hits[size] = false;
+      size++;
+   }
+
+   // Gathers the interval bounds of the origins and inverse directions used by mayHit(),
+   // has to be called after the last push()
+   void computeBounds()
+   {
+      origins = AABB();
+      invDirBounds = AABB();
+      maxDistance = 0.0f;
+      for (uint32_t i = 0; i < size; i++)
+      {
+         origins.grow(rays[i].origin);
+         invDirBounds.grow(invDirs[i]);
+         maxDistance = glm::max(maxDistance, tMax[i]);
+      }
+
+      // The intervals only give tight plane distances if no direction changes sign
+      coherent = size > 0;
+      for (int32_t axis = 0; axis < 3; axis++)
+         coherent = coherent && (invDirBounds.min[axis] > 0.0f || invDirBounds.max[axis] < 0.0f);
+   }
+
+   // Interval arithmetic culling, returns false only if no ray of the packet can hit the box.
+   // The exit is widened like in AABB::intersect(), so rays through a vertex on the box surface
+   // are kept.
+   bool mayHit(const AABB& box, float t_min) const
+   {
+      if (!coherent)
+         return true;
+
+      auto productRange = [](float aMin, float aMax, float bMin, float bMax, float& lo, float& hi)
+      {
+         float p0 = aMin * bMin, p1 = aMin * bMax, p2 = aMax * bMin, p3 = aMax * bMax;
+         lo = glm::min(glm::min(p0, p1), glm::min(p2, p3));
+         hi = glm::max(glm::max(p0, p1), glm::max(p2, p3));
+      };
+
+      float entry = t_min;
+      float exit = maxDistance;
+      for (int32_t axis = 0; axis < 3; axis++)
+      {
+         bool positive = invDirBounds.min[axis] > 0.0f;
+         float nearPlane = positive ? box.min[axis] : box.max[axis];
+         float farPlane = positive ? box.max[axis] : box.min[axis];
+
+         float nearMin, nearMax, farMin, farMax;
+         productRange(nearPlane - origins.max[axis], nearPlane - origins.min[axis], invDirBounds.min[axis], invDirBounds.max[axis], nearMin, nearMax);
+         productRange(farPlane - origins.max[axis], farPlane - origins.min[axis], invDirBounds.min[axis], invDirBounds.max[axis], farMin, farMax);
+         entry = glm::max(entry, nearMin);
+         exit = glm::min(exit, AABB::robustExit * farMax);
+      }
+
+      return entry <= exit;
+   }
+
+   // Index of the first ray from firstActive on that hits the box, or size if none does
+   uint32_t firstHit(const AABB& box, float t_min, uint32_t firstActive) const
+   {
+      if (!mayHit(box, t_min))
+         return size;
+
+      for (uint32_t i = firstActive; i < size; i++)
+      {
+         if (box.intersect(rays[i], invDirs[i], t_min, tMax[i]) != FLT_MAX)
+            return i;
+      }
+
+      return size;
+   }
+
+   Ray rays[maxSize];
+   glm::vec3 invDirs[maxSize];
+   float tMax[maxSize];
+   HitRecord hitRecords[maxSize];
+   bool hits[maxSize];
+   uint32_t size = 0;
+
+   AABB origins;
+   AABB invDirBounds;
+   float maxDistance = 0.0f;
+   bool coherent = false;
+};
+
+inline float luminance(const glm::vec3& color)
+{
+   return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+class Lambertian
+{
+public:
+   Lambertian(glm::vec3 color) : albedo(color) {}
+
+   bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const
+   {
+      // Normal plus a unit vector is cosine distributed, the exact Lambertian distribution,
+      // see chapter 8.5 in the tutorial
+      glm::vec3 scatterDirection = hitRecord.normal + randomUnitVector(stream);
+
+      if (glm::length(scatterDirection) < FLT_EPSILON)
+         scatterDirection = hitRecord.normal;
+
+      scatteredRay = Ray(hitRecord.pos, scatterDirection);
+      attenuation = albedo;
+      return true;
+   }
+
+   // Solid angle density of scatter() choosing direction
+   float pdf(const HitRecord& hitRecord, const glm::vec3& direction) const
+   {
+      return glm::max(0.0f, glm::dot(hitRecord.normal, glm::normalize(direction))) / glm::pi<float>();
+   }
+
+   glm::vec3 albedo;
+};
+
+class Metal
+{
+public:
+   Metal(glm::vec3 color, float f) : albedo(color), fuzz(f) {}
+
+   bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const
+   {
+      glm::vec3 reflected = glm::reflect(glm::normalize(inputRay.dir), hitRecord.normal);
+      scatteredRay = Ray(hitRecord.pos, reflected + fuzz * randomPointInUnitSphere(stream));
+      attenuation = albedo;
+      return (glm::dot(scatteredRay.dir, hitRecord.normal) > 0);
+   }
+
+   glm::vec3 albedo;
+   float fuzz;
+};
+
+class Dielectric
+{
+public:
+   Dielectric(float indexOfRefraction) : ir(indexOfRefraction) {}
+
+   bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const
+   {
+      attenuation = glm::vec3(1.0f);
+      float refractionRatio = hitRecord.frontFace ? (1.0f / ir) : ir;
+
+      glm::vec3 normalizedDirection = glm::normalize(inputRay.dir);
+      float cosTheta = glm::min<float>(glm::dot(-normalizedDirection, hitRecord.normal), 1.0f);
+      float sinTheta = glm::sqrt(1.0f - cosTheta * cosTheta);
+
+      bool cannotRefract = ((refractionRatio * sinTheta) > 1.0f);
+      glm::vec3 direction;
+
+      if (cannotRefract || (calcReflectance(cosTheta, refractionRatio) > stream.next1D()))
+         direction = reflect(normalizedDirection, hitRecord.normal);
+      else
+         direction = refract(normalizedDirection, hitRecord.normal, refractionRatio);
+
+      scatteredRay = Ray(hitRecord.pos, direction);
+      return true;
+   }
+
+   float calcReflectance(float cosine, float refIdx) const
+   {
+      // Schlick's approximation
+      float r0 = (1.0f - refIdx) / (1.0f + refIdx);
+      r0 = r0 * r0;
+      return r0 + (1.0f - r0) * glm::pow((1.0f - cosine), 5.0f);
+   }
+
+   float ir;
+};
+
+// Emits the same radiance on both sides and scatters nothing, paths end on it. Emissive
+// spheres and meshes are gathered into the LightList of the World for direct light sampling.
+class DiffuseLight
+{
+public:
+   DiffuseLight(glm::vec3 radiance) : emitted(radiance) {}
+
+   bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const
+   {
+      return false;
+   }
+
+   glm::vec3 emitted;
+};
+
+// Materials are a closed set stored by value in a tagged union, 20 bytes each. The
+// alternative index doubles as the material type for sorting hits before shading.
+using Material = std::variant<Lambertian, Metal, Dielectric, DiffuseLight>;
+const uint32_t numMaterialTypes = (uint32_t)std::variant_size<Material>::value;
+
+inline bool scatter(const Material& material, const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream)
+{
+   return std::visit([&](const auto& typedMaterial)
+   {
+      return typedMaterial.scatter(inputRay, hitRecord, attenuation, scatteredRay, stream);
+   }, material);
+}
+
+enum class BVHBuilder
+{
+   SAH,         // Binned surface area heuristic, top down
+   LBVH,        // Morton code order with a parallel hierarchy emission (Karras 2012)
+   LBVHTreelets // LBVH followed by treelet restructuring (Karras and Aila 2013)
+};
+
+// Node format traversed by BVH::traverse(), packets always use the binary nodes
+enum class BVHLayout
+{
+   Binary,     // Two children with float bounds
+   Quantized4, // Four children with 8-bit bounds per 64-byte node
+   Wide4,      // Four children with float bounds, tested with SSE
+   Wide8       // Eight children with float bounds, tested with AVX2
+};
+
+struct BVHBuildOptions
+{
+   BVHBuilder builder = BVHBuilder::SAH;
+   BVHLayout layout = BVHLayout::Binary;
+   uint32_t numThreads = 1;
+};
+
+class Object
+{
+public:
+   virtual ~Object() {}
+   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) = 0;
+   virtual AABB boundingBox() const = 0;
+
+   // Whether anything lies between t_min and t_max, without finding the closest hit.
+   // Defaults to hit().
+   virtual bool occluded(const Ray& ray, float t_min, float t_max)
+   {
+      HitRecord hitRecord;
+      return hit(ray, t_min, t_max, hitRecord);
+   }
+
+   // Intersects the rays of the packet from firstActive on, shrinking tMax and filling the hit
+   // record of every ray that finds a closer hit. Defaults to one ray at a time.
+   virtual void hitPacket(RayPacket& packet, float t_min, uint32_t firstActive)
+   {
+      for (uint32_t i = firstActive; i < packet.size; i++)
+      {
+         if (hit(packet.rays[i], t_min, packet.tMax[i], packet.hitRecords[i]))
+         {
+            packet.tMax[i] = packet.hitRecords[i].t;
+            packet.hits[i] = true;
+         }
+      }
+   }
+
+   // Called by World::build() before the bounds are gathered, lets primitive
+   // groups build their own acceleration structure
+   virtual void build(const BVHBuildOptions& options) {}
+
+   virtual size_t numPrimitives() const { return 1; }
+};
+
+class Sphere : public Object
+{
+public:
+   Sphere(glm::vec3 center, float radius, uint32_t materialId)
+   {
+      this->center = center;
+      this->radius = radius;
+      this->materialId = materialId;
+   }
+
+   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) override
+   {
+      glm::vec3 originToCenter = ray.origin - center;
+      float a = glm::length2(ray.dir);
+      float half_b = glm::dot(originToCenter, ray.dir);
+      float c = glm::length2(originToCenter) - radius * radius;
+      float discriminant = half_b * half_b - a * c;
+
+      if (discriminant < 0)
+         return false;
+
+      float sqrtd = glm::sqrt(discriminant);
+
+      // Find nearest root in the acceptable range
+      float root = (-half_b - sqrtd) / a;
+      if (root < t_min || root > t_max)
+      {
+         root = (-half_b + sqrtd) / a;
+         if (root < t_min || root > t_max)
+            return false;
+      }
+
+      hitRecord.t = root;
+      hitRecord.pos = ray.at(hitRecord.t);
+      glm::vec3 outwardNormal = (hitRecord.pos - center) / radius;
+      hitRecord.setFaceNormal(ray, outwardNormal);
+      hitRecord.materialId = materialId;
+      hitRecord.primitiveId = 0;
+
+      return true;
+   }
+
+   virtual AABB boundingBox() const override
+   {
+      return AABB(center - glm::vec3(radius), center + glm::vec3(radius));
+   }
+
+   uint32_t materialId;
+   glm::vec3 center;
+   float radius;
+};
+
+struct BVHNode
+{
+   AABB bounds;
+   uint32_t leftFirst; // Index of the left child (right child follows it), or first primitive for leaves
+   uint32_t count;     // Number of primitives, zero for interior nodes
+};
+
+// Four children in one cache line. Child bounds are 8-bit steps from the minimum of the node
+// bounds, with a power of two step size per axis, rounded outwards so they stay conservative.
+// Nodes lie in depth-first order, the first interior child usually follows its parent.
+struct alignas(64) QuantizedBVHNode
+{
+   static const uint32_t width = 4;
+
+   glm::vec3 origin;
+   int8_t exponents[3];
+   uint8_t numChildren;
+   uint32_t children[4]; // Node index of interior children, first primitive of leaves
+   uint8_t counts[4];    // Number of primitives, zero for interior children
+   uint8_t lower[3][4];
+   uint8_t upper[3][4];
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 64, "Quantized nodes have to fill one cache line");
+
+// Children with float bounds as structure of arrays, so one SIMD slab test covers all of them.
+// Unused slots have both bounds at +infinity, which every ray misses.
+template<uint32_t Width>
+struct alignas(64) WideBVHNode
+{
+   static const uint32_t width = Width;
+
+   float lower[3][Width];
+   float upper[3][Width];
+   uint32_t children[Width]; // Node index of interior children, first primitive of leaves
+   uint32_t counts[Width];   // Number of primitives, zero for interior children
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 128 && sizeof(WideBVHNode<8>) == 256, "Wide nodes have to fill whole cache lines");
+
+// Slots in use. The masks returned by intersectChildren() cover unused quantized slots too,
+// wide nodes mark them with bounds every ray misses.
+inline uint32_t numChildren(const QuantizedBVHNode& node) { return node.numChildren; }
+template<uint32_t Width>
+inline uint32_t numChildren(const WideBVHNode<Width>& node) { return Width; }
+
+// 2^exponent, built from the float bits
+inline float quantizedScale(int8_t exponent)
+{
+   uint32_t bits = (uint32_t)(exponent + 127) << 23;
+   float scale;
+   std::memcpy(&scale, &bits, sizeof(scale));
+   return scale;
+}
+
+// Child tests of the wide node layouts return the mask of children the ray enters within
+// [t_min, t_max] and write their entry distances. The exit distances are widened like in
+// AABB::intersect(). In the SIMD versions the operand order of min and max makes a NaN from a
+// ray lying in a slab plane drop that axis instead of the child.
+template<uint32_t Width>
+uint32_t intersectChildrenScalar(const WideBVHNode<Width>& node, const Ray& ray, const glm::vec3& invDir, float t_min, float t_max, float* entries)
+{
+   uint32_t hitMask = 0;
+   for (uint32_t i = 0; i < Width; i++)
+   {
+      AABB bounds(glm::vec3(node.lower[0][i], node.lower[1][i], node.lower[2][i]), glm::vec3(node.upper[0][i], node.upper[1][i], node.upper[2][i]));
+      entries[i] = bounds.intersect(ray, invDir, t_min, t_max);
+      hitMask |= entries[i] != FLT_MAX ? 1u << i : 0u;
+   }
+   return hitMask;
+}
+
+#if SIMD_X86
+TARGET_AVX2 uint32_t intersectChildrenAVX2(const WideBVHNode<8>& node, const Ray& ray, const glm::vec3& invDir, float t_min, float t_max, float* entries)
+{
+   __m256 entry = _mm256_set1_ps(t_min);
+   __m256 exit = _mm256_set1_ps(t_max);
+   for (uint32_t axis = 0; axis < 3; axis++)
+   {
+      __m256 rayOrigin = _mm256_set1_ps(ray.origin[axis]);
+      __m256 inverse = _mm256_set1_ps(invDir[axis]);
+      __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.lower[axis]), rayOrigin), inverse);
+      __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.upper[axis]), rayOrigin), inverse);
+      entry = _mm256_max_ps(_mm256_min_ps(t0, t1), entry);
+      exit = _mm256_min_ps(_mm256_mul_ps(_mm256_set1_ps(AABB::robustExit), _mm256_max_ps(t0, t1)), exit);
+   }
+   _mm256_storeu_ps(entries, entry);
+   return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ));
+}
+#endif
+
+// SSE2 is part of x86-64
+inline uint32_t intersectChildren(const WideBVHNode<4>& node, const Ray& ray, const glm::vec3& invDir, float t_min, float t_max, float* entries)
+{
+#if SIMD_X86
+   __m128 entry = _mm_set1_ps(t_min);
+   __m128 exit = _mm_set1_ps(t_max);
+   for (uint32_t axis = 0; axis < 3; axis++)
+   {
+      __m128 rayOrigin = _mm_set1_ps(ray.origin[axis]);
+      __m128 inverse = _mm_set1_ps(invDir[axis]);
+      __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.lower[axis]), rayOrigin), inverse);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.upper[axis]), rayOrigin), inverse);
+      entry = _mm_max_ps(_mm_min_ps(t0, t1), entry);
+      exit = _mm_min_ps(_mm_mul_ps(_mm_set1_ps(AABB::robustExit), _mm_max_ps(t0, t1)), exit);
+   }
+   _mm_storeu_ps(entries, entry);
+   return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+   return intersectChildrenScalar(node, ray, invDir, t_min, t_max, entries);
+#endif
+}
+
+// BVH::setLayout() only builds 8-wide nodes when AVX2 is available
+inline uint32_t intersectChildren(const WideBVHNode<8>& node, const Ray& ray, const glm::vec3& invDir, float t_min, float t_max, float* entries)
+{
+#if SIMD_X86
+   return intersectChildrenAVX2(node, ray, invDir, t_min, t_max, entries);
+#else
+   return intersectChildrenScalar(node, ray, invDir, t_min, t_max, entries);
+#endif
+}
+
+// Decodes the bounds exactly as BVH::emitQuantized() checked them
+inline uint32_t intersectChildren(const QuantizedBVHNode& node, const Ray& ray, const glm::vec3& invDir, float t_min, float t_max, float* entries)
+{
+   uint32_t hitMask = 0;
+#if SIMD_X86
+   __m128 entry = _mm_set1_ps(t_min);
+   __m128 exit = _mm_set1_ps(t_max);
+   for (uint32_t axis = 0; axis < 3; axis++)
+   {
+      __m128 scale = _mm_set1_ps(quantizedScale(node.exponents[axis]));
+      __m128 origin = _mm_set1_ps(node.origin[axis]);
+      __m128 rayOrigin = _mm_set1_ps(ray.origin[axis]);
+      __m128 inverse = _mm_set1_ps(invDir[axis]);
+      int32_t lowerBytes, upperBytes;
+      std::memcpy(&lowerBytes, node.lower[axis], 4);
+      std::memcpy(&upperBytes, node.upper[axis], 4);
+      __m128i zero = _mm_setzero_si128();
+      __m128 lower = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lowerBytes), zero), zero));
+      __m128 upper = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(upperBytes), zero), zero));
+      __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(lower, scale)), rayOrigin), inverse);
+      __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(origin, _mm_mul_ps(upper, scale)), rayOrigin), inverse);
+      entry = _mm_max_ps(_mm_min_ps(t0, t1), entry);
+      exit = _mm_min_ps(_mm_mul_ps(_mm_set1_ps(AABB::robustExit), _mm_max_ps(t0, t1)), exit);
+   }
+   _mm_storeu_ps(entries, entry);
+   hitMask = (uint32_t)_mm_movemask_ps(_mm_cmple_ps(entry, exit));
+#else
+   float exits[4] = { t_max, t_max, t_max, t_max };
+   std::fill(entries, entries + 4, t_min);
+   for (uint32_t axis = 0; axis < 3; axis++)
+   {
+      float scale = quantizedScale(node.exponents[axis]);
+      for (uint32_t i = 0; i < 4; i++)
+      {
+         float t0 = (node.origin[axis] + node.lower[axis][i] * scale - ray.origin[axis]) * invDir[axis];
+         float t1 = (node.origin[axis] + node.upper[axis][i] * scale - ray.origin[axis]) * invDir[axis];
+         entries[i] = glm::max(entries[i], glm::min(t0, t1));
+         exits[i] = glm::min(exits[i], AABB::robustExit * glm::max(t0, t1));
+      }
+   }
+   for (uint32_t i = 0; i < 4; i++)
+      hitMask |= entries[i] <= exits[i] ? 1u << i : 0u;
+#endif
+   return hitMask;
+}
+
+// Bounding volume hierarchy built with a binned surface area heuristic.
+// The tree only stores primitive indices, intersecting the primitives themselves is
+// left to the callback passed to traverse().
+class BVH
+{
+public:
+   static const uint32_t numBins = 16;
+   static const uint32_t maxLeafSize = 8;
+   static const uint32_t maxDepth = 64;
+
+   // primitiveBatchSize is the number of primitives intersected at the cost of one, e.g.
+   // the SIMD width of the leaf kernel. The cost model then fills leaves up to that size.
+   void build(const std::vector<AABB>& primitiveBounds, uint32_t primitiveBatchSize = 1, const BVHBuildOptions& options = BVHBuildOptions())
+   {
+      mappedNodes = nullptr;
+      numMappedNodes = 0;
+
+      if (options.builder != BVHBuilder::SAH)
+      {
+         buildLinear(primitiveBounds, primitiveBatchSize, options.numThreads);
+         if (options.builder == BVHBuilder::LBVHTreelets)
+            optimizeTreelets(options.numThreads);
+      }
+      else
+         buildSAH(primitiveBounds, primitiveBatchSize);
+
+      setLayout(options.layout);
+   }
+
+   void buildSAH(const std::vector<AABB>& primitiveBounds, uint32_t primitiveBatchSize)
+   {
+      batchSize = primitiveBatchSize;
+      nodes.clear();
+      primitiveIndices.resize(primitiveBounds.size());
+      std::iota(primitiveIndices.begin(), primitiveIndices.end(), 0);
+
+      if (primitiveBounds.empty())
+         return;
+
+      std::vector<glm::vec3> centroids(primitiveBounds.size());
+      for (size_t i = 0; i < primitiveBounds.size(); i++)
+         centroids[i] = primitiveBounds[i].centroid();
+
+      nodes.reserve(2 * primitiveBounds.size() - 1);
+      nodes.push_back({ AABB(), 0, (uint32_t)primitiveBounds.size() });
+      subdivide(0, 1, primitiveBounds, centroids);
+      nodes.shrink_to_fit();
+   }
+
+   // leafFunc(first, count, t_min, closestHit) is called with a range of primitiveIndices
+   // and must return true and shrink closestHit on a hit
+   template<typename LeafFunc>
+   bool traverse(const Ray& ray, float t_min, float t_max, LeafFunc&& leafFunc) const
+   {
+      return traverseLayout<false>(ray, t_min, t_max, leafFunc);
+   }
+
+   // Occlusion version of traverse(), returns as soon as leafFunc reports a hit in any leaf
+   template<typename LeafFunc>
+   bool traverseAny(const Ray& ray, float t_min, float t_max, LeafFunc&& leafFunc) const
+   {
+      return traverseLayout<true>(ray, t_min, t_max, leafFunc);
+   }
+
+   // Packet version of traverse(). Nodes that interval culling rules out for the whole packet
+   // are skipped, otherwise the rays are tested in order until the first one that hits the
+   // node. leafFunc(first, count, t_min, firstActive) only has to handle the rays from
+   // firstActive on, the ones before it miss the leaf.
+   template<typename LeafFunc>
+   void traversePacket(RayPacket& packet, float t_min, uint32_t firstActive, LeafFunc&& leafFunc) const
+   {
+      const BVHNode* nodes = nodeData();
+      if (numNodes() == 0)
+         return;
+
+      struct StackEntry
+      {
+         uint32_t nodeIndex;
+         uint32_t firstActive;
+      };
+
+      StackEntry stack[maxDepth];
+      uint32_t stackSize = 0;
+      StackEntry entry = { 0, firstActive };
+
+      while (true)
+      {
+         const BVHNode& node = nodes[entry.nodeIndex];
+         uint32_t active = packet.firstHit(node.bounds, t_min, entry.firstActive);
+
+         if (active < packet.size)
+         {
+            if (node.count > 0)
+               leafFunc(node.leftFirst, node.count, t_min, active);
+            else
+            {
+               // Visit the child that lies first along the direction of the first active ray
+               uint32_t nearChild = node.leftFirst;
+               uint32_t farChild = node.leftFirst + 1;
+               if (glm::dot(nodes[farChild].bounds.centroid() - nodes[nearChild].bounds.centroid(), packet.rays[active].dir) < 0.0f)
+                  std::swap(nearChild, farChild);
+
+               stack[stackSize++] = { farChild, active };
+               entry = { nearChild, active };
+               continue;
+            }
+         }
+
+         if (stackSize == 0)
+            break;
+         entry = stack[--stackSize];
+      }
+   }
+
+   // Converts the binary nodes to the given layout for traverse(). Works on attached nodes
+   // too, the converted nodes are always owned by the BVH. Trees with leaves too large for
+   // the 8-bit counts of the quantized layout, left by unsplittable primitives, stay binary,
+   // and the 8-wide layout falls back to 4 wide without AVX2.
+   void setLayout(BVHLayout layout)
+   {
+      const BVHNode* binaryNodes = nodeData();
+      bool countsFit = true;
+      for (uint32_t i = 0; i < numNodes(); i++)
+         countsFit = countsFit && binaryNodes[i].count <= 255;
+      if (layout == BVHLayout::Wide8 && getSimdLevel() != SimdLevel::AVX2)
+         layout = BVHLayout::Wide4;
+
+      quantizedNodes.clear();
+      wide4Nodes.clear();
+      wide8Nodes.clear();
+      if (numNodes() > 0)
+      {
+         if (layout == BVHLayout::Quantized4 && countsFit)
+            emitQuantized(0);
+         else if (layout == BVHLayout::Wide4)
+            emitWide(0, wide4Nodes);
+         else if (layout == BVHLayout::Wide8)
+            emitWide(0, wide8Nodes);
+      }
+      quantizedNodes.shrink_to_fit();
+      wide4Nodes.shrink_to_fit();
+      wide8Nodes.shrink_to_fit();
+   }
+
+   // Memory traverse() reads nodes from
+   size_t traversedNodeBytes() const
+   {
+      if (!quantizedNodes.empty())
+         return quantizedNodes.size() * sizeof(QuantizedBVHNode);
+      if (!wide4Nodes.empty())
+         return wide4Nodes.size() * sizeof(WideBVHNode<4>);
+      if (!wide8Nodes.empty())
+         return wide8Nodes.size() * sizeof(WideBVHNode<8>);
+      return numNodes() * sizeof(BVHNode);
+   }
+
+   // Memory of all nodes, the binary nodes stay next to a converted layout for packets, the
+   // scene cache and the root bounds
+   size_t nodeBytes() const
+   {
+      return numNodes() * sizeof(BVHNode) + quantizedNodes.size() * sizeof(QuantizedBVHNode) + wide4Nodes.size() * sizeof(WideBVHNode<4>) +
+         wide8Nodes.size() * sizeof(WideBVHNode<8>);
+   }
+
+   // Linear BVH: primitives are sorted along a 30-bit Morton curve of their centroids and the
+   // hierarchy follows the bits in which neighbouring codes differ, which lets every internal
+   // node find its children independently (Karras 2012). A parallel bottom-up pass then
+   // computes bounds and collapses subtrees into leaves where the SAH cost model says so.
+   // Much faster to build than the binned SAH, at the cost of some tree quality.
+   void buildLinear(const std::vector<AABB>& primitiveBounds, uint32_t primitiveBatchSize, uint32_t numThreads)
+   {
+      batchSize = primitiveBatchSize;
+      nodes.clear();
+      const uint32_t numPrimitives = (uint32_t)primitiveBounds.size();
+      primitiveIndices.resize(numPrimitives);
+      std::iota(primitiveIndices.begin(), primitiveIndices.end(), 0);
+
+      if (numPrimitives == 0)
+         return;
+
+      AABB rootBounds;
+      for (const AABB& bounds : primitiveBounds)
+         rootBounds.grow(bounds);
+
+      if (numPrimitives == 1)
+      {
+         nodes.push_back({ rootBounds, 0, 1 });
+         return;
+      }
+
+      // Morton codes of the centroids, quantized to 10 bits per axis
+      std::vector<AABB> threadCentroidBounds(numThreads);
+      parallelFor(numThreads, numPrimitives, [&](size_t begin, size_t end, uint32_t thread)
+      {
+         for (size_t i = begin; i < end; i++)
+            threadCentroidBounds[thread].grow(primitiveBounds[i].centroid());
+      });
+      AABB centroidBounds;
+      for (const AABB& bounds : threadCentroidBounds)
+         centroidBounds.grow(bounds);
+
+      // Axes on which all centroids coincide map to cell zero
+      glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+      glm::vec3 scale;
+      for (int32_t axis = 0; axis < 3; axis++)
+         scale[axis] = extent[axis] > 0.0f ? 1023.0f / extent[axis] : 0.0f;
+      std::vector<uint32_t> codes(numPrimitives);
+      parallelFor(numThreads, numPrimitives, [&](size_t begin, size_t end, uint32_t thread)
+      {
+         for (size_t i = begin; i < end; i++)
+         {
+            glm::vec3 cell = (primitiveBounds[i].centroid() - centroidBounds.min) * scale;
+            codes[i] = (spreadBits((uint32_t)cell.x) << 2) | (spreadBits((uint32_t)cell.y) << 1) | spreadBits((uint32_t)cell.z);
+         }
+      });
+
+      radixSort(codes, primitiveIndices, numThreads);
+
+      // Internal node i of the n - 1 covers a range of sorted primitives that starts or ends
+      // at i, children refer to internal nodes or, with leafReference set, to primitives
+      const uint32_t numInternal = numPrimitives - 1;
+      const uint32_t leafReference = 0x80000000u;
+      std::vector<uint32_t> children(2 * numInternal);
+      std::vector<uint32_t> rangeFirst(numInternal);
+      std::vector<uint32_t> parents(numInternal + numPrimitives);
+
+      // Length of the common prefix of two keys, equal codes are told apart by their index
+      auto commonPrefix = [&](int64_t i, int64_t j) -> int32_t
+      {
+         if (j < 0 || j >= numPrimitives)
+            return -1;
+         if (codes[i] != codes[j])
+            return (int32_t)countLeadingZeros(codes[i] ^ codes[j]);
+         return 32 + (int32_t)countLeadingZeros((uint32_t)i ^ (uint32_t)j);
+      };
+
+      parallelFor(numThreads, numInternal, [&](size_t begin, size_t end, uint32_t thread)
+      {
+         for (int64_t i = (int64_t)begin; i < (int64_t)end; i++)
+         {
+            // The range extends towards the neighbour that shares the longer prefix
+            int64_t direction = commonPrefix(i, i + 1) - commonPrefix(i, i - 1) >= 0 ? 1 : -1;
+            int32_t minPrefix = commonPrefix(i, i - direction);
+
+            int64_t maxLength = 2;
+            while (commonPrefix(i, i + maxLength * direction) > minPrefix)
+               maxLength *= 2;
+
+            int64_t length = 0;
+            for (int64_t step = maxLength / 2; step >= 1; step /= 2)
+            {
+               if (commonPrefix(i, i + (length + step) * direction) > minPrefix)
+                  length += step;
+            }
+            int64_t j = i + length * direction;
+
+            // Split where the first bit below the common prefix of the range changes
+            int32_t nodePrefix = commonPrefix(i, j);
+            int64_t split = 0;
+            int64_t step = length;
+            do
+            {
+               step = (step + 1) / 2;
+               if (commonPrefix(i, i + (split + step) * direction) > nodePrefix)
+                  split += step;
+            } while (step > 1);
+            int64_t gamma = i + split * direction + glm::min<int64_t>(direction, 0);
+
+            uint32_t left = glm::min(i, j) == gamma ? (uint32_t)gamma | leafReference : (uint32_t)gamma;
+            uint32_t right = glm::max(i, j) == gamma + 1 ? (uint32_t)(gamma + 1) | leafReference : (uint32_t)(gamma + 1);
+            children[2 * i] = left;
+            children[2 * i + 1] = right;
+            rangeFirst[i] = (uint32_t)glm::min(i, j);
+            parents[(left & leafReference) ? numInternal + (left & ~leafReference) : left] = (uint32_t)i;
+            parents[(right & leafReference) ? numInternal + (right & ~leafReference) : right] = (uint32_t)i;
+         }
+      });
+
+      // Bottom up from every primitive, the second thread to arrive at a node processes it
+      std::vector<AABB> internalBounds(numInternal);
+      std::vector<uint32_t> internalCounts(numInternal);
+      std::vector<float> internalCosts(numInternal);
+      std::vector<uint8_t> collapse(numInternal);
+      std::unique_ptr<std::atomic<uint32_t>[]> arrivals(new std::atomic<uint32_t>[numInternal]);
+      for (uint32_t i = 0; i < numInternal; i++)
+         arrivals[i] = 0;
+
+      auto childData = [&](uint32_t child, AABB& bounds, uint32_t& count, float& cost)
+      {
+         if (child & leafReference)
+         {
+            bounds = primitiveBounds[primitiveIndices[child & ~leafReference]];
+            count = 1;
+            cost = bounds.surfaceArea() * intersectionCost(1);
+         }
+         else
+         {
+            bounds = internalBounds[child];
+            count = internalCounts[child];
+            cost = internalCosts[child];
+         }
+      };
+
+      parallelFor(numThreads, numPrimitives, [&](size_t begin, size_t end, uint32_t thread)
+      {
+         for (size_t leaf = begin; leaf < end; leaf++)
+         {
+            uint32_t node = parents[numInternal + leaf];
+            while (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1)
+            {
+               AABB leftBounds, rightBounds;
+               uint32_t leftCount, rightCount;
+               float leftCost, rightCost;
+               childData(children[2 * node], leftBounds, leftCount, leftCost);
+               childData(children[2 * node + 1], rightBounds, rightCount, rightCost);
+
+               AABB bounds = leftBounds;
+               bounds.grow(rightBounds);
+               uint32_t count = leftCount + rightCount;
+               float area = bounds.surfaceArea();
+               float splitCost = area + leftCost + rightCost;
+               float leafCost = count <= maxLeafSize ? area * intersectionCost(count) : FLT_MAX;
+
+               internalBounds[node] = bounds;
+               internalCounts[node] = count;
+               internalCosts[node] = glm::min(splitCost, leafCost);
+               collapse[node] = leafCost <= splitCost ? 1 : 0;
+
+               if (node == 0)
+                  break;
+               node = parents[node];
+            }
+         }
+      });
+
+      // Flatten into the layout of build(), children of a node stored next to each other
+      nodes.reserve(2 * numPrimitives - 1);
+      nodes.push_back(BVHNode());
+      std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, 0 } };
+      while (!stack.empty())
+      {
+         uint32_t reference = stack.back().first;
+         uint32_t output = stack.back().second;
+         stack.pop_back();
+
+         if (reference & leafReference)
+         {
+            uint32_t first = reference & ~leafReference;
+            nodes[output] = { primitiveBounds[primitiveIndices[first]], first, 1 };
+         }
+         else if (collapse[reference])
+            nodes[output] = { internalBounds[reference], rangeFirst[reference], internalCounts[reference] };
+         else
+         {
+            uint32_t leftChild = (uint32_t)nodes.size();
+            nodes.resize(nodes.size() + 2);
+            nodes[output] = { internalBounds[reference], leftChild, 0 };
+            stack.push_back({ children[2 * reference + 1], leftChild + 1 });
+            stack.push_back({ children[2 * reference], leftChild });
+         }
+      }
+      nodes.shrink_to_fit();
+   }
+
+   // Treelet restructuring (Karras and Aila 2013). Every internal node, bottom up, grows a
+   // treelet of up to 7 leaves by repeatedly opening the largest one, finds the topology with
+   // the lowest SAH cost over those leaves by dynamic programming and rewrites the treelet in
+   // place. Subtrees below the top levels are independent and run in parallel.
+   void optimizeTreelets(uint32_t numThreads)
+   {
+      if (nodes.size() < 3)
+         return;
+
+      std::vector<float> costs(nodes.size());
+      std::vector<uint8_t> heights(nodes.size());
+
+      // Top levels breadth first until there are enough independent subtrees
+      std::vector<std::pair<uint32_t, uint32_t>> topNodes;
+      std::vector<std::pair<uint32_t, uint32_t>> subtrees = { { 0, 0 } };
+      while (subtrees.size() < 8 * numThreads)
+      {
+         std::vector<std::pair<uint32_t, uint32_t>> nextLevel;
+         for (const auto& subtree : subtrees)
+         {
+            const BVHNode& node = nodes[subtree.first];
+            if (node.count > 0)
+               nextLevel.push_back(subtree);
+            else
+            {
+               topNodes.push_back(subtree);
+               nextLevel.push_back({ node.leftFirst, subtree.second + 1 });
+               nextLevel.push_back({ node.leftFirst + 1, subtree.second + 1 });
+            }
+         }
+
+         if (nextLevel.size() == subtrees.size())
+            break;
+         subtrees.swap(nextLevel);
+      }
+
+      parallelFor(numThreads, subtrees.size(), [&](size_t begin, size_t end, uint32_t thread)
+      {
+         for (size_t i = begin; i < end; i++)
+            optimizeSubtree(subtrees[i].first, subtrees[i].second, costs, heights);
+      }, 1);
+
+      for (auto topNode = topNodes.rbegin(); topNode != topNodes.rend(); ++topNode)
+         optimizeTreelet(topNode->first, topNode->second, costs, heights);
+   }
+
+   // SAH cost of the tree relative to its root, in the units of the build cost model
+   float cost() const
+   {
+      const BVHNode* nodes = nodeData();
+      if (numNodes() == 0)
+         return 0.0f;
+
+      float sum = 0.0f;
+      for (uint32_t i = 0; i < numNodes(); i++)
+         sum += nodes[i].bounds.surfaceArea() * (nodes[i].count > 0 ? intersectionCost(nodes[i].count) : 1.0f);
+      return sum / nodes[0].bounds.surfaceArea();
+   }
+
+   // Uses nodes stored elsewhere, e.g. in a mapped scene cache, instead of building. The
+   // memory has to outlive the BVH or the next build().
+   void attach(const BVHNode* data, uint32_t count)
+   {
+      nodes.clear();
+      nodes.shrink_to_fit();
+      quantizedNodes.clear();
+      wide4Nodes.clear();
+      wide8Nodes.clear();
+      primitiveIndices.clear();
+      mappedNodes = data;
+      numMappedNodes = count;
+   }
+
+   const BVHNode* nodeData() const { return mappedNodes ? mappedNodes : nodes.data(); }
+   uint32_t numNodes() const { return mappedNodes ? numMappedNodes : (uint32_t)nodes.size(); }
+
+   std::vector<BVHNode> nodes;
+   std::vector<uint32_t> primitiveIndices;
+
+private:
+   template<bool AnyHit, typename LeafFunc>
+   bool traverseLayout(const Ray& ray, float t_min, float t_max, LeafFunc&& leafFunc) const
+   {
+      if (!quantizedNodes.empty())
+         return traverseWide<AnyHit>(quantizedNodes, ray, t_min, t_max, leafFunc);
+      if (!wide4Nodes.empty())
+         return traverseWide<AnyHit>(wide4Nodes, ray, t_min, t_max, leafFunc);
+      if (!wide8Nodes.empty())
+         return traverseWide<AnyHit>(wide8Nodes, ray, t_min, t_max, leafFunc);
+      return traverseBinary<AnyHit>(ray, t_min, t_max, leafFunc);
+   }
+
+   template<bool AnyHit, typename LeafFunc>
+   bool traverseBinary(const Ray& ray, float t_min, float t_max, LeafFunc&& leafFunc) const
+   {
+      const BVHNode* nodes = nodeData();
+      if (numNodes() == 0)
+         return false;
+
+      glm::vec3 invDir = 1.0f / ray.dir;
+      if (nodes[0].bounds.intersect(ray, invDir, t_min, t_max) == FLT_MAX)
+         return false;
+
+      uint32_t stack[maxDepth];
+      uint32_t stackSize = 0;
+      uint32_t nodeIndex = 0;
+      bool hitAnything = false;
+      float closestHit = t_max;
+
+      while (true)
+      {
+         const BVHNode& node = nodes[nodeIndex];
+
+         if (node.count > 0)
+         {
+            if (leafFunc(node.leftFirst, node.count, t_min, closestHit))
+            {
+               if (AnyHit)
+                  return true;
+               hitAnything = true;
+            }
+
+            if (stackSize == 0)
+               break;
+            nodeIndex = stack[--stackSize];
+            continue;
+         }
+
+         // Visit the closest child first so that closestHit shrinks as early as possible
+         uint32_t nearChild = node.leftFirst;
+         uint32_t farChild = node.leftFirst + 1;
+         float nearDist = nodes[nearChild].bounds.intersect(ray, invDir, t_min, closestHit);
+         float farDist = nodes[farChild].bounds.intersect(ray, invDir, t_min, closestHit);
+
+         if (farDist < nearDist)
+         {
+            std::swap(nearChild, farChild);
+            std::swap(nearDist, farDist);
+         }
+
+         if (nearDist == FLT_MAX)
+         {
+            if (stackSize == 0)
+               break;
+            nodeIndex = stack[--stackSize];
+         }
+         else
+         {
+            nodeIndex = nearChild;
+            if (farDist != FLT_MAX)
+               stack[stackSize++] = farChild;
+         }
+      }
+
+      return hitAnything;
+   }
+
+   // traverse() on the wide layouts. Hit children are pushed far to near with their entry
+   // distance, so the nearest one is popped next and entries beyond the closest hit are
+   // dropped without touching their node. Occlusion queries skip the sorting, any blocker
+   // ends them.
+   template<bool AnyHit, typename Node, typename LeafFunc>
+   bool traverseWide(const AlignedVector<Node>& wideNodes, const Ray& ray, float t_min, float t_max, LeafFunc&& leafFunc) const
+   {
+      struct StackEntry
+      {
+         uint32_t index; // Node, or first primitive of a leaf
+         uint32_t count; // Zero for nodes
+         float distance;
+      };
+
+      glm::vec3 invDir = 1.0f / ray.dir;
+      if (nodeData()[0].bounds.intersect(ray, invDir, t_min, t_max) == FLT_MAX)
+         return false;
+
+      StackEntry stack[(Node::width - 1) * maxDepth + 1];
+      uint32_t stackSize = 0;
+      stack[stackSize++] = { 0, 0, t_min };
+      bool hitAnything = false;
+      float closestHit = t_max;
+
+      while (stackSize > 0)
+      {
+         StackEntry entry = stack[--stackSize];
+         if (entry.distance > closestHit)
+            continue;
+
+         if (entry.count > 0)
+         {
+            if (leafFunc(entry.index, entry.count, t_min, closestHit))
+            {
+               if (AnyHit)
+                  return true;
+               hitAnything = true;
+            }
+            continue;
+         }
+
+         const Node& node = wideNodes[entry.index];
+         float entries[Node::width];
+         uint32_t hitMask = intersectChildren(node, ray, invDir, t_min, closestHit, entries);
+
+         StackEntry hits[Node::width];
+         uint32_t numHits = 0;
+         for (uint32_t i = 0; i < numChildren(node); i++)
+         {
+            if (!(hitMask & (1u << i)))
+               continue;
+
+            float distance = entries[i];
+            if (AnyHit)
+            {
+               hits[numHits++] = { node.children[i], node.counts[i], distance };
+               continue;
+            }
+
+            // Insertion sort, far to near
+            uint32_t slot = numHits++;
+            for (; slot > 0 && hits[slot - 1].distance < distance; slot--)
+               hits[slot] = hits[slot - 1];
+            hits[slot] = { node.children[i], node.counts[i], distance };
+         }
+
+         for (uint32_t i = 0; i < numHits; i++)
+            stack[stackSize++] = hits[i];
+      }
+
+      return hitAnything;
+   }
+
+   // Binary nodes that replace an interior node in a wide node, found by opening the interior
+   // descendant with the largest surface area until there are maxChildren. A leaf, which can
+   // only be the root here, becomes the single child of its wide node.
+   uint32_t collapseChildren(uint32_t binaryIndex, uint32_t maxChildren, uint32_t* children) const
+   {
+      const BVHNode* binaryNodes = nodeData();
+      const BVHNode& binaryNode = binaryNodes[binaryIndex];
+      if (binaryNode.count > 0)
+      {
+         children[0] = binaryIndex;
+         return 1;
+      }
+
+      children[0] = binaryNode.leftFirst;
+      children[1] = binaryNode.leftFirst + 1;
+      uint32_t numChildren = 2;
+      while (numChildren < maxChildren)
+      {
+         int32_t largest = -1;
+         for (uint32_t i = 0; i < numChildren; i++)
+         {
+            const BVHNode& child = binaryNodes[children[i]];
+            if (child.count == 0 && (largest < 0 || child.bounds.surfaceArea() > binaryNodes[children[largest]].bounds.surfaceArea()))
+               largest = (int32_t)i;
+         }
+         if (largest < 0)
+            break;
+
+         uint32_t opened = children[largest];
+         children[largest] = binaryNodes[opened].leftFirst;
+         children[numChildren++] = binaryNodes[opened].leftFirst + 1;
+      }
+      return numChildren;
+   }
+
+   // Emits the wide node for a binary node followed by the nodes of its interior children
+   template<uint32_t Width>
+   uint32_t emitWide(uint32_t binaryIndex, AlignedVector<WideBVHNode<Width>>& wideNodes)
+   {
+      const BVHNode* binaryNodes = nodeData();
+      uint32_t children[Width];
+      uint32_t numChildren = collapseChildren(binaryIndex, Width, children);
+
+      WideBVHNode<Width> node;
+      for (uint32_t i = 0; i < Width; i++)
+      {
+         const AABB& bounds = binaryNodes[children[glm::min(i, numChildren - 1)]].bounds;
+         for (uint32_t axis = 0; axis < 3; axis++)
+         {
+            node.lower[axis][i] = i < numChildren ? bounds.min[axis] : INFINITY;
+            node.upper[axis][i] = i < numChildren ? bounds.max[axis] : INFINITY;
+         }
+         node.children[i] = 0;
+         node.counts[i] = 0;
+      }
+
+      uint32_t index = (uint32_t)wideNodes.size();
+      wideNodes.push_back(node);
+      for (uint32_t i = 0; i < numChildren; i++)
+      {
+         const BVHNode& child = binaryNodes[children[i]];
+         uint32_t childIndex = child.count > 0 ? child.leftFirst : emitWide(children[i], wideNodes);
+         wideNodes[index].children[i] = childIndex;
+         wideNodes[index].counts[i] = child.count;
+      }
+      return index;
+   }
+
+   // Same as emitWide() for the quantized layout
+   uint32_t emitQuantized(uint32_t binaryIndex)
+   {
+      const BVHNode* binaryNodes = nodeData();
+      const BVHNode& binaryNode = binaryNodes[binaryIndex];
+      uint32_t children[4];
+      uint32_t numChildren = collapseChildren(binaryIndex, 4, children);
+
+      QuantizedBVHNode node = {};
+      const AABB& bounds = binaryNode.bounds;
+      node.origin = bounds.min;
+      node.numChildren = (uint8_t)numChildren;
+      glm::vec3 scale;
+      for (uint32_t axis = 0; axis < 3; axis++)
+      {
+         // Smallest power of two step that spans the bounds in 255 steps, with a margin for
+         // the rounding of the extent
+         int exponent;
+         std::frexp((bounds.max[axis] - bounds.min[axis]) * (1.0f + 1e-5f) / 255.0f, &exponent);
+         node.exponents[axis] = (int8_t)glm::clamp(exponent, -126, 127);
+         scale[axis] = quantizedScale(node.exponents[axis]);
+      }
+
+      for (uint32_t i = 0; i < numChildren; i++)
+      {
+         const AABB& childBounds = binaryNodes[children[i]].bounds;
+         for (uint32_t axis = 0; axis < 3; axis++)
+         {
+            float lower = glm::clamp(std::floor((childBounds.min[axis] - node.origin[axis]) / scale[axis]), 0.0f, 255.0f);
+            float upper = glm::clamp(std::ceil((childBounds.max[axis] - node.origin[axis]) / scale[axis]), 0.0f, 255.0f);
+            while (lower > 0.0f && node.origin[axis] + lower * scale[axis] > childBounds.min[axis])
+               lower -= 1.0f;
+            while (upper < 255.0f && node.origin[axis] + upper * scale[axis] < childBounds.max[axis])
+               upper += 1.0f;
+            node.lower[axis][i] = (uint8_t)lower;
+            node.upper[axis][i] = (uint8_t)upper;
+         }
+      }
+
+      uint32_t index = (uint32_t)quantizedNodes.size();
+      quantizedNodes.push_back(node);
+      for (uint32_t i = 0; i < numChildren; i++)
+      {
+         const BVHNode& child = binaryNodes[children[i]];
+         uint32_t childIndex = child.count > 0 ? child.leftFirst : emitQuantized(children[i]);
+         quantizedNodes[index].children[i] = childIndex;
+         quantizedNodes[index].counts[i] = (uint8_t)child.count;
+      }
+      return index;
+   }
+
+   const BVHNode* mappedNodes = nullptr;
+   uint32_t numMappedNodes = 0;
+   AlignedVector<QuantizedBVHNode> quantizedNodes;
+   AlignedVector<WideBVHNode<4>> wide4Nodes;
+   AlignedVector<WideBVHNode<8>> wide8Nodes;
+
+   // Inserts two zero bits after each of the low 10 bits
+   static uint32_t spreadBits(uint32_t value)
+   {
+      value = glm::min(value, 1023u);
+      value = (value | (value << 16)) & 0x030000ffu;
+      value = (value | (value << 8)) & 0x0300f00fu;
+      value = (value | (value << 4)) & 0x030c30c3u;
+      value = (value | (value << 2)) & 0x09249249u;
+      return value;
+   }
+
+   // Stable least significant digit radix sort of 30-bit keys, 8 bits per pass. Every thread
+   // counts the digits of its chunk, the prefix sum over (digit, thread) then gives each
+   // thread its own output ranges to scatter into.
+   static void radixSort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, uint32_t numThreads)
+   {
+      const uint32_t radix = 256;
+      std::vector<uint32_t> sortedKeys(keys.size());
+      std::vector<uint32_t> sortedValues(values.size());
+      std::vector<uint32_t> histograms(numThreads * radix);
+
+      for (uint32_t shift = 0; shift < 30; shift += 8)
+      {
+         std::fill(histograms.begin(), histograms.end(), 0);
+         parallelFor(numThreads, keys.size(), [&](size_t begin, size_t end, uint32_t thread)
+         {
+            uint32_t* histogram = &histograms[thread * radix];
+            for (size_t i = begin; i < end; i++)
+               histogram[(keys[i] >> shift) & (radix - 1)]++;
+         });
+
+         uint32_t offset = 0;
+         for (uint32_t digit = 0; digit < radix; digit++)
+         {
+            for (uint32_t thread = 0; thread < numThreads; thread++)
+            {
+               uint32_t count = histograms[thread * radix + digit];
+               histograms[thread * radix + digit] = offset;
+               offset += count;
+            }
+         }
+
+         parallelFor(numThreads, keys.size(), [&](size_t begin, size_t end, uint32_t thread)
+         {
+            uint32_t* offsets = &histograms[thread * radix];
+            for (size_t i = begin; i < end; i++)
+            {
+               uint32_t destination = offsets[(keys[i] >> shift) & (radix - 1)]++;
+               sortedKeys[destination] = keys[i];
+               sortedValues[destination] = values[i];
+            }
+         });
+
+         keys.swap(sortedKeys);
+         values.swap(sortedValues);
+      }
+   }
+
+   void optimizeSubtree(uint32_t nodeIndex, uint32_t depth, std::vector<float>& costs, std::vector<uint8_t>& heights)
+   {
+      const BVHNode& node = nodes[nodeIndex];
+      if (node.count == 0)
+      {
+         optimizeSubtree(node.leftFirst, depth + 1, costs, heights);
+         optimizeSubtree(node.leftFirst + 1, depth + 1, costs, heights);
+      }
+      optimizeTreelet(nodeIndex, depth, costs, heights);
+   }
+
+   // Expects the costs and heights of everything below nodeIndex to be final
+   void optimizeTreelet(uint32_t nodeIndex, uint32_t depth, std::vector<float>& costs, std::vector<uint8_t>& heights)
+   {
+      const uint32_t maxTreeletLeaves = 7;
+      BVHNode& root = nodes[nodeIndex];
+      float area = root.bounds.surfaceArea();
+
+      if (root.count > 0)
+      {
+         costs[nodeIndex] = area * intersectionCost(root.count);
+         heights[nodeIndex] = 0;
+         return;
+      }
+
+      uint32_t leaves[maxTreeletLeaves] = { root.leftFirst, root.leftFirst + 1 };
+      uint32_t pairs[maxTreeletLeaves - 1] = { root.leftFirst };
+      uint32_t numLeaves = 2;
+
+      while (numLeaves < maxTreeletLeaves)
+      {
+         int32_t largest = -1;
+         float largestArea = -1.0f;
+         for (uint32_t i = 0; i < numLeaves; i++)
+         {
+            float leafArea = nodes[leaves[i]].bounds.surfaceArea();
+            if (nodes[leaves[i]].count == 0 && leafArea > largestArea)
+            {
+               largest = i;
+               largestArea = leafArea;
+            }
+         }
+
+         if (largest < 0)
+            break;
+
+         uint32_t opened = leaves[largest];
+         pairs[numLeaves - 1] = nodes[opened].leftFirst;
+         leaves[largest] = nodes[opened].leftFirst;
+         leaves[numLeaves++] = nodes[opened].leftFirst + 1;
+      }
+
+      float currentCost = area + costs[root.leftFirst] + costs[root.leftFirst + 1];
+      uint32_t currentHeight = 1 + glm::max(heights[root.leftFirst], heights[root.leftFirst + 1]);
+
+      // Best cost and split of every subset of the treelet leaves, subsets only contain
+      // smaller ones so increasing order visits them first
+      const uint32_t numSubsets = 1u << numLeaves;
+      AABB subsetBounds[1 << maxTreeletLeaves];
+      float subsetCosts[1 << maxTreeletLeaves];
+      uint32_t subsetSplits[1 << maxTreeletLeaves];
+      uint32_t subsetHeights[1 << maxTreeletLeaves];
+
+      for (uint32_t subset = 1; subset < numSubsets; subset++)
+      {
+         uint32_t lowest = subset & (~subset + 1);
+         if (subset == lowest)
+         {
+            uint32_t leaf = leaves[countTrailingZeros(subset)];
+            subsetBounds[subset] = nodes[leaf].bounds;
+            subsetCosts[subset] = costs[leaf];
+            subsetHeights[subset] = heights[leaf];
+            continue;
+         }
+
+         subsetBounds[subset] = subsetBounds[subset ^ lowest];
+         subsetBounds[subset].grow(subsetBounds[lowest]);
+
+         float bestCost = FLT_MAX;
+         uint32_t bestSplit = 0;
+         for (uint32_t part = (subset - 1) & subset; part != 0; part = (part - 1) & subset)
+         {
+            if ((part & lowest) == 0)
+               continue;
+
+            float partitionCost = subsetCosts[part] + subsetCosts[subset ^ part];
+            if (partitionCost < bestCost)
+            {
+               bestCost = partitionCost;
+               bestSplit = part;
+            }
+         }
+
+         subsetCosts[subset] = subsetBounds[subset].surfaceArea() + bestCost;
+         subsetSplits[subset] = bestSplit;
+         subsetHeights[subset] = 1 + glm::max(subsetHeights[bestSplit], subsetHeights[subset ^ bestSplit]);
+      }
+
+      // Keep the treelet unless the new topology is cheaper and the tree stays within maxDepth
+      const uint32_t all = numSubsets - 1;
+      if (subsetCosts[all] >= currentCost * 0.999f || depth + subsetHeights[all] >= maxDepth)
+      {
+         costs[nodeIndex] = currentCost;
+         heights[nodeIndex] = (uint8_t)currentHeight;
+         return;
+      }
+
+      BVHNode leafNodes[maxTreeletLeaves];
+      float leafCosts[maxTreeletLeaves];
+      uint8_t leafHeights[maxTreeletLeaves];
+      for (uint32_t i = 0; i < numLeaves; i++)
+      {
+         leafNodes[i] = nodes[leaves[i]];
+         leafCosts[i] = costs[leaves[i]];
+         leafHeights[i] = heights[leaves[i]];
+      }
+
+      uint32_t nextPair = 0;
+      auto emit = [&](auto& self, uint32_t subset, uint32_t output) -> void
+      {
+         if ((subset & (subset - 1)) == 0)
+         {
+            uint32_t leaf = countTrailingZeros(subset);
+            nodes[output] = leafNodes[leaf];
+            costs[output] = leafCosts[leaf];
+            heights[output] = leafHeights[leaf];
+            return;
+         }
+
+         uint32_t pair = pairs[nextPair++];
+         nodes[output] = { subsetBounds[subset], pair, 0 };
+         costs[output] = subsetCosts[subset];
+         heights[output] = (uint8_t)subsetHeights[subset];
+         self(self, subsetSplits[subset], pair);
+         self(self, subset ^ subsetSplits[subset], pair + 1);
+      };
+      emit(emit, all, nodeIndex);
+   }
+
+   struct Bin
+   {
+      AABB bounds;
+      uint32_t count = 0;
+   };
+
+   float intersectionCost(uint32_t count) const
+   {
+      return (float)((count + batchSize - 1) / batchSize);
+   }
+
+   uint32_t batchSize = 1;
+
+   void subdivide(uint32_t nodeIndex, uint32_t depth, const std::vector<AABB>& primitiveBounds, const std::vector<glm::vec3>& centroids)
+   {
+      BVHNode& node = nodes[nodeIndex];
+      const uint32_t first = node.leftFirst;
+      const uint32_t count = node.count;
+
+      AABB centroidBounds;
+      for (uint32_t i = first; i < first + count; i++)
+      {
+         node.bounds.grow(primitiveBounds[primitiveIndices[i]]);
+         centroidBounds.grow(centroids[primitiveIndices[i]]);
+      }
+
+      if (count == 1 || depth >= maxDepth)
+         return;
+
+      // Sweep the bin boundaries of every axis and keep the cheapest split
+      int32_t bestAxis = -1;
+      uint32_t bestSplit = 0;
+      float bestCost = FLT_MAX;
+
+      for (int32_t axis = 0; axis < 3; axis++)
+      {
+         float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+         if (extent <= 0.0f)
+            continue;
+
+         Bin bins[numBins];
+         float scale = numBins / extent;
+         for (uint32_t i = first; i < first + count; i++)
+         {
+            uint32_t primitive = primitiveIndices[i];
+            uint32_t binIndex = glm::min(numBins - 1, (uint32_t)((centroids[primitive][axis] - centroidBounds.min[axis]) * scale));
+            bins[binIndex].bounds.grow(primitiveBounds[primitive]);
+            bins[binIndex].count++;
+         }
+
+         float leftArea[numBins - 1];
+         uint32_t leftCount[numBins - 1];
+         AABB leftBox;
+         uint32_t leftSum = 0;
+         for (uint32_t i = 0; i < numBins - 1; i++)
+         {
+            leftBox.grow(bins[i].bounds);
+            leftSum += bins[i].count;
+            leftArea[i] = leftSum > 0 ? leftBox.surfaceArea() : 0.0f;
+            leftCount[i] = leftSum;
+         }
+
+         AABB rightBox;
+         uint32_t rightSum = 0;
+         for (uint32_t i = numBins - 1; i > 0; i--)
+         {
+            rightBox.grow(bins[i].bounds);
+            rightSum += bins[i].count;
+            float cost = intersectionCost(leftCount[i - 1]) * leftArea[i - 1] + intersectionCost(rightSum) * (rightSum > 0 ? rightBox.surfaceArea() : 0.0f);
+            if (cost < bestCost)
+            {
+               bestCost = cost;
+               bestAxis = axis;
+               bestSplit = i;
+            }
+         }
+      }
+
+      if (bestAxis == -1)
+         return;
+
+      // Costs are relative to the parent area, intersecting a primitive and stepping a node cost the same
+      float leafCost = intersectionCost(count);
+      float splitCost = 1.0f + bestCost / node.bounds.surfaceArea();
+      if (splitCost >= leafCost && count <= maxLeafSize)
+         return;
+
+      float scale = numBins / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+      float axisMin = centroidBounds.min[bestAxis];
+      auto middle = std::partition(primitiveIndices.begin() + first, primitiveIndices.begin() + first + count, [&](uint32_t primitive)
+      {
+         uint32_t binIndex = glm::min(numBins - 1, (uint32_t)((centroids[primitive][bestAxis] - axisMin) * scale));
+         return binIndex < bestSplit;
+      });
+
+      uint32_t leftCount = (uint32_t)(middle - primitiveIndices.begin()) - first;
+      if (leftCount == 0 || leftCount == count)
+         return;
+
+      uint32_t leftChild = (uint32_t)nodes.size();
+      nodes.push_back({ AABB(), first, leftCount });
+      nodes.push_back({ AABB(), first + leftCount, count - leftCount });
+
+      // push_back() may have reallocated, don't use the node reference from here on
+      nodes[nodeIndex].leftFirst = leftChild;
+      nodes[nodeIndex].count = 0;
+
+      subdivide(leftChild, depth + 1, primitiveBounds, centroids);
+      subdivide(leftChild + 1, depth + 1, primitiveBounds, centroids);
+   }
+};
+
+// Pointers into structure-of-arrays sphere storage, padded so that kernels may read
+// up to 7 spheres past the end of a range
+struct SphereArrays
+{
+   const float* centerX;
+   const float* centerY;
+   const float* centerZ;
+   const float* radius;
+};
+
+// Sphere kernels return the index of the closest sphere in [first, first + count) that the ray
+// hits within [t_min, closestHit] and shrink closestHit to it, or -1 if none is hit
+typedef int32_t (*SphereKernel)(const SphereArrays& spheres, const Ray& ray, uint32_t first, uint32_t count, float t_min, float& closestHit);
+
+int32_t intersectSpheresScalar(const SphereArrays& spheres, const Ray& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   int32_t closest = -1;
+   float a = glm::length2(ray.dir);
+
+   for (uint32_t i = first; i < first + count; i++)
+   {
+      glm::vec3 originToCenter = ray.origin - glm::vec3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]);
+      float half_b = glm::dot(originToCenter, ray.dir);
+      float c = glm::length2(originToCenter) - spheres.radius[i] * spheres.radius[i];
+      float discriminant = half_b * half_b - a * c;
+
+      if (discriminant < 0)
+         continue;
+
+      float sqrtd = glm::sqrt(discriminant);
+      float root = (-half_b - sqrtd) / a;
+      if (root < t_min || root > closestHit)
+      {
+         root = (-half_b + sqrtd) / a;
+         if (root < t_min || root > closestHit)
+            continue;
+      }
+
+      closestHit = root;
+      closest = i;
+   }
+
+   return closest;
+}
+
+#if SIMD_X86
+TARGET_SSE41 int32_t intersectSpheresSSE41(const SphereArrays& spheres, const Ray& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   const __m128 originX = _mm_set1_ps(ray.origin.x);
+   const __m128 originY = _mm_set1_ps(ray.origin.y);
+   const __m128 originZ = _mm_set1_ps(ray.origin.z);
+   const __m128 dirX = _mm_set1_ps(ray.dir.x);
+   const __m128 dirY = _mm_set1_ps(ray.dir.y);
+   const __m128 dirZ = _mm_set1_ps(ray.dir.z);
+   const __m128 a = _mm_set1_ps(glm::length2(ray.dir));
+   const __m128 tMin = _mm_set1_ps(t_min);
+   const __m128 infinity = _mm_set1_ps(FLT_MAX);
+   const __m128 laneIndices = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+   int32_t closest = -1;
+
+   for (uint32_t i = 0; i < count; i += 4)
+   {
+      const uint32_t base = first + i;
+      __m128 ocX = _mm_sub_ps(originX, _mm_loadu_ps(spheres.centerX + base));
+      __m128 ocY = _mm_sub_ps(originY, _mm_loadu_ps(spheres.centerY + base));
+      __m128 ocZ = _mm_sub_ps(originZ, _mm_loadu_ps(spheres.centerZ + base));
+      __m128 radius = _mm_loadu_ps(spheres.radius + base);
+
+      __m128 halfB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocX, dirX), _mm_mul_ps(ocY, dirY)), _mm_mul_ps(ocZ, dirZ));
+      __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocX, ocX), _mm_mul_ps(ocY, ocY)), _mm_mul_ps(ocZ, ocZ)), _mm_mul_ps(radius, radius));
+      __m128 discriminant = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(a, c));
+
+      __m128 valid = _mm_and_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()), _mm_cmplt_ps(laneIndices, _mm_set1_ps((float)(count - i))));
+      if (_mm_movemask_ps(valid) == 0)
+         continue;
+
+      __m128 tMax = _mm_set1_ps(closestHit);
+      __m128 sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+      __m128 minusHalfB = _mm_sub_ps(_mm_setzero_ps(), halfB);
+      __m128 nearRoot = _mm_div_ps(_mm_sub_ps(minusHalfB, sqrtd), a);
+      __m128 farRoot = _mm_div_ps(_mm_add_ps(minusHalfB, sqrtd), a);
+      __m128 nearValid = _mm_and_ps(_mm_cmpge_ps(nearRoot, tMin), _mm_cmple_ps(nearRoot, tMax));
+      __m128 root = _mm_blendv_ps(farRoot, nearRoot, nearValid);
+      valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(root, tMin), _mm_cmple_ps(root, tMax)));
+      if (_mm_movemask_ps(valid) == 0)
+         continue;
+
+      root = _mm_blendv_ps(infinity, root, valid);
+      __m128 minRoot = _mm_min_ps(root, _mm_shuffle_ps(root, root, _MM_SHUFFLE(2, 3, 0, 1)));
+      minRoot = _mm_min_ps(minRoot, _mm_shuffle_ps(minRoot, minRoot, _MM_SHUFFLE(1, 0, 3, 2)));
+
+      uint32_t lane = countTrailingZeros(_mm_movemask_ps(_mm_cmpeq_ps(root, minRoot)));
+      closestHit = _mm_cvtss_f32(minRoot);
+      closest = base + lane;
+   }
+
+   return closest;
+}
+
+TARGET_AVX2 int32_t intersectSpheresAVX2(const SphereArrays& spheres, const Ray& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   const __m256 originX = _mm256_set1_ps(ray.origin.x);
+   const __m256 originY = _mm256_set1_ps(ray.origin.y);
+   const __m256 originZ = _mm256_set1_ps(ray.origin.z);
+   const __m256 dirX = _mm256_set1_ps(ray.dir.x);
+   const __m256 dirY = _mm256_set1_ps(ray.dir.y);
+   const __m256 dirZ = _mm256_set1_ps(ray.dir.z);
+   const __m256 a = _mm256_set1_ps(glm::length2(ray.dir));
+   const __m256 tMin = _mm256_set1_ps(t_min);
+   const __m256 infinity = _mm256_set1_ps(FLT_MAX);
+   const __m256 laneIndices = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+   int32_t closest = -1;
+
+   for (uint32_t i = 0; i < count; i += 8)
+   {
+      const uint32_t base = first + i;
+      __m256 ocX = _mm256_sub_ps(originX, _mm256_loadu_ps(spheres.centerX + base));
+      __m256 ocY = _mm256_sub_ps(originY, _mm256_loadu_ps(spheres.centerY + base));
+      __m256 ocZ = _mm256_sub_ps(originZ, _mm256_loadu_ps(spheres.centerZ + base));
+      __m256 radius = _mm256_loadu_ps(spheres.radius + base);
+
+      __m256 halfB = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocX, dirX), _mm256_mul_ps(ocY, dirY)), _mm256_mul_ps(ocZ, dirZ));
+      __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocX, ocX), _mm256_mul_ps(ocY, ocY)), _mm256_mul_ps(ocZ, ocZ)), _mm256_mul_ps(radius, radius));
+      __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(halfB, halfB), _mm256_mul_ps(a, c));
+
+      __m256 valid = _mm256_and_ps(_mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(laneIndices, _mm256_set1_ps((float)(count - i)), _CMP_LT_OQ));
+      if (_mm256_movemask_ps(valid) == 0)
+         continue;
+
+      __m256 tMax = _mm256_set1_ps(closestHit);
+      __m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(discriminant, _mm256_setzero_ps()));
+      __m256 minusHalfB = _mm256_sub_ps(_mm256_setzero_ps(), halfB);
+      __m256 nearRoot = _mm256_div_ps(_mm256_sub_ps(minusHalfB, sqrtd), a);
+      __m256 farRoot = _mm256_div_ps(_mm256_add_ps(minusHalfB, sqrtd), a);
+      __m256 nearValid = _mm256_and_ps(_mm256_cmp_ps(nearRoot, tMin, _CMP_GE_OQ), _mm256_cmp_ps(nearRoot, tMax, _CMP_LE_OQ));
+      __m256 root = _mm256_blendv_ps(farRoot, nearRoot, nearValid);
+      valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(root, tMin, _CMP_GE_OQ), _mm256_cmp_ps(root, tMax, _CMP_LE_OQ)));
+      if (_mm256_movemask_ps(valid) == 0)
+         continue;
+
+      root = _mm256_blendv_ps(infinity, root, valid);
+      __m256 minRoot = _mm256_min_ps(root, _mm256_permute_ps(root, _MM_SHUFFLE(2, 3, 0, 1)));
+      minRoot = _mm256_min_ps(minRoot, _mm256_permute_ps(minRoot, _MM_SHUFFLE(1, 0, 3, 2)));
+      minRoot = _mm256_min_ps(minRoot, _mm256_permute2f128_ps(minRoot, minRoot, 1));
+
+      uint32_t lane = countTrailingZeros(_mm256_movemask_ps(_mm256_cmp_ps(root, minRoot, _CMP_EQ_OQ)));
+      closestHit = _mm256_cvtss_f32(minRoot);
+      closest = base + lane;
+   }
+
+   return closest;
+}
+#endif
+
+SphereKernel getSphereKernel(SimdLevel level)
+{
+#if SIMD_X86
+   if (level == SimdLevel::AVX2)
+      return intersectSpheresAVX2;
+   if (level == SimdLevel::SSE41)
+      return intersectSpheresSSE41;
+#endif
+   return intersectSpheresScalar;
+}
+
+// Spheres stored as a structure of arrays with their own BVH. After build() the arrays are
+// sorted into BVH leaf order, so every leaf is a contiguous range that the widest kernel
+// supported by the CPU intersects in one go.
+class SphereGroup : public Object
+{
+public:
+   static const uint32_t padding = 7;
+
+   SphereGroup()
+   {
+      kernel = getSphereKernel(getSimdLevel());
+   }
+
+   void reserve(size_t count)
+   {
+      centerX.reserve(count + padding);
+      centerY.reserve(count + padding);
+      centerZ.reserve(count + padding);
+      radii.reserve(count + padding);
+      materialIds.reserve(count);
+   }
+
+   void addSphere(glm::vec3 center, float radius, uint32_t materialId)
+   {
+      // Drops the kernel padding of a previous build, it is added again by the next one
+      centerX.resize(materialIds.size());
+      centerY.resize(materialIds.size());
+      centerZ.resize(materialIds.size());
+      radii.resize(materialIds.size());
+
+      centerX.push_back(center.x);
+      centerY.push_back(center.y);
+      centerZ.push_back(center.z);
+      radii.push_back(radius);
+      materialIds.push_back(materialId);
+   }
+
+   virtual void build(const BVHBuildOptions& options) override
+   {
+      // Spheres and nodes from a scene cache are final, only the traversal layout is derived
+      if (mapping)
+      {
+         bvh.setLayout(options.layout);
+         return;
+      }
+
+      const uint32_t numSpheres = (uint32_t)materialIds.size();
+      centerX.resize(numSpheres);
+      centerY.resize(numSpheres);
+      centerZ.resize(numSpheres);
+      radii.resize(numSpheres);
+
+      std::vector<AABB> bounds(numSpheres);
+      for (uint32_t i = 0; i < numSpheres; i++)
+      {
+         glm::vec3 center = glm::vec3(centerX[i], centerY[i], centerZ[i]);
+         bounds[i] = AABB(center - glm::vec3(radii[i]), center + glm::vec3(radii[i]));
+      }
+
+      bvh.build(bounds, leafBatchSize(), options);
+
+      auto reorder = [&](auto& values)
+      {
+         auto sorted = values;
+         for (uint32_t i = 0; i < numSpheres; i++)
+            sorted[i] = values[bvh.primitiveIndices[i]];
+         values.swap(sorted);
+      };
+
+      reorder(centerX);
+      reorder(centerY);
+      reorder(centerZ);
+      reorder(radii);
+      reorder(materialIds);
+      std::iota(bvh.primitiveIndices.begin(), bvh.primitiveIndices.end(), 0);
+
+      centerX.resize(numSpheres + padding, 0.0f);
+      centerY.resize(numSpheres + padding, 0.0f);
+      centerZ.resize(numSpheres + padding, 0.0f);
+      radii.resize(numSpheres + padding, 0.0f);
+   }
+
+   // Spheres per leaf batch, the width of the SIMD kernel
+   static uint32_t leafBatchSize() { return getSimdLevel() == SimdLevel::AVX2 ? 8 : 4; }
+
+   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) override
+   {
+      SphereArrays spheres = arrays();
+      int32_t closest = -1;
+      float t = t_max;
+
+      bvh.traverse(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         int32_t index = kernel(spheres, ray, first, count, t_min, closestHit);
+         if (index < 0)
+            return false;
+
+         closest = index;
+         t = closestHit;
+         return true;
+      });
+
+      if (closest < 0)
+         return false;
+
+      // Only the final closest hit pays for the full record
+      glm::vec3 center = glm::vec3(spheres.centerX[closest], spheres.centerY[closest], spheres.centerZ[closest]);
+      hitRecord.t = t;
+      hitRecord.pos = ray.at(t);
+      hitRecord.setFaceNormal(ray, (hitRecord.pos - center) / spheres.radius[closest]);
+      hitRecord.materialId = materialIdData()[closest];
+      hitRecord.primitiveId = (uint32_t)closest;
+      return true;
+   }
+
+   virtual bool occluded(const Ray& ray, float t_min, float t_max) override
+   {
+      SphereArrays spheres = arrays();
+      return bvh.traverseAny(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         return kernel(spheres, ray, first, count, t_min, closestHit) >= 0;
+      });
+   }
+
+   virtual void hitPacket(RayPacket& packet, float t_min, uint32_t firstActive) override
+   {
+      SphereArrays spheres = arrays();
+      int32_t closest[RayPacket::maxSize];
+      std::fill(closest, closest + packet.size, -1);
+
+      bvh.traversePacket(packet, t_min, firstActive, [&](uint32_t first, uint32_t count, float t_min, uint32_t active)
+      {
+         for (uint32_t i = active; i < packet.size; i++)
+         {
+            int32_t index = kernel(spheres, packet.rays[i], first, count, t_min, packet.tMax[i]);
+            if (index >= 0)
+               closest[i] = index;
+         }
+      });
+
+      for (uint32_t i = firstActive; i < packet.size; i++)
+      {
+         if (closest[i] < 0)
+            continue;
+
+         const Ray& ray = packet.rays[i];
+         HitRecord& hitRecord = packet.hitRecords[i];
+         glm::vec3 center = glm::vec3(spheres.centerX[closest[i]], spheres.centerY[closest[i]], spheres.centerZ[closest[i]]);
+         hitRecord.t = packet.tMax[i];
+         hitRecord.pos = ray.at(hitRecord.t);
+         hitRecord.setFaceNormal(ray, (hitRecord.pos - center) / spheres.radius[closest[i]]);
+         hitRecord.materialId = materialIdData()[closest[i]];
+         hitRecord.primitiveId = (uint32_t)closest[i];
+         packet.hits[i] = true;
+      }
+   }
+
+   virtual AABB boundingBox() const override
+   {
+      return bvh.numNodes() == 0 ? AABB() : bvh.nodeData()[0].bounds;
+   }
+
+   SphereArrays arrays() const
+   {
+      if (mapping)
+         return mappedSpheres;
+      return { centerX.data(), centerY.data(), centerZ.data(), radii.data() };
+   }
+
+   const uint32_t* materialIdData() const { return mapping ? mappedMaterialIds : materialIds.data(); }
+
+   // Points the group at arrays and nodes inside a scene cache, which the group keeps mapped.
+   // The arrays need the same padding as the ones build() creates.
+   void attach(std::shared_ptr<const MappedFile> file, const SphereArrays& spheres, const uint32_t* sphereMaterialIds, uint32_t count,
+               const BVHNode* nodes, uint32_t numNodes)
+   {
+      centerX.clear();
+      centerY.clear();
+      centerZ.clear();
+      radii.clear();
+      materialIds.clear();
+      mapping = file;
+      mappedSpheres = spheres;
+      mappedMaterialIds = sphereMaterialIds;
+      numMappedSpheres = count;
+      bvh.attach(nodes, numNodes);
+   }
+
+   virtual size_t numPrimitives() const override { return numSpheres(); }
+
+   const BVH& getBVH() const { return bvh; }
+
+   uint32_t numSpheres() const { return mapping ? numMappedSpheres : (uint32_t)materialIds.size(); }
+   void setKernel(SimdLevel level) { kernel = getSphereKernel(level); }
+
+private:
+   AlignedVector<float> centerX;
+   AlignedVector<float> centerY;
+   AlignedVector<float> centerZ;
+   AlignedVector<float> radii;
+   AlignedVector<uint32_t> materialIds;
+   SphereKernel kernel;
+   BVH bvh;
+
+   std::shared_ptr<const MappedFile> mapping;
+   SphereArrays mappedSpheres = {};
+   const uint32_t* mappedMaterialIds = nullptr;
+   uint32_t numMappedSpheres = 0;
+};
+
+// Ray in the sheared space of the watertight ray/triangle test (Woop, Benthin and Wald 2013).
+// The axis along which the ray is longest becomes z and the ray is sheared to point along
+// it, so the test reduces to 2D edge functions around the origin. Two triangles sharing an
+// edge evaluate it with the same arithmetic, which leaves no gaps for rays to slip through.
+struct WatertightRay
+{
+   WatertightRay() {}
+   WatertightRay(const Ray& ray) : origin(ray.origin)
+   {
+      glm::vec3 absDir = glm::abs(ray.dir);
+      kz = absDir.x > absDir.y ? (absDir.x > absDir.z ? 0 : 2) : (absDir.y > absDir.z ? 1 : 2);
+      kx = (kz + 1) % 3;
+      ky = (kx + 1) % 3;
+      if (ray.dir[kz] < 0.0f)
+         std::swap(kx, ky);
+
+      shearX = ray.dir[kx] / ray.dir[kz];
+      shearY = ray.dir[ky] / ray.dir[kz];
+      shearZ = 1.0f / ray.dir[kz];
+   }
+
+   glm::vec3 origin;
+   uint32_t kx, ky, kz;
+   float shearX, shearY, shearZ;
+};
+
+// Triangle corners as one array per corner and axis, in the order of the mesh BVH leaves
+struct TriangleArrays
+{
+   const float* vertices[3][3];
+};
+
+typedef int32_t (*TriangleKernel)(const TriangleArrays& triangles, const WatertightRay& ray, uint32_t first, uint32_t count, float t_min, float& closestHit);
+
+inline bool intersectTriangle(const TriangleArrays& triangles, const WatertightRay& ray, uint32_t i, float t_min, float t_max, float& t)
+{
+   glm::vec3 sheared[3];
+   for (uint32_t v = 0; v < 3; v++)
+   {
+      float z = triangles.vertices[v][ray.kz][i] - ray.origin[ray.kz];
+      sheared[v].x = (triangles.vertices[v][ray.kx][i] - ray.origin[ray.kx]) - ray.shearX * z;
+      sheared[v].y = (triangles.vertices[v][ray.ky][i] - ray.origin[ray.ky]) - ray.shearY * z;
+      sheared[v].z = ray.shearZ * z;
+   }
+
+   float u = sheared[2].x * sheared[1].y - sheared[2].y * sheared[1].x;
+   float v = sheared[0].x * sheared[2].y - sheared[0].y * sheared[2].x;
+   float w = sheared[1].x * sheared[0].y - sheared[1].y * sheared[0].x;
+
+   // The ray passes through an edge or vertex, recompute in double precision to decide the
+   // side consistently for all triangles that share it
+   if (u == 0.0f || v == 0.0f || w == 0.0f)
+   {
+      u = (float)((double)sheared[2].x * sheared[1].y - (double)sheared[2].y * sheared[1].x);
+      v = (float)((double)sheared[0].x * sheared[2].y - (double)sheared[0].y * sheared[2].x);
+      w = (float)((double)sheared[1].x * sheared[0].y - (double)sheared[1].y * sheared[0].x);
+   }
+
+   if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+      return false;
+
+   float det = u + v + w;
+   if (det == 0.0f)
+      return false;
+
+   t = (u * sheared[0].z + v * sheared[1].z + w * sheared[2].z) / det;
+   return t >= t_min && t <= t_max;
+}
+
+int32_t intersectTrianglesScalar(const TriangleArrays& triangles, const WatertightRay& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   int32_t closest = -1;
+   for (uint32_t i = first; i < first + count; i++)
+   {
+      float t;
+      if (intersectTriangle(triangles, ray, i, t_min, closestHit, t))
+      {
+         closestHit = t;
+         closest = i;
+      }
+   }
+   return closest;
+}
+
+#if SIMD_X86
+// The SIMD kernels follow the scalar arithmetic exactly. Blocks where the ray passes through
+// an edge or vertex of a triangle are rare and handed to the scalar kernel for its double
+// precision fallback.
+TARGET_SSE41 int32_t intersectTrianglesSSE41(const TriangleArrays& triangles, const WatertightRay& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   const __m128 originX = _mm_set1_ps(ray.origin[ray.kx]);
+   const __m128 originY = _mm_set1_ps(ray.origin[ray.ky]);
+   const __m128 originZ = _mm_set1_ps(ray.origin[ray.kz]);
+   const __m128 shearX = _mm_set1_ps(ray.shearX);
+   const __m128 shearY = _mm_set1_ps(ray.shearY);
+   const __m128 shearZ = _mm_set1_ps(ray.shearZ);
+   const __m128 zero = _mm_setzero_ps();
+   const __m128 tMin = _mm_set1_ps(t_min);
+   const __m128 infinity = _mm_set1_ps(FLT_MAX);
+   const __m128 laneIndices = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+   int32_t closest = -1;
+
+   for (uint32_t i = 0; i < count; i += 4)
+   {
+      const uint32_t base = first + i;
+      __m128 x[3], y[3], z[3];
+      for (uint32_t v = 0; v < 3; v++)
+      {
+         __m128 relativeZ = _mm_sub_ps(_mm_loadu_ps(triangles.vertices[v][ray.kz] + base), originZ);
+         x[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(triangles.vertices[v][ray.kx] + base), originX), _mm_mul_ps(shearX, relativeZ));
+         y[v] = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(triangles.vertices[v][ray.ky] + base), originY), _mm_mul_ps(shearY, relativeZ));
+         z[v] = _mm_mul_ps(shearZ, relativeZ);
+      }
+
+      __m128 u = _mm_sub_ps(_mm_mul_ps(x[2], y[1]), _mm_mul_ps(y[2], x[1]));
+      __m128 v = _mm_sub_ps(_mm_mul_ps(x[0], y[2]), _mm_mul_ps(y[0], x[2]));
+      __m128 w = _mm_sub_ps(_mm_mul_ps(x[1], y[0]), _mm_mul_ps(y[1], x[0]));
+
+      __m128 lanes = _mm_cmplt_ps(laneIndices, _mm_set1_ps((float)(count - i)));
+      __m128 onEdge = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+      if (_mm_movemask_ps(_mm_and_ps(onEdge, lanes)) != 0)
+      {
+         int32_t index = intersectTrianglesScalar(triangles, ray, base, glm::min(4u, count - i), t_min, closestHit);
+         closest = index >= 0 ? index : closest;
+         continue;
+      }
+
+      __m128 anyNegative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+      __m128 anyPositive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+      __m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+      __m128 valid = _mm_andnot_ps(_mm_and_ps(anyNegative, anyPositive), _mm_andnot_ps(_mm_cmpeq_ps(det, zero), lanes));
+      if (_mm_movemask_ps(valid) == 0)
+         continue;
+
+      __m128 t = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(u, z[0]), _mm_mul_ps(v, z[1])), _mm_mul_ps(w, z[2])), det);
+      valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, tMin), _mm_cmple_ps(t, _mm_set1_ps(closestHit))));
+      if (_mm_movemask_ps(valid) == 0)
+         continue;
+
+      t = _mm_blendv_ps(infinity, t, valid);
+      __m128 minT = _mm_min_ps(t, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2, 3, 0, 1)));
+      minT = _mm_min_ps(minT, _mm_shuffle_ps(minT, minT, _MM_SHUFFLE(1, 0, 3, 2)));
+
+      uint32_t lane = countTrailingZeros(_mm_movemask_ps(_mm_cmpeq_ps(t, minT)));
+      closestHit = _mm_cvtss_f32(minT);
+      closest = base + lane;
+   }
+
+   return closest;
+}
+
+TARGET_AVX2 int32_t intersectTrianglesAVX2(const TriangleArrays& triangles, const WatertightRay& ray, uint32_t first, uint32_t count, float t_min, float& closestHit)
+{
+   const __m256 originX = _mm256_set1_ps(ray.origin[ray.kx]);
+   const __m256 originY = _mm256_set1_ps(ray.origin[ray.ky]);
+   const __m256 originZ = _mm256_set1_ps(ray.origin[ray.kz]);
+   const __m256 shearX = _mm256_set1_ps(ray.shearX);
+   const __m256 shearY = _mm256_set1_ps(ray.shearY);
+   const __m256 shearZ = _mm256_set1_ps(ray.shearZ);
+   const __m256 zero = _mm256_setzero_ps();
+   const __m256 tMin = _mm256_set1_ps(t_min);
+   const __m256 infinity = _mm256_set1_ps(FLT_MAX);
+   const __m256 laneIndices = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+   int32_t closest = -1;
+
+   for (uint32_t i = 0; i < count; i += 8)
+   {
+      const uint32_t base = first + i;
+      __m256 x[3], y[3], z[3];
+      for (uint32_t v = 0; v < 3; v++)
+      {
+         __m256 relativeZ = _mm256_sub_ps(_mm256_loadu_ps(triangles.vertices[v][ray.kz] + base), originZ);
+         x[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(triangles.vertices[v][ray.kx] + base), originX), _mm256_mul_ps(shearX, relativeZ));
+         y[v] = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(triangles.vertices[v][ray.ky] + base), originY), _mm256_mul_ps(shearY, relativeZ));
+         z[v] = _mm256_mul_ps(shearZ, relativeZ);
+      }
+
+      __m256 u = _mm256_sub_ps(_mm256_mul_ps(x[2], y[1]), _mm256_mul_ps(y[2], x[1]));
+      __m256 v = _mm256_sub_ps(_mm256_mul_ps(x[0], y[2]), _mm256_mul_ps(y[0], x[2]));
+      __m256 w = _mm256_sub_ps(_mm256_mul_ps(x[1], y[0]), _mm256_mul_ps(y[1], x[0]));
+
+      __m256 lanes = _mm256_cmp_ps(laneIndices, _mm256_set1_ps((float)(count - i)), _CMP_LT_OQ);
+      __m256 onEdge = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)), _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+      if (_mm256_movemask_ps(_mm256_and_ps(onEdge, lanes)) != 0)
+      {
+         int32_t index = intersectTrianglesScalar(triangles, ray, base, glm::min(8u, count - i), t_min, closestHit);
+         closest = index >= 0 ? index : closest;
+         continue;
+      }
+
+      __m256 anyNegative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)), _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+      __m256 anyPositive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+      __m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+      __m256 valid = _mm256_andnot_ps(_mm256_and_ps(anyNegative, anyPositive), _mm256_andnot_ps(_mm256_cmp_ps(det, zero, _CMP_EQ_OQ), lanes));
+      if (_mm256_movemask_ps(valid) == 0)
+         continue;
+
+      __m256 t = _mm256_div_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(u, z[0]), _mm256_mul_ps(v, z[1])), _mm256_mul_ps(w, z[2])), det);
+      valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, tMin, _CMP_GE_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(closestHit), _CMP_LE_OQ)));
+      if (_mm256_movemask_ps(valid) == 0)
+         continue;
+
+      t = _mm256_blendv_ps(infinity, t, valid);
+      __m256 minT = _mm256_min_ps(t, _mm256_permute_ps(t, _MM_SHUFFLE(2, 3, 0, 1)));
+      minT = _mm256_min_ps(minT, _mm256_permute_ps(minT, _MM_SHUFFLE(1, 0, 3, 2)));
+      minT = _mm256_min_ps(minT, _mm256_permute2f128_ps(minT, minT, 1));
+
+      uint32_t lane = countTrailingZeros(_mm256_movemask_ps(_mm256_cmp_ps(t, minT, _CMP_EQ_OQ)));
+      closestHit = _mm256_cvtss_f32(minT);
+      closest = base + lane;
+   }
+
+   return closest;
+}
+#endif
+
+TriangleKernel getTriangleKernel(SimdLevel level)
+{
+#if SIMD_X86
+   if (level == SimdLevel::AVX2)
+      return intersectTrianglesAVX2;
+   if (level == SimdLevel::SSE41)
+      return intersectTrianglesSSE41;
+#endif
+   return intersectTrianglesScalar;
+}
+
+// Indexed triangle mesh with one material. build() gathers the corners of every triangle into
+// arrays in BVH leaf order, so the leaf kernels stream through them without indirection.
+class TriangleMesh : public Object
+{
+public:
+   static const uint32_t padding = 7;
+
+   TriangleMesh(uint32_t materialId) : materialId(materialId)
+   {
+      kernel = getTriangleKernel(getSimdLevel());
+   }
+
+   void reserve(size_t numVertices, size_t numTriangles)
+   {
+      positions.reserve(numVertices);
+      indices.reserve(3 * numTriangles);
+   }
+
+   uint32_t addVertex(const glm::vec3& position)
+   {
+      positions.push_back(position);
+      return (uint32_t)positions.size() - 1;
+   }
+
+   void addTriangle(uint32_t a, uint32_t b, uint32_t c)
+   {
+      indices.push_back(a);
+      indices.push_back(b);
+      indices.push_back(c);
+   }
+
+   virtual void build(const BVHBuildOptions& options) override
+   {
+      const uint32_t triangleCount = numTriangles();
+      std::vector<AABB> bounds(triangleCount);
+      for (uint32_t i = 0; i < triangleCount; i++)
+      {
+         for (uint32_t v = 0; v < 3; v++)
+            bounds[i].grow(positions[indices[3 * i + v]]);
+      }
+
+      bvh.build(bounds, getSimdLevel() == SimdLevel::AVX2 ? 8 : 4, options);
+
+      std::vector<uint32_t> sortedIndices(indices.size());
+      for (uint32_t i = 0; i < triangleCount; i++)
+      {
+         for (uint32_t v = 0; v < 3; v++)
+            sortedIndices[3 * i + v] = indices[3 * bvh.primitiveIndices[i] + v];
+      }
+      indices.swap(sortedIndices);
+      std::iota(bvh.primitiveIndices.begin(), bvh.primitiveIndices.end(), 0);
+
+      for (uint32_t v = 0; v < 3; v++)
+      {
+         for (uint32_t axis = 0; axis < 3; axis++)
+         {
+            corners[v][axis].resize(triangleCount + padding, 0.0f);
+            for (uint32_t i = 0; i < triangleCount; i++)
+               corners[v][axis][i] = positions[indices[3 * i + v]][axis];
+         }
+      }
+   }
+
+   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) override
+   {
+      TriangleArrays triangles = arrays();
+      WatertightRay watertightRay(ray);
+      int32_t closest = -1;
+      float t = t_max;
+
+      bvh.traverse(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         int32_t index = kernel(triangles, watertightRay, first, count, t_min, closestHit);
+         if (index < 0)
+            return false;
+
+         closest = index;
+         t = closestHit;
+         return true;
+      });
+
+      if (closest < 0)
+         return false;
+
+      fillHitRecord(ray, closest, t, hitRecord);
+      return true;
+   }
+
+   virtual bool occluded(const Ray& ray, float t_min, float t_max) override
+   {
+      TriangleArrays triangles = arrays();
+      WatertightRay watertightRay(ray);
+      return bvh.traverseAny(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         return kernel(triangles, watertightRay, first, count, t_min, closestHit) >= 0;
+      });
+   }
+
+   virtual void hitPacket(RayPacket& packet, float t_min, uint32_t firstActive) override
+   {
+      TriangleArrays triangles = arrays();
+      WatertightRay watertightRays[RayPacket::maxSize];
+      int32_t closest[RayPacket::maxSize];
+      for (uint32_t i = firstActive; i < packet.size; i++)
+      {
+         watertightRays[i] = WatertightRay(packet.rays[i]);
+         closest[i] = -1;
+      }
+
+      bvh.traversePacket(packet, t_min, firstActive, [&](uint32_t first, uint32_t count, float t_min, uint32_t active)
+      {
+         for (uint32_t i = active; i < packet.size; i++)
+         {
+            int32_t index = kernel(triangles, watertightRays[i], first, count, t_min, packet.tMax[i]);
+            if (index >= 0)
+               closest[i] = index;
+         }
+      });
+
+      for (uint32_t i = firstActive; i < packet.size; i++)
+      {
+         if (closest[i] < 0)
+            continue;
+
+         fillHitRecord(packet.rays[i], closest[i], packet.tMax[i], packet.hitRecords[i]);
+         packet.hits[i] = true;
+      }
+   }
+
+   virtual AABB boundingBox() const override
+   {
+      return bvh.numNodes() == 0 ? AABB() : bvh.nodeData()[0].bounds;
+   }
+
+   virtual size_t numPrimitives() const override { return numTriangles(); }
+
+   TriangleArrays arrays() const
+   {
+      TriangleArrays triangles;
+      for (uint32_t v = 0; v < 3; v++)
+      {
+         for (uint32_t axis = 0; axis < 3; axis++)
+            triangles.vertices[v][axis] = corners[v][axis].data();
+      }
+      return triangles;
+   }
+
+   uint32_t numVertices() const { return (uint32_t)positions.size(); }
+   uint32_t numTriangles() const { return (uint32_t)(indices.size() / 3); }
+   uint32_t getMaterialId() const { return materialId; }
+   const BVH& getBVH() const { return bvh; }
+   void setKernel(SimdLevel level) { kernel = getTriangleKernel(level); }
+
+   // File the mesh was loaded from, lets scenes that use it be written back
+   std::string source;
+
+private:
+   void fillHitRecord(const Ray& ray, int32_t triangle, float t, HitRecord& hitRecord) const
+   {
+      glm::vec3 v0 = positions[indices[3 * triangle]];
+      glm::vec3 v1 = positions[indices[3 * triangle + 1]];
+      glm::vec3 v2 = positions[indices[3 * triangle + 2]];
+      hitRecord.t = t;
+      hitRecord.pos = ray.at(t);
+      hitRecord.setFaceNormal(ray, glm::normalize(glm::cross(v1 - v0, v2 - v0)));
+      hitRecord.materialId = materialId;
+      hitRecord.primitiveId = (uint32_t)triangle;
+   }
+
+   std::vector<glm::vec3> positions;
+   std::vector<uint32_t> indices;
+   AlignedVector<float> corners[3][3];
+   uint32_t materialId;
+   TriangleKernel kernel;
+   BVH bvh;
+};
+
+// Places shared geometry in the world with an affine transform. The geometry keeps its own
+// acceleration structure, which serves every instance of it, so an instance only costs its
+// transforms and a slot in the top level BVH of the World.
+class Instance : public Object
+{
+public:
+   Instance(std::shared_ptr<Object> geometry, const glm::mat4& objectToWorld)
+      : geometry(geometry), objectToWorld(objectToWorld), worldToObject(glm::inverse(objectToWorld))
+   {
+   }
+
+   virtual bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) override
+   {
+      // The direction is not normalized, so distances along the object space ray are the world space ones
+      Ray objectRay(glm::vec3(worldToObject * glm::vec4(ray.origin, 1.0f)), glm::mat3(worldToObject) * ray.dir);
+      if (!geometry->hit(objectRay, t_min, t_max, hitRecord))
+         return false;
+
+      // Normals transform with the inverse transpose, which keeps them on the side the ray came from
+      hitRecord.pos = ray.at(hitRecord.t);
+      hitRecord.normal = glm::normalize(glm::transpose(glm::mat3(worldToObject)) * hitRecord.normal);
+      return true;
+   }
+
+   virtual bool occluded(const Ray& ray, float t_min, float t_max) override
+   {
+      Ray objectRay(glm::vec3(worldToObject * glm::vec4(ray.origin, 1.0f)), glm::mat3(worldToObject) * ray.dir);
+      return geometry->occluded(objectRay, t_min, t_max);
+   }
+
+   virtual AABB boundingBox() const override
+   {
+      AABB objectBounds = geometry->boundingBox();
+      AABB bounds;
+      for (uint32_t corner = 0; corner < 8; corner++)
+      {
+         glm::vec3 position((corner & 1) ? objectBounds.max.x : objectBounds.min.x, (corner & 2) ? objectBounds.max.y : objectBounds.min.y,
+            (corner & 4) ? objectBounds.max.z : objectBounds.min.z);
+         bounds.grow(glm::vec3(objectToWorld * glm::vec4(position, 1.0f)));
+      }
+      return bounds;
+   }
+
+   // Instanced primitives, the geometry itself is stored once
+   virtual size_t numPrimitives() const override { return geometry->numPrimitives(); }
+
+   const std::shared_ptr<Object>& getGeometry() const { return geometry; }
+   const glm::mat4& getTransform() const { return objectToWorld; }
+
+private:
+   std::shared_ptr<Object> geometry;
+   glm::mat4 objectToWorld;
+   glm::mat4 worldToObject;
+};
+
+// A point on a light chosen by LightList::sample()
+struct LightSample
+{
+   glm::vec3 dir;      // Normalized, from the shaded point towards the light
+   float distance;     // Along dir to the light surface
+   float pdf;          // Solid angle density, including the choice of the light
+   glm::vec3 radiance;
+};
+
+// Emissive spheres and meshes of a World, gathered by World::build() for next event
+// estimation. Lights are picked by emitted power. Spheres are sampled uniformly within the
+// cone of directions they subtend, meshes uniformly by area from world space copies of their
+// triangles.
+class LightList
+{
+public:
+   void clear()
+   {
+      lights.clear();
+      lightCdf.clear();
+      triangles.clear();
+      triangleCdf.clear();
+      firstLightOfObject.clear();
+   }
+
+   // objectId and primitiveId are those of the hit records on the sphere, see pdf()
+   void addSphere(const glm::vec3& center, float radius, uint32_t objectId, uint32_t primitiveId, const glm::vec3& emitted)
+   {
+      Light light = {};
+      light.center = center;
+      light.radius = radius;
+      light.area = 4.0f * glm::pi<float>() * radius * radius;
+      light.objectId = objectId;
+      light.primitiveId = primitiveId;
+      light.emitted = emitted;
+      lights.push_back(light);
+   }
+
+   // The whole mesh is one light, hits on any of its triangles in object objectId belong to it
+   void addMesh(const TriangleMesh& mesh, const glm::mat4& objectToWorld, uint32_t objectId, const glm::vec3& emitted)
+   {
+      Light light = {};
+      light.firstTriangle = (uint32_t)triangleCdf.size();
+      light.numTriangles = mesh.numTriangles();
+      light.objectId = objectId;
+      light.emitted = emitted;
+
+      TriangleArrays arrays = mesh.arrays();
+      for (uint32_t i = 0; i < mesh.numTriangles(); i++)
+      {
+         glm::vec3 corners[3];
+         for (uint32_t v = 0; v < 3; v++)
+         {
+            glm::vec3 position = glm::vec3(arrays.vertices[v][0][i], arrays.vertices[v][1][i], arrays.vertices[v][2][i]);
+            corners[v] = glm::vec3(objectToWorld * glm::vec4(position, 1.0f));
+         }
+         triangles.push_back(corners[0]);
+         triangles.push_back(corners[1] - corners[0]);
+         triangles.push_back(corners[2] - corners[0]);
+         light.area += 0.5f * glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+         triangleCdf.push_back(light.area);
+      }
+
+      for (uint32_t i = 0; i < light.numTriangles; i++)
+         triangleCdf[light.firstTriangle + i] /= light.area;
+      if (light.area > 0.0f)
+         lights.push_back(light);
+   }
+
+   // Builds the selection table, called after the last light is added
+   void finalize(uint32_t numObjects)
+   {
+      std::sort(lights.begin(), lights.end(), [](const Light& a, const Light& b)
+      {
+         return a.objectId != b.objectId ? a.objectId < b.objectId : a.primitiveId < b.primitiveId;
+      });
+
+      float totalPower = 0.0f;
+      for (const Light& light : lights)
+         totalPower += luminance(light.emitted) * light.area;
+      if (totalPower <= 0.0f)
+      {
+         clear();
+         return;
+      }
+
+      float power = 0.0f;
+      for (Light& light : lights)
+      {
+         light.probability = luminance(light.emitted) * light.area / totalPower;
+         power += luminance(light.emitted) * light.area;
+         lightCdf.push_back(power / totalPower);
+      }
+
+      firstLightOfObject.assign(numObjects + 1, 0);
+      for (const Light& light : lights)
+         firstLightOfObject[light.objectId + 1]++;
+      for (uint32_t i = 0; i < numObjects; i++)
+         firstLightOfObject[i + 1] += firstLightOfObject[i];
+   }
+
+   bool empty() const { return lights.empty(); }
+   size_t size() const { return lights.size(); }
+
+   // Picks a light with u and a point on it with point, as seen from pos. Fails when the point
+   // cannot see the chosen light, e.g. from inside an emissive sphere.
+   bool sample(const glm::vec3& pos, float u, const glm::vec2& point, LightSample& sample) const
+   {
+      uint32_t index = glm::min((uint32_t)(std::upper_bound(lightCdf.begin(), lightCdf.end(), u) - lightCdf.begin()), (uint32_t)lights.size() - 1);
+      const Light& light = lights[index];
+      sample.radiance = light.emitted;
+
+      if (light.numTriangles == 0)
+      {
+         glm::vec3 toCenter = light.center - pos;
+         float distanceSquared = glm::dot(toCenter, toCenter);
+         float radiusSquared = light.radius * light.radius;
+         if (distanceSquared <= radiusSquared)
+            return false;
+
+         float oneMinusCosThetaMax = coneOpening(distanceSquared, radiusSquared);
+         sample.dir = alignToAxis(uniformCone(point, oneMinusCosThetaMax), toCenter / glm::sqrt(distanceSquared));
+
+         // Near intersection with the sphere, from the distance of the center to the ray
+         float projection = glm::dot(toCenter, sample.dir);
+         glm::vec3 perpendicular = toCenter - projection * sample.dir;
+         sample.distance = projection - glm::sqrt(glm::max(0.0f, radiusSquared - glm::dot(perpendicular, perpendicular)));
+         sample.pdf = light.probability / (2.0f * glm::pi<float>() * oneMinusCosThetaMax);
+         return true;
+      }
+
+      // The choice of the light leaves u uniform within its slice of the table
+      float lower = index > 0 ? lightCdf[index - 1] : 0.0f;
+      float remapped = glm::min((u - lower) / (lightCdf[index] - lower), 1.0f - FLT_EPSILON);
+      const float* cdf = triangleCdf.data() + light.firstTriangle;
+      uint32_t triangle = light.firstTriangle + glm::min((uint32_t)(std::upper_bound(cdf, cdf + light.numTriangles, remapped) - cdf), light.numTriangles - 1);
+
+      const glm::vec3* corner = triangles.data() + 3 * triangle;
+      float root = glm::sqrt(point.x);
+      glm::vec3 position = corner[0] + root * (1.0f - point.y) * corner[1] + root * point.y * corner[2];
+      glm::vec3 toLight = position - pos;
+      sample.distance = glm::length(toLight);
+      if (sample.distance <= 0.0f)
+         return false;
+
+      sample.dir = toLight / sample.distance;
+      float cosine = glm::abs(glm::dot(glm::normalize(glm::cross(corner[1], corner[2])), sample.dir));
+      if (cosine <= 0.0f)
+         return false;
+
+      sample.pdf = light.probability * sample.distance * sample.distance / (cosine * light.area);
+      return true;
+   }
+
+   // Density of sample() choosing the direction from origin to a hit on an emitter, zero if the
+   // emitter is not in the list. The light is found from the object and primitive of the hit.
+   float pdf(const glm::vec3& origin, const HitRecord& hitRecord) const
+   {
+      if (hitRecord.objectId + 1 >= firstLightOfObject.size())
+         return 0.0f;
+
+      // An object holds a single mesh light or sphere lights sorted by primitive
+      const Light* first = lights.data() + firstLightOfObject[hitRecord.objectId];
+      const Light* last = lights.data() + firstLightOfObject[hitRecord.objectId + 1];
+      if (first == last)
+         return 0.0f;
+
+      if (first->numTriangles > 0)
+      {
+         glm::vec3 toLight = hitRecord.pos - origin;
+         float distanceSquared = glm::dot(toLight, toLight);
+         float cosine = glm::abs(glm::dot(hitRecord.normal, toLight)) / glm::sqrt(distanceSquared);
+         return cosine > 0.0f ? first->probability * distanceSquared / (cosine * first->area) : 0.0f;
+      }
+
+      const Light* light = std::lower_bound(first, last, hitRecord.primitiveId, [](const Light& light, uint32_t primitiveId) { return light.primitiveId < primitiveId; });
+      if (light == last || light->primitiveId != hitRecord.primitiveId)
+         return 0.0f;
+
+      glm::vec3 toCenter = light->center - origin;
+      float distanceSquared = glm::dot(toCenter, toCenter);
+      float radiusSquared = light->radius * light->radius;
+      if (distanceSquared <= radiusSquared)
+         return 0.0f;
+      return light->probability / (2.0f * glm::pi<float>() * coneOpening(distanceSquared, radiusSquared));
+   }
+
+private:
+   struct Light
+   {
+      glm::vec3 center;       // Spheres
+      float radius;
+      uint32_t firstTriangle; // Meshes, into triangles and triangleCdf
+      uint32_t numTriangles;
+      float area;
+      float probability;      // Of being picked by sample()
+      uint32_t objectId;      // Of the hit records on the light
+      uint32_t primitiveId;   // Spheres
+      glm::vec3 emitted;
+   };
+
+   // 1 - cos of the half angle of the cone a sphere subtends, without cancellation for far lights
+   static float coneOpening(float distanceSquared, float radiusSquared)
+   {
+      float sinThetaMaxSquared = radiusSquared / distanceSquared;
+      return sinThetaMaxSquared / (1.0f + glm::sqrt(glm::max(0.0f, 1.0f - sinThetaMaxSquared)));
+   }
+
+   std::vector<Light> lights;
+   std::vector<float> lightCdf;                // Normalized prefix sums of the light powers
+   std::vector<glm::vec3> triangles;           // First corner and both edges of every mesh light triangle
+   std::vector<float> triangleCdf;             // Normalized prefix sums of the triangle areas, per mesh light
+   std::vector<uint32_t> firstLightOfObject;   // Lights are sorted by object and primitive
+};
+
+class World
+{
+public:
+   void addObject(std::shared_ptr<Object> object)
+   {
+      objects.push_back(object);
+   }
+
+   void reserveMaterials(size_t count)
+   {
+      materials.reserve(count);
+   }
+
+   // The world owns its materials, hit records only carry the returned index
+   uint32_t addMaterial(const Material& material)
+   {
+      materials.push_back(material);
+      return (uint32_t)materials.size() - 1;
+   }
+
+   const Material& getMaterial(uint32_t materialId) const
+   {
+      return materialData()[materialId];
+   }
+
+   const Material* materialData() const { return mappedMaterials ? mappedMaterials : materials.data(); }
+
+   // Scales the sky gradient, black leaves emissive objects as the only light
+   void setSky(const glm::vec3& color) { sky = color; }
+   const glm::vec3& getSky() const { return sky; }
+
+   // Direct light sampling at diffuse hits, takes effect on the next build(). Without it the
+   // light list stays empty and emitters are only found by BSDF sampling.
+   void setLightSampling(bool enabled) { lightSampling = enabled; }
+   const LightList& getLights() const { return lights; }
+   uint32_t numMaterials() const { return mappedMaterials ? numMappedMaterials : (uint32_t)materials.size(); }
+
+   // Uses the material table of a mapped scene cache, which the world keeps mapped
+   void attachMaterials(std::shared_ptr<const MappedFile> file, const Material* data, uint32_t count)
+   {
+      materials.clear();
+      mapping = file;
+      mappedMaterials = data;
+      numMappedMaterials = count;
+   }
+
+   // Builds the acceleration structure, has to be called again after adding objects
+   void build(const BVHBuildOptions& options = BVHBuildOptions())
+   {
+      // Geometry shared by several instances is built once
+      std::vector<Object*> unbuilt;
+      for (const auto& object : objects)
+      {
+         unbuilt.push_back(object.get());
+         if (auto instance = dynamic_cast<const Instance*>(object.get()))
+            unbuilt.push_back(instance->getGeometry().get());
+      }
+      std::sort(unbuilt.begin(), unbuilt.end());
+      unbuilt.erase(std::unique(unbuilt.begin(), unbuilt.end()), unbuilt.end());
+      for (Object* object : unbuilt)
+         object->build(options);
+
+      std::vector<AABB> bounds(objects.size());
+      for (size_t i = 0; i < objects.size(); i++)
+         bounds[i] = objects[i]->boundingBox();
+
+      bvh.build(bounds, 1, options);
+      gatherLights();
+   }
+
+   bool hit(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) const
+   {
+      if (bvh.nodes.empty())
+         return hitLinear(ray, t_min, t_max, hitRecord);
+
+      // Objects only write the record on a hit, so it can be filled in place
+      return bvh.traverse(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         bool hitAnything = false;
+         for (uint32_t i = first; i < first + count; i++)
+         {
+            if (objects[bvh.primitiveIndices[i]]->hit(ray, t_min, closestHit, hitRecord))
+            {
+               closestHit = hitRecord.t;
+               hitRecord.objectId = bvh.primitiveIndices[i];
+               hitAnything = true;
+            }
+         }
+         return hitAnything;
+      });
+   }
+
+   // Any hit between t_min and t_max, for shadow and ambient occlusion rays. Stops at the
+   // first blocker instead of searching for the closest one.
+   bool occluded(const Ray& ray, float t_min, float t_max) const
+   {
+      if (bvh.nodes.empty())
+      {
+         for (const auto& object : objects)
+         {
+            if (object->occluded(ray, t_min, t_max))
+               return true;
+         }
+         return false;
+      }
+
+      return bvh.traverseAny(ray, t_min, t_max, [&](uint32_t first, uint32_t count, float t_min, float& closestHit)
+      {
+         for (uint32_t i = first; i < first + count; i++)
+         {
+            if (objects[bvh.primitiveIndices[i]]->occluded(ray, t_min, closestHit))
+               return true;
+         }
+         return false;
+      });
+   }
+
+   // Closest hits of all rays in the packet, computeBounds() has to be called first
+   void hitPacket(RayPacket& packet, float t_min) const
+   {
+      // Objects don't know their index, the rays an object reports hits for are tagged with it
+      auto hitObject = [&](uint32_t objectId, float t_min, uint32_t active)
+      {
+         bool hits[RayPacket::maxSize];
+         std::copy(packet.hits + active, packet.hits + packet.size, hits + active);
+         std::fill(packet.hits + active, packet.hits + packet.size, false);
+         objects[objectId]->hitPacket(packet, t_min, active);
+         for (uint32_t i = active; i < packet.size; i++)
+         {
+            if (packet.hits[i])
+               packet.hitRecords[i].objectId = objectId;
+            packet.hits[i] = packet.hits[i] || hits[i];
+         }
+      };
+
+      if (bvh.nodes.empty())
+      {
+         for (uint32_t i = 0; i < objects.size(); i++)
+            hitObject(i, t_min, 0);
+         return;
+      }
+
+      bvh.traversePacket(packet, t_min, 0, [&](uint32_t first, uint32_t count, float t_min, uint32_t active)
+      {
+         for (uint32_t i = first; i < first + count; i++)
+            hitObject(bvh.primitiveIndices[i], t_min, active);
+      });
+   }
+
+   // Brute force reference, tests every object
+   bool hitLinear(const Ray& ray, float t_min, float t_max, HitRecord& hitRecord) const
+   {
+      bool hitAnything = false;
+      float closestHit = t_max;
+
+      for (uint32_t i = 0; i < objects.size(); i++)
+      {
+         if (objects[i]->hit(ray, t_min, closestHit, hitRecord))
+         {
+            hitAnything = true;
+            closestHit = hitRecord.t;
+            hitRecord.objectId = i;
+         }
+      }
+
+      return hitAnything;
+   }
+
+   size_t numObjects() const { return objects.size(); }
+
+   size_t numPrimitives() const
+   {
+      size_t count = 0;
+      for (const auto& object : objects)
+         count += object->numPrimitives();
+      return count;
+   }
+
+   const std::vector<std::shared_ptr<Object>>& getObjects() const { return objects; }
+   const BVH& getBVH() const { return bvh; }
+
+private:
+   // Emissive spheres and meshes, instanced meshes included. Emitters of other instanced
+   // geometry are left to BSDF sampling.
+   void gatherLights()
+   {
+      lights.clear();
+      const Material* table = materialData();
+      if (!lightSampling || std::none_of(table, table + numMaterials(), [](const Material& material) { return std::holds_alternative<DiffuseLight>(material); }))
+         return;
+
+      auto emitted = [&](uint32_t materialId)
+      {
+         const DiffuseLight* light = std::get_if<DiffuseLight>(&table[materialId]);
+         return light ? light->emitted : glm::vec3(0.0f);
+      };
+
+      for (uint32_t objectId = 0; objectId < objects.size(); objectId++)
+      {
+         const Object* object = objects[objectId].get();
+         if (auto sphereGroup = dynamic_cast<const SphereGroup*>(object))
+         {
+            SphereArrays spheres = sphereGroup->arrays();
+            const uint32_t* materialIds = sphereGroup->materialIdData();
+            for (uint32_t i = 0; i < sphereGroup->numSpheres(); i++)
+            {
+               if (emitted(materialIds[i]) != glm::vec3(0.0f))
+                  lights.addSphere(glm::vec3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]), spheres.radius[i], objectId, i, emitted(materialIds[i]));
+            }
+         }
+         else if (auto sphere = dynamic_cast<const Sphere*>(object))
+         {
+            if (emitted(sphere->materialId) != glm::vec3(0.0f))
+               lights.addSphere(sphere->center, sphere->radius, objectId, 0, emitted(sphere->materialId));
+         }
+         else if (auto mesh = dynamic_cast<const TriangleMesh*>(object))
+         {
+            if (emitted(mesh->getMaterialId()) != glm::vec3(0.0f))
+               lights.addMesh(*mesh, glm::mat4(1.0f), objectId, emitted(mesh->getMaterialId()));
+         }
+         else if (auto instance = dynamic_cast<const Instance*>(object))
+         {
+            auto instancedMesh = dynamic_cast<const TriangleMesh*>(instance->getGeometry().get());
+            if (instancedMesh && emitted(instancedMesh->getMaterialId()) != glm::vec3(0.0f))
+               lights.addMesh(*instancedMesh, instance->getTransform(), objectId, emitted(instancedMesh->getMaterialId()));
+         }
+      }
+
+      lights.finalize((uint32_t)objects.size());
+   }
+
+   std::vector<std::shared_ptr<Object>> objects;
+   std::vector<Material> materials;
+   LightList lights;
+   glm::vec3 sky = glm::vec3(1.0f);
+   bool lightSampling = true;
+   BVH bvh;
+
+   std::shared_ptr<const MappedFile> mapping;
+   const Material* mappedMaterials = nullptr;
+   uint32_t numMappedMaterials = 0;
+};
+
+// Binary scene cache holding the packed spheres, the material table and the sphere BVH exactly
+// as they lie in memory. Sections are 64-byte aligned and addressed by offsets from the start
+// of the file, so loading is a mmap plus pointer setup and costs the same for any scene size.
+// The key identifies what the scene was created from, a file with a different key, version or
+// type layout is ignored and the caller builds the scene as usual.
+// The key cannot see the code that creates the scene: bump the version whenever
+// createRandomScene() or the SphereGroup build changes what is stored.
+const uint32_t sceneCacheVersion = 2;
+
+struct SceneCacheHeader
+{
+   enum Section { CenterX, CenterY, CenterZ, Radius, MaterialIds, Materials, Nodes, NumSections };
+
+   char magic[4];
+   uint32_t version;
+   uint64_t key;
+   uint64_t layoutHash; // Sizes of the stored types, they are written as raw memory
+   uint64_t fileSize;
+   uint32_t numSpheres;
+   uint32_t numMaterials;
+   uint32_t numNodes;
+   uint32_t reserved;
+   uint64_t offsets[NumSections];
+   uint64_t headerHash; // Of everything above
+};
+
+inline uint64_t sceneCacheLayoutHash()
+{
+   static_assert(std::is_trivially_copyable<Material>::value && std::is_trivially_copyable<BVHNode>::value, "Cached types are written as raw memory");
+
+   const uint64_t sizes[] = { sizeof(Material), alignof(Material), sizeof(BVHNode), sizeof(SceneCacheHeader), SphereGroup::padding };
+   return hashBytes(sizes, sizeof(sizes));
+}
+
+// Everything the generated scene and its BVH are created from, the leaf batch size depends on
+// the SIMD level of the CPU
+inline uint64_t sceneCacheKey(int32_t gridExtent, BVHBuilder builder)
+{
+   uint32_t leafBatchSize = SphereGroup::leafBatchSize();
+   uint64_t key = hashBytes(&gridExtent, sizeof(gridExtent));
+   key = hashBytes(&builder, sizeof(builder), key);
+   return hashBytes(&leafBatchSize, sizeof(leafBatchSize), key);
+}
+
+inline void sceneCacheSectionSizes(uint64_t numSpheres, uint64_t numMaterials, uint64_t numNodes, uint64_t sizes[SceneCacheHeader::NumSections])
+{
+   const uint64_t paddedSpheres = numSpheres + SphereGroup::padding;
+   sizes[SceneCacheHeader::CenterX] = paddedSpheres * sizeof(float);
+   sizes[SceneCacheHeader::CenterY] = paddedSpheres * sizeof(float);
+   sizes[SceneCacheHeader::CenterZ] = paddedSpheres * sizeof(float);
+   sizes[SceneCacheHeader::Radius] = paddedSpheres * sizeof(float);
+   sizes[SceneCacheHeader::MaterialIds] = numSpheres * sizeof(uint32_t);
+   sizes[SceneCacheHeader::Materials] = numMaterials * sizeof(Material);
+   sizes[SceneCacheHeader::Nodes] = numNodes * sizeof(BVHNode);
+}
+
+// Only worlds made of a single built SphereGroup can be cached
+bool saveSceneCache(const std::string& filename, const World& world, uint64_t key)
+{
+   auto sphereGroup = world.getObjects().size() == 1 ? std::dynamic_pointer_cast<const SphereGroup>(world.getObjects()[0]) : nullptr;
+   if (!sphereGroup || sphereGroup->getBVH().numNodes() == 0)
+      return false;
+
+   const uint32_t numSpheres = sphereGroup->numSpheres();
+   SphereArrays spheres = sphereGroup->arrays();
+   const BVH& bvh = sphereGroup->getBVH();
+
+   const void* sections[SceneCacheHeader::NumSections] = { spheres.centerX, spheres.centerY, spheres.centerZ, spheres.radius, sphereGroup->materialIdData(),
+                                                           world.materialData(), bvh.nodeData() };
+   uint64_t sizes[SceneCacheHeader::NumSections];
+   sceneCacheSectionSizes(numSpheres, world.numMaterials(), bvh.numNodes(), sizes);
+
+   SceneCacheHeader header = {};
+   std::memcpy(header.magic, "RTSC", 4);
+   header.version = sceneCacheVersion;
+   header.key = key;
+   header.layoutHash = sceneCacheLayoutHash();
+   header.numSpheres = numSpheres;
+   header.numMaterials = world.numMaterials();
+   header.numNodes = bvh.numNodes();
+
+   uint64_t offset = sizeof(SceneCacheHeader);
+   for (uint32_t i = 0; i < SceneCacheHeader::NumSections; i++)
+   {
+      offset = (offset + 63) & ~63ull;
+      header.offsets[i] = offset;
+      offset += sizes[i];
+   }
+   header.fileSize = offset;
+   header.headerHash = hashBytes(&header, offsetof(SceneCacheHeader, headerHash));
+
+   // Written next to the target and renamed like checkpoints, a reader never maps a partial file
+   std::string tempFilename = filename + ".tmp";
+   {
+      std::ofstream fout = std::ofstream(tempFilename, std::ios::binary);
+      fout.write((const char*)&header, sizeof(header));
+      uint64_t written = sizeof(header);
+      const char zeros[64] = {};
+      for (uint32_t i = 0; i < SceneCacheHeader::NumSections; i++)
+      {
+         fout.write(zeros, header.offsets[i] - written);
+         fout.write((const char*)sections[i], sizes[i]);
+         written = header.offsets[i] + sizes[i];
+      }
+      if (!fout)
+         return false;
+   }
+
+   std::remove(filename.c_str());
+   return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+}
+
+// Replaces the contents of world with the cached scene if the file matches key. World::build()
+// still has to be called, it only builds the top level over the mapped sphere group.
+bool loadSceneCache(const std::string& filename, uint64_t key, World& world)
+{
+   auto file = std::make_shared<MappedFile>();
+   if (!file->open(filename) || file->fileSize() < sizeof(SceneCacheHeader))
+      return false;
+
+   const SceneCacheHeader& header = *(const SceneCacheHeader*)file->bytes();
+   if (std::string(header.magic, 4) != "RTSC" || header.version != sceneCacheVersion || header.key != key ||
+       header.layoutHash != sceneCacheLayoutHash() || header.fileSize != file->fileSize() ||
+       header.headerHash != hashBytes(&header, offsetof(SceneCacheHeader, headerHash)))
+      return false;
+
+   // Every section has to start aligned and end within the file before pointers into it are formed
+   uint64_t sizes[SceneCacheHeader::NumSections];
+   sceneCacheSectionSizes(header.numSpheres, header.numMaterials, header.numNodes, sizes);
+   for (uint32_t i = 0; i < SceneCacheHeader::NumSections; i++)
+   {
+      if (header.offsets[i] % 64 != 0 || header.offsets[i] > header.fileSize || sizes[i] > header.fileSize - header.offsets[i])
+         return false;
+   }
+
+   auto section = [&](SceneCacheHeader::Section i) { return file->bytes() + header.offsets[i]; };
+   SphereArrays spheres = { (const float*)section(SceneCacheHeader::CenterX), (const float*)section(SceneCacheHeader::CenterY),
+                            (const float*)section(SceneCacheHeader::CenterZ), (const float*)section(SceneCacheHeader::Radius) };
+
+   world = World();
+   auto sphereGroup = std::make_shared<SphereGroup>();
+   sphereGroup->attach(file, spheres, (const uint32_t*)section(SceneCacheHeader::MaterialIds), header.numSpheres,
+                       (const BVHNode*)section(SceneCacheHeader::Nodes), header.numNodes);
+   world.attachMaterials(file, (const Material*)section(SceneCacheHeader::Materials), header.numMaterials);
+   world.addObject(sphereGroup);
+   return true;
+}
+
+enum class ImageFormat
+{
+   PPM, // Binary P6, 8 bits per channel with gamma correction
+   PFM  // Linear 32-bit float HDR
+};
+
+// Both writers build the pixel data in memory and emit it with a single write
+void writePPM(const std::string& filename, const Image& image)
+{
+   std::string header = "P6\n" + std::to_string(image.width) + " " + std::to_string(image.height) + "\n255\n";
+   std::vector<uint8_t> buffer(header.begin(), header.end());
+   buffer.resize(header.size() + 3 * image.pixels.size());
+
+   uint8_t* out = buffer.data() + header.size();
+   for (int32_t y = image.height-1; y >= 0; y--)
+   {
+      for (uint32_t x = 0; x < image.width; x++)
+      {
+         glm::vec3 color = image.pixels[y * image.width + x];
+         color = glm::sqrt(color); // Gamma correction
+         color = glm::clamp(color, glm::vec3(0.0f), glm::vec3(0.999f));
+         glm::ivec3 colorInt = color * glm::vec3(256.0f);
+         *out++ = (uint8_t)colorInt.x;
+         *out++ = (uint8_t)colorInt.y;
+         *out++ = (uint8_t)colorInt.z;
+      }
+   }
+
+   std::ofstream fout = std::ofstream(filename, std::ios::binary);
+   fout.write((const char*)buffer.data(), buffer.size());
+}
+
+void writePFM(const std::string& filename, const Image& image)
+{
+   // A negative scale marks little endian data, PFM scanlines run bottom to top like Image
+   const uint16_t endianProbe = 1;
+   bool littleEndian = *(const uint8_t*)&endianProbe == 1;
+   std::string header = "PF\n" + std::to_string(image.width) + " " + std::to_string(image.height) + "\n" + (littleEndian ? "-1.0" : "1.0") + "\n";
+
+   std::vector<float> data;
+   data.reserve(3 * image.pixels.size());
+   for (const glm::vec3& color : image.pixels)
+   {
+      data.push_back(color.x);
+      data.push_back(color.y);
+      data.push_back(color.z);
+   }
+
+   std::ofstream fout = std::ofstream(filename, std::ios::binary);
+   fout.write(header.data(), header.size());
+   fout.write((const char*)data.data(), data.size() * sizeof(float));
+}
+
+void writeImage(const std::string& filename, const Image& image, ImageFormat format)
+{
+   if (format == ImageFormat::PFM)
+      writePFM(filename, image);
+   else
+      writePPM(filename, image);
+}
+
+// Samples used per pixel, blue for few and red for maxSamples
+void writeSampleHeatmap(const std::string& filename, const Image& image, uint32_t maxSamples)
+{
+   Image heatmap(image.width, image.height);
+   for (size_t i = 0; i < image.pixels.size(); i++)
+   {
+      float t = glm::min(1.0f, (float)image.sampleCounts[i] / maxSamples);
+      glm::vec3 color = glm::vec3(t, 0.0f, 1.0f - t);
+      heatmap.pixels[i] = color * color; // Undo the gamma correction of the writer
+   }
+
+   writePPM(filename, heatmap);
+}
+
+glm::vec3 backgroundColor(const World& world, const Ray& ray)
+{
+   glm::vec3 unitDir = glm::normalize(ray.dir);
+   float t = 0.5f * (unitDir.y + 1.0f);
+
+   return world.getSky() * ((1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f));
+}
+
+const float shadowAcneConstant = 0.001f;
+const float maxRayDistance = 100.0f;
+
+// Russian roulette, called after every bounce. Once a path has bounced a few times it survives
+// with a probability given by its throughput and survivors are reweighted so the estimate
+// stays unbiased. Returns false if the path is terminated.
+inline bool continuePath(int32_t depth, glm::vec3& throughput, SampleStream& stream)
+{
+   const int32_t rouletteStartDepth = 3;
+   const float maxSurvivalProbability = 0.95f;
+
+   if (depth < rouletteStartDepth)
+      return true;
+
+   float survivalProbability = glm::min(glm::max(throughput.x, glm::max(throughput.y, throughput.z)), maxSurvivalProbability);
+   if (stream.next1D() >= survivalProbability)
+      return false;
+
+   throughput /= survivalProbability;
+   return true;
+}
+
+// Veach's power heuristic, the weight of a sample taken with density pdf when another
+// technique could have found it with otherPdf
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+   float squared = pdf * pdf;
+   return squared / (squared + otherPdf * otherPdf);
+}
+
+// Next event estimation at a diffuse hit, one light sample tested with a shadow ray and
+// weighted against the BSDF sampling of the next bounce finding the same light
+glm::vec3 sampleDirectLight(const World& world, const Lambertian& material, const HitRecord& hitRecord, SampleStream& stream, uint64_t& rayCount)
+{
+   float u = stream.next1D();
+   glm::vec2 point = stream.next2D();
+   LightSample sample;
+   if (!world.getLights().sample(hitRecord.pos, u, point, sample))
+      return glm::vec3(0.0f);
+
+   float cosine = glm::dot(hitRecord.normal, sample.dir);
+   if (cosine <= 0.0f)
+      return glm::vec3(0.0f);
+
+   rayCount++;
+   if (world.occluded(Ray(hitRecord.pos, sample.dir), shadowAcneConstant, sample.distance - shadowAcneConstant))
+      return glm::vec3(0.0f);
+
+   // The Lambertian BSDF times the cosine is albedo times the density of scatter()
+   float bsdfPdf = cosine / glm::pi<float>();
+   return material.albedo * bsdfPdf * sample.radiance * powerHeuristic(sample.pdf, bsdfPdf) / sample.pdf;
+}
+
+// One bounce of a path on a hit of the given material type, shared by all integrators so that
+// they give the same result. Emission of the hit is weighted against the light sample of the
+// previous bounce, whose scattered direction had density bsdfPdf, zero after camera rays and
+// specular bounces. Diffuse hits add a light sample, then the path scatters. Returns false if
+// the path ends.
+template<typename MaterialType>
+bool shadeHit(const MaterialType& material, const World& world, int32_t depth, Ray& ray, const HitRecord& hitRecord, glm::vec3& throughput, float& bsdfPdf, glm::vec3& radiance,
+   SampleStream& stream, uint64_t& rayCount)
+{
+   if constexpr (std::is_same_v<MaterialType, DiffuseLight>)
+   {
+      float weight = bsdfPdf > 0.0f ? powerHeuristic(bsdfPdf, world.getLights().pdf(ray.origin, hitRecord)) : 1.0f;
+      radiance += throughput * material.emitted * weight;
+      return false;
+   }
+
+   stream.startBounce(depth);
+   if constexpr (std::is_same_v<MaterialType, Lambertian>)
+   {
+      if (!world.getLights().empty())
+         radiance += throughput * sampleDirectLight(world, material, hitRecord, stream, rayCount);
+   }
+
+   Ray scatteredRay;
+   glm::vec3 attenuation;
+   if (!material.scatter(ray, hitRecord, attenuation, scatteredRay, stream))
+      return false;
+
+   // Without lights every emitter hit keeps its full weight
+   if constexpr (std::is_same_v<MaterialType, Lambertian>)
+      bsdfPdf = world.getLights().empty() ? 0.0f : material.pdf(hitRecord, scatteredRay.dir);
+   else
+      bsdfPdf = 0.0f;
+
+   throughput *= attenuation;
+   ray = scatteredRay;
+   return continuePath(depth, throughput, stream);
+}
+
+// Iterative path integrator for a camera ray whose closest hit is already known, e.g. from a
+// ray packet. Paths normally end by Russian roulette and maxDepth only remains as a safety
+// limit. rayCount is incremented for every further ray traced.
+glm::vec3 rayColor(const Ray& cameraRay, bool cameraHit, const HitRecord& cameraHitRecord, const World& world, int32_t maxDepth, SampleStream& stream, uint64_t& rayCount)
+{
+   Ray ray = cameraRay;
+   HitRecord hitRecord = cameraHitRecord;
+   bool hit = cameraHit;
+   glm::vec3 throughput = glm::vec3(1.0f);
+   glm::vec3 radiance = glm::vec3(0.0f);
+   float bsdfPdf = 0.0f;
+
+   for (int32_t depth = 0; depth < maxDepth; depth++)
+   {
+      if (depth > 0)
+      {
+         rayCount++;
+         hit = world.hit(ray, shadowAcneConstant, maxRayDistance, hitRecord);
+      }
+
+      if (!hit)
+         return radiance + throughput * backgroundColor(world, ray);
+
+      bool alive = std::visit([&](const auto& material)
+      {
+         return shadeHit(material, world, depth, ray, hitRecord, throughput, bsdfPdf, radiance, stream, rayCount);
+      }, world.getMaterial(hitRecord.materialId));
+
+      if (!alive)
+         return radiance;
+   }
+
+   return radiance;
+}
+
+glm::vec3 rayColor(const Ray& cameraRay, const World& world, int32_t maxDepth, SampleStream& stream, uint64_t& rayCount)
+{
+   HitRecord hitRecord;
+   rayCount++;
+   bool hit = world.hit(cameraRay, shadowAcneConstant, maxRayDistance, hitRecord);
+   return rayColor(cameraRay, hit, hitRecord, world, maxDepth, stream, rayCount);
+}
+
+struct PathState
+{
+   Ray ray;
+   glm::vec3 throughput;
+   glm::vec3 radiance;
+   HitRecord hitRecord;
+   SampleStream stream;
+   float bsdfPdf = 0.0f; // Of the last scattered direction, see shadeHit()
+};
+
+// Scatters all paths in a bin of hits on one material type. The type is known up front, so
+// the loop runs a single scatter() without dispatch.
+template<typename MaterialType>
+void shadeBin(std::vector<PathState>& paths, const std::vector<uint32_t>& bin, const World& world, int32_t depth, std::vector<uint32_t>& survivors, uint64_t& rayCount)
+{
+   for (uint32_t pathIndex : bin)
+   {
+      PathState& path = paths[pathIndex];
+      const MaterialType& material = *std::get_if<MaterialType>(&world.getMaterial(path.hitRecord.materialId));
+      if (shadeHit(material, world, depth, path.ray, path.hitRecord, path.throughput, path.bsdfPdf, path.radiance, path.stream, rayCount))
+         survivors.push_back(pathIndex);
+   }
+}
+
+template<size_t... MaterialTypes>
+void shadeBins(std::vector<PathState>& paths, const std::vector<uint32_t>* bins, const World& world, int32_t depth, std::vector<uint32_t>& survivors, uint64_t& rayCount,
+   std::index_sequence<MaterialTypes...>)
+{
+   (shadeBin<std::variant_alternative_t<MaterialTypes, Material>>(paths, bins[MaterialTypes], world, depth, survivors, rayCount), ...);
+}
+
+// Same estimator as rayColor() for a batch of paths. After every bounce the hits are binned by
+// material type and each bin is shaded in one loop. Every path keeps its own generator, so
+// the result matches rayColor() exactly.
+void tracePathsSorted(std::vector<PathState>& paths, const World& world, int32_t maxDepth, uint64_t& rayCount)
+{
+   std::vector<uint32_t> active(paths.size());
+   std::iota(active.begin(), active.end(), 0);
+   std::vector<uint32_t> survivors;
+   std::vector<uint32_t> bins[numMaterialTypes];
+
+   for (int32_t depth = 0; depth < maxDepth && !active.empty(); depth++)
+   {
+      for (std::vector<uint32_t>& bin : bins)
+         bin.clear();
+
+      for (uint32_t pathIndex : active)
+      {
+         PathState& path = paths[pathIndex];
+         rayCount++;
+         if (world.hit(path.ray, shadowAcneConstant, maxRayDistance, path.hitRecord))
+            bins[world.getMaterial(path.hitRecord.materialId).index()].push_back(pathIndex);
+         else
+            path.radiance += path.throughput * backgroundColor(world, path.ray);
+      }
+
+      survivors.clear();
+      shadeBins(paths, bins, world, depth, survivors, rayCount, std::make_index_sequence<numMaterialTypes>());
+      active.swap(survivors);
+   }
+}
+
+struct Tile
+{
+   uint32_t x0, y0;
+   uint32_t x1, y1; // Exclusive
+};
+
+// Hands out image tiles to the render threads. Tiles are dealt round-robin in a spiral
+// from the image center into one queue per worker. A worker takes tiles from the front
+// of its own queue and steals from the back of the others once it runs dry.
+class TileScheduler
+{
+public:
+   TileScheduler(uint32_t width, uint32_t height, uint32_t tileSize, uint32_t numWorkers)
+   {
+      for (uint32_t i = 0; i < numWorkers; i++)
+         queues.push_back(std::make_unique<WorkQueue>());
+
+      int32_t tilesX = (width + tileSize - 1) / tileSize;
+      int32_t tilesY = (height + tileSize - 1) / tileSize;
+      numTiles = tilesX * tilesY;
+
+      // Square spiral walk, legs grow by one every second turn
+      int32_t x = (tilesX - 1) / 2;
+      int32_t y = (tilesY - 1) / 2;
+      int32_t dx = 1, dy = 0;
+      int32_t legLength = 1;
+      uint32_t visited = 0;
+
+      while (visited < numTiles)
+      {
+         for (int32_t turn = 0; turn < 2; turn++)
+         {
+            for (int32_t step = 0; step < legLength; step++)
+            {
+               if (x >= 0 && y >= 0 && x < tilesX && y < tilesY)
+               {
+                  Tile tile = { x * tileSize, y * tileSize, glm::min((x + 1) * tileSize, width), glm::min((y + 1) * tileSize, height) };
+                  queues[visited % numWorkers]->tiles.push_back(tile);
+                  visited++;
+               }
+               x += dx;
+               y += dy;
+            }
+
+            std::swap(dx, dy);
+            dx = -dx;
+         }
+         legLength++;
+      }
+   }
+
+   bool nextTile(uint32_t worker, Tile& tile, bool& stolen)
+   {
+      {
+         WorkQueue& queue = *queues[worker];
+         std::lock_guard<std::mutex> lock(queue.mutex);
+         if (!queue.tiles.empty())
+         {
+            tile = queue.tiles.front();
+            queue.tiles.pop_front();
+            stolen = false;
+            return true;
+         }
+      }
+
+      for (uint32_t i = 1; i < queues.size(); i++)
+      {
+         WorkQueue& victim = *queues[(worker + i) % queues.size()];
+         std::lock_guard<std::mutex> lock(victim.mutex);
+         if (!victim.tiles.empty())
+         {
+            tile = victim.tiles.back();
+            victim.tiles.pop_back();
+            stolen = true;
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   uint32_t numTiles;
+
+private:
+   struct alignas(64) WorkQueue
+   {
+      std::mutex mutex;
+      std::deque<Tile> tiles;
+   };
+
+   std::vector<std::unique_ptr<WorkQueue>> queues;
+};
+
+// Running mean and variance of a pixel's sample luminance (Welford's algorithm)
+struct VarianceEstimator
+{
+   void add(float value)
+   {
+      count++;
+      float delta = value - mean;
+      mean += delta / count;
+      m2 += delta * (value - mean);
+   }
+
+   // Standard error of the mean relative to the mean, dark pixels are judged against a floor
+   // so that they don't need an excessive number of samples
+   float relativeError() const
+   {
+      const float minMean = 0.01f;
+      float variance = m2 / (count - 1);
+      return glm::sqrt(variance / count) / glm::max(mean, minMean);
+   }
+
+   uint32_t count = 0;
+   float mean = 0.0f;
+   float m2 = 0.0f;
+};
+
+// Per-pixel running sums of a progressive render, the sample count lives in the estimator
+struct PixelAccumulator
+{
+   glm::vec3 sum = glm::vec3(0.0f);
+   VarianceEstimator estimator;
+};
+
+// Float accumulation buffer that progressive passes add samples to. Pixels are stored in blocks
+// of one render tile that start on a cache line, so a worker never writes a line that holds
+// pixels of another worker's tile. resolve() converts to the linear Image. The buffer is also
+// the content of a checkpoint file: a small header followed by the raw PixelAccumulator blocks.
+// The header carries a key of the scene and the settings the samples were taken with, so a
+// checkpoint is never blended into a different render.
+class AccumulationBuffer
+{
+public:
+   static const uint32_t checkpointVersion = 3;
+   static const uint32_t tileSize = 32;
+
+   AccumulationBuffer(uint32_t width, uint32_t height)
+      : width(width), height(height), tilesX((width + tileSize - 1) / tileSize), pixels(tilesX * ((height + tileSize - 1) / tileSize) * tileSize * tileSize)
+   {
+      static_assert((tileSize * tileSize * sizeof(PixelAccumulator)) % 64 == 0, "Tile blocks have to fill whole cache lines");
+   }
+
+   uint32_t index(uint32_t x, uint32_t y) const
+   {
+      uint32_t tile = (y / tileSize) * tilesX + x / tileSize;
+      return tile * tileSize * tileSize + (y % tileSize) * tileSize + x % tileSize;
+   }
+
+   PixelAccumulator& at(uint32_t x, uint32_t y) { return pixels[index(x, y)]; }
+   const PixelAccumulator& at(uint32_t x, uint32_t y) const { return pixels[index(x, y)]; }
+
+   bool saveCheckpoint(const std::string& filename, uint64_t renderKey, uint32_t frameIndex, uint32_t passes) const
+   {
+      CheckpointHeader header = { { 'R', 'T', 'C', 'P' }, checkpointVersion, width, height, frameIndex, passes, renderKey };
+
+      // Written next to the target and renamed, so a preempted write never corrupts the last checkpoint
+      std::string tempFilename = filename + ".tmp";
+      {
+         std::ofstream fout = std::ofstream(tempFilename, std::ios::binary);
+         fout.write((const char*)&header, sizeof(header));
+         fout.write((const char*)pixels.data(), pixels.size() * sizeof(PixelAccumulator));
+         if (!fout)
+            return false;
+      }
+
+      // POSIX rename replaces the target atomically, Windows refuses to rename onto an existing file
+#if defined(_WIN32)
+      std::remove(filename.c_str());
+#endif
+      return std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+   }
+
+   // Returns the number of passes stored in the checkpoint, or -1 if it doesn't match this render
+   int32_t loadCheckpoint(const std::string& filename, uint64_t renderKey, uint32_t frameIndex)
+   {
+      std::ifstream fin = std::ifstream(filename, std::ios::binary);
+      CheckpointHeader header;
+      if (!fin.read((char*)&header, sizeof(header)))
+         return -1;
+
+      if (std::string(header.magic, 4) != "RTCP" || header.version != checkpointVersion || header.width != width ||
+          header.height != height || header.frameIndex != frameIndex || header.renderKey != renderKey)
+         return -1;
+
+      if (!fin.read((char*)pixels.data(), pixels.size() * sizeof(PixelAccumulator)))
+      {
+         std::fill(pixels.begin(), pixels.end(), PixelAccumulator());
+         return -1;
+      }
+
+      return (int32_t)header.passes;
+   }
+
+   void resolve(Image& image) const
+   {
+      for (uint32_t y = 0; y < height; y++)
+      {
+         for (uint32_t x = 0; x < width; x++)
+         {
+            const PixelAccumulator& pixel = at(x, y);
+            uint32_t count = pixel.estimator.count;
+            image.pixels[y * width + x] = count > 0 ? pixel.sum / (float)count : glm::vec3(0.0f);
+            image.sampleCounts[y * width + x] = count;
+         }
+      }
+   }
+
+   uint32_t width;
+   uint32_t height;
+   uint32_t tilesX;
+   AlignedVector<PixelAccumulator> pixels; // Tile blocks, padded to whole tiles at the right and bottom edges
+
+private:
+   struct CheckpointHeader
+   {
+      char magic[4];
+      uint32_t version;
+      uint32_t width;
+      uint32_t height;
+      uint32_t frameIndex;
+      uint32_t passes;
+      uint64_t renderKey;
+   };
+};
+
+// Structure of arrays queue of live paths for the wavefront integrator
+struct PathQueue
+{
+   void clear()
+   {
+      originX.clear(); originY.clear(); originZ.clear();
+      dirX.clear(); dirY.clear(); dirZ.clear();
+      throughputR.clear(); throughputG.clear(); throughputB.clear();
+      bsdfPdfs.clear();
+      streams.clear();
+      pathIndices.clear();
+   }
+
+   void push(uint32_t pathIndex, const Ray& ray, const glm::vec3& throughput, float bsdfPdf, const SampleStream& stream)
+   {
+      originX.push_back(ray.origin.x); originY.push_back(ray.origin.y); originZ.push_back(ray.origin.z);
+      dirX.push_back(ray.dir.x); dirY.push_back(ray.dir.y); dirZ.push_back(ray.dir.z);
+      throughputR.push_back(throughput.x); throughputG.push_back(throughput.y); throughputB.push_back(throughput.z);
+      bsdfPdfs.push_back(bsdfPdf);
+      streams.push_back(stream);
+      pathIndices.push_back(pathIndex);
+   }
+
+   Ray ray(uint32_t i) const
+   {
+      return Ray(glm::vec3(originX[i], originY[i], originZ[i]), glm::vec3(dirX[i], dirY[i], dirZ[i]));
+   }
+
+   glm::vec3 throughput(uint32_t i) const
+   {
+      return glm::vec3(throughputR[i], throughputG[i], throughputB[i]);
+   }
+
+   uint32_t size() const { return (uint32_t)pathIndices.size(); }
+
+   AlignedVector<float> originX, originY, originZ;
+   AlignedVector<float> dirX, dirY, dirZ;
+   AlignedVector<float> throughputR, throughputG, throughputB;
+   AlignedVector<float> bsdfPdfs; // Of the last scattered direction, see shadeHit()
+   AlignedVector<SampleStream> streams;
+   AlignedVector<uint32_t> pathIndices; // Index of the path in the batch
+};
+
+// Structure of arrays queue of hits on one material type
+struct HitQueue
+{
+   void clear()
+   {
+      queueIndices.clear();
+      t.clear();
+      posX.clear(); posY.clear(); posZ.clear();
+      normalX.clear(); normalY.clear(); normalZ.clear();
+      materialIds.clear();
+      objectIds.clear();
+      primitiveIds.clear();
+      frontFaces.clear();
+   }
+
+   void push(uint32_t queueIndex, const HitRecord& hitRecord)
+   {
+      queueIndices.push_back(queueIndex);
+      t.push_back(hitRecord.t);
+      posX.push_back(hitRecord.pos.x); posY.push_back(hitRecord.pos.y); posZ.push_back(hitRecord.pos.z);
+      normalX.push_back(hitRecord.normal.x); normalY.push_back(hitRecord.normal.y); normalZ.push_back(hitRecord.normal.z);
+      materialIds.push_back(hitRecord.materialId);
+      objectIds.push_back(hitRecord.objectId);
+      primitiveIds.push_back(hitRecord.primitiveId);
+      frontFaces.push_back(hitRecord.frontFace ? 1 : 0);
+   }
+
+   HitRecord hitRecord(uint32_t i) const
+   {
+      HitRecord hitRecord;
+      hitRecord.materialId = materialIds[i];
+      hitRecord.objectId = objectIds[i];
+      hitRecord.primitiveId = primitiveIds[i];
+      hitRecord.pos = glm::vec3(posX[i], posY[i], posZ[i]);
+      hitRecord.normal = glm::vec3(normalX[i], normalY[i], normalZ[i]);
+      hitRecord.t = t[i];
+      hitRecord.frontFace = frontFaces[i] != 0;
+      return hitRecord;
+   }
+
+   uint32_t size() const { return (uint32_t)queueIndices.size(); }
+
+   AlignedVector<uint32_t> queueIndices; // Entry of the ray in the current path queue
+   AlignedVector<float> t;
+   AlignedVector<float> posX, posY, posZ;
+   AlignedVector<float> normalX, normalY, normalZ;
+   AlignedVector<uint32_t> materialIds;
+   AlignedVector<uint32_t> objectIds;
+   AlignedVector<uint32_t> primitiveIds;
+   AlignedVector<uint8_t> frontFaces;
+};
+
+// Wavefront integrator. Instead of tracing one path to completion, a large batch of paths
+// moves through separate stages that each run as one tight loop over a queue: generate camera
+// rays, intersect, shade per material type, and accumulate finished paths. Queues are reused
+// between batches, so one instance per worker thread. Paths carry their own generators and
+// give the same result as rayColor().
+class WavefrontIntegrator
+{
+public:
+   // Generate stage, one camera ray for each of the given pixels
+   void generate(const std::vector<uint32_t>& pixels, const AccumulationBuffer& accumulation, const Camera& camera, const Sampler& sampler, uint32_t frameIndex)
+   {
+      const uint32_t numPaths = (uint32_t)pixels.size();
+      pixelIndices = pixels;
+      radiance.assign(numPaths, glm::vec3(0.0f));
+      current.clear();
+      cameraStreams.clear();
+      for (AlignedVector<float>* values : { &filmU, &filmV, &lensU, &lensV, &lensX, &lensY })
+         values->resize(numPaths);
+
+      for (uint32_t pathIndex = 0; pathIndex < numPaths; pathIndex++)
+      {
+         uint32_t pixelIndex = pixels[pathIndex];
+         uint32_t x = pixelIndex % accumulation.width;
+         uint32_t y = pixelIndex / accumulation.width;
+
+         SampleStream stream(sampler, x, y, accumulation.width, accumulation.at(x, y).estimator.count, frameIndex);
+         glm::vec2 jitter = stream.next2D();
+         glm::vec2 lens = stream.next2D();
+         filmU[pathIndex] = ((float)x + jitter.x) / (accumulation.width - 1);
+         filmV[pathIndex] = ((float)y + jitter.y) / (accumulation.height - 1);
+         lensU[pathIndex] = lens.x;
+         lensV[pathIndex] = lens.y;
+         cameraStreams.push_back(stream);
+      }
+
+      // Lens samples of the whole batch are mapped to the disc 8 at a time
+      concentricDiscBatch(lensU.data(), lensV.data(), lensX.data(), lensY.data(), numPaths);
+
+      for (uint32_t pathIndex = 0; pathIndex < numPaths; pathIndex++)
+      {
+         Ray ray = camera.getRay(filmU[pathIndex], filmV[pathIndex], glm::vec2(lensX[pathIndex], lensY[pathIndex]));
+         current.push(pathIndex, ray, glm::vec3(1.0f), 0.0f, cameraStreams[pathIndex]);
+      }
+   }
+
+   void trace(const World& world, int32_t maxDepth, uint64_t& rayCount)
+   {
+      for (int32_t depth = 0; depth < maxDepth && current.size() > 0; depth++)
+      {
+         intersect(world, rayCount);
+
+         next.clear();
+         shadeAll(world, depth, rayCount, std::make_index_sequence<numMaterialTypes>());
+         std::swap(current, next);
+      }
+   }
+
+   // Accumulate stage, returns the number of samples added
+   uint32_t accumulate(AccumulationBuffer& accumulation) const
+   {
+      for (size_t pathIndex = 0; pathIndex < pixelIndices.size(); pathIndex++)
+      {
+         uint32_t pixelIndex = pixelIndices[pathIndex];
+         PixelAccumulator& pixel = accumulation.at(pixelIndex % accumulation.width, pixelIndex / accumulation.width);
+         pixel.sum += radiance[pathIndex];
+         pixel.estimator.add(luminance(radiance[pathIndex]));
+      }
+
+      return (uint32_t)pixelIndices.size();
+   }
+
+private:
+   // Intersect stage, misses pick up the background and hits are queued by material type
+   void intersect(const World& world, uint64_t& rayCount)
+   {
+      for (HitQueue& hitQueue : hitQueues)
+         hitQueue.clear();
+
+      for (uint32_t i = 0; i < current.size(); i++)
+      {
+         Ray ray = current.ray(i);
+         HitRecord hitRecord;
+         rayCount++;
+
+         if (world.hit(ray, shadowAcneConstant, maxRayDistance, hitRecord))
+            hitQueues[world.getMaterial(hitRecord.materialId).index()].push(i, hitRecord);
+         else
+            radiance[current.pathIndices[i]] += current.throughput(i) * backgroundColor(world, ray);
+      }
+   }
+
+   // Shade stage for one material type, survivors continue in the next path queue
+   template<typename MaterialType>
+   void shade(const World& world, const HitQueue& hitQueue, int32_t depth, uint64_t& rayCount)
+   {
+      for (uint32_t i = 0; i < hitQueue.size(); i++)
+      {
+         uint32_t queueIndex = hitQueue.queueIndices[i];
+         uint32_t pathIndex = current.pathIndices[queueIndex];
+         HitRecord hitRecord = hitQueue.hitRecord(i);
+         SampleStream stream = current.streams[queueIndex];
+         const MaterialType& material = *std::get_if<MaterialType>(&world.getMaterial(hitRecord.materialId));
+
+         Ray ray = current.ray(queueIndex);
+         glm::vec3 throughput = current.throughput(queueIndex);
+         float bsdfPdf = current.bsdfPdfs[queueIndex];
+         if (shadeHit(material, world, depth, ray, hitRecord, throughput, bsdfPdf, radiance[pathIndex], stream, rayCount))
+            next.push(pathIndex, ray, throughput, bsdfPdf, stream);
+      }
+   }
+
+   template<size_t... MaterialTypes>
+   void shadeAll(const World& world, int32_t depth, uint64_t& rayCount, std::index_sequence<MaterialTypes...>)
+   {
+      (shade<std::variant_alternative_t<MaterialTypes, Material>>(world, hitQueues[MaterialTypes], depth, rayCount), ...);
+   }
+
+   PathQueue current;
+   PathQueue next;
+   HitQueue hitQueues[numMaterialTypes];
+   AlignedVector<float> filmU, filmV, lensU, lensV, lensX, lensY;
+   std::vector<SampleStream> cameraStreams;
+   std::vector<uint32_t> pixelIndices;
+   std::vector<glm::vec3> radiance;
+};
+
+enum class Integrator
+{
+   Megakernel, // Every thread traces one path at a time to completion with rayColor()
+   Wavefront   // Batches of paths move through the stages of WavefrontIntegrator
+};
+
+struct RenderSettings
+{
+   uint32_t samplesPerPixel = 500;
+   int32_t maxDepth = 50;
+   uint32_t numThreads = 16;
+   uint32_t frameIndex = 0;
+   Integrator integrator = Integrator::Megakernel;
+   SamplerType sampler = SamplerType::Random;
+
+   // Tiles traced together by the wavefront integrator
+   uint32_t wavefrontTiles = 16;
+
+   // Adaptive sampling stops a pixel once the relative error of its mean drops below
+   // errorThreshold. samplesPerPixel is then the upper bound.
+   bool adaptive = false;
+   uint32_t minSamples = 16;
+   float errorThreshold = 0.01f;
+
+   // Stops after the pass that exceeds the budget, zero renders until samplesPerPixel
+   double timeBudgetSeconds = 0.0;
+
+   // Written at most once per checkpointIntervalSeconds and after the last pass when set,
+   // resume continues from it
+   std::string checkpointFile;
+   double checkpointIntervalSeconds = 60.0;
+   bool resume = false;
+
+   // Megakernel only, intersects the camera rays of 8x8 pixel blocks as ray packets
+   bool packetTracing = true;
+
+   // Megakernel only, traces each tile pass as one batch and shades the hits of every bounce
+   // sorted by material type
+   bool sortMaterials = false;
+
+   // Suppresses progress and statistics output
+   bool quiet = false;
+};
+
+struct RenderStats
+{
+   double seconds = 0.0;
+   uint32_t passes = 0;
+   uint64_t primaryRays = 0;
+   uint64_t totalRays = 0;
+};
+
+// Identifies what the samples of a checkpoint were taken with: the camera, the scene's object
+// bounds and sizes, and the settings that change the per-pixel estimate
+uint64_t checkpointKey(const World& world, const Camera& camera, const RenderSettings& settings)
+{
+   uint64_t key = hashBytes(&camera.origin, sizeof(glm::vec3));
+   key = hashBytes(&camera.lowerLeftCorner, sizeof(glm::vec3), key);
+   key = hashBytes(&camera.horizontal, sizeof(glm::vec3), key);
+   key = hashBytes(&camera.vertical, sizeof(glm::vec3), key);
+   key = hashBytes(&camera.lensRadius, sizeof(float), key);
+   key = hashBytes(&world.getSky(), sizeof(glm::vec3), key);
+
+   uint64_t sizes[3] = { world.numObjects(), world.numPrimitives(), world.numMaterials() };
+   key = hashBytes(sizes, sizeof(sizes), key);
+   for (const auto& object : world.getObjects())
+   {
+      AABB bounds = object->boundingBox();
+      key = hashBytes(&bounds.min, sizeof(glm::vec3), key);
+      key = hashBytes(&bounds.max, sizeof(glm::vec3), key);
+   }
+
+   key = hashBytes(&settings.sampler, sizeof(settings.sampler), key);
+   key = hashBytes(&settings.samplesPerPixel, sizeof(settings.samplesPerPixel), key);
+   return hashBytes(&settings.maxDepth, sizeof(settings.maxDepth), key);
+}
+
+// Progressive renderer, every pass adds one sample to each pixel that still needs one. Sample
+// seeds only depend on the pixel and its sample count, so a resumed render produces the same
+// image as an uninterrupted one.
+RenderStats render(Image& image, const World& world, const Camera& camera, const RenderSettings& settings)
+{
+   const uint32_t numThreads = settings.numThreads;
+   const uint32_t tileSize = AccumulationBuffer::tileSize;
+   AccumulationBuffer accumulation(image.width, image.height);
+   uint32_t passes = 0;
+   const uint64_t renderKey = settings.checkpointFile.empty() ? 0 : checkpointKey(world, camera, settings);
+
+   if (settings.resume)
+   {
+      int32_t loadedPasses = accumulation.loadCheckpoint(settings.checkpointFile, renderKey, settings.frameIndex);
+      if (loadedPasses >= 0)
+      {
+         passes = (uint32_t)loadedPasses;
+         if (!settings.quiet)
+            std::cout << "Resuming from " << settings.checkpointFile << " after " << passes << " passes" << std::endl;
+      }
+      else if (!settings.quiet)
+         std::cout << "No matching checkpoint in " << settings.checkpointFile << ", starting over" << std::endl;
+   }
+
+   if (!settings.quiet)
+      std::cout << "Rendering using " << numThreads << " threads";
+
+   // Counters are bumped for every ray, give each worker its own cache line
+   struct alignas(64) WorkerStats
+   {
+      double busySeconds = 0.0;
+      uint32_t tilesRendered = 0;
+      uint32_t tilesStolen = 0;
+      uint64_t samples = 0;
+      uint64_t rays = 0;
+   };
+   std::vector<WorkerStats> workerStats(numThreads);
+
+   std::unique_ptr<Sampler> sampler = createSampler(settings.sampler, settings.samplesPerPixel);
+
+   auto needsSample = [&](const VarianceEstimator& estimator)
+   {
+      if (estimator.count >= settings.samplesPerPixel)
+         return false;
+
+      bool converged = settings.adaptive && estimator.count >= settings.minSamples && estimator.relativeError() < settings.errorThreshold;
+      return !converged;
+   };
+
+   auto addSample = [&](uint32_t pixelIndex, const glm::vec3& sample, WorkerStats& stats)
+   {
+      PixelAccumulator& pixel = accumulation.pixels[pixelIndex];
+      pixel.sum += sample;
+      pixel.estimator.add(luminance(sample));
+      stats.samples++;
+   };
+
+   auto work = [&](uint32_t worker, TileScheduler& scheduler)
+   {
+      const uint32_t packetSize = 8;
+      Tile tile;
+      bool stolen;
+      std::vector<PathState> paths;
+      std::vector<uint32_t> pathPixels;
+      std::unique_ptr<RayPacket> packet = std::make_unique<RayPacket>();
+      std::vector<SampleStream> packetStreams;
+      std::vector<uint32_t> packetPixels;
+
+      while (scheduler.nextTile(worker, tile, stolen))
+      {
+         auto tileStart = std::chrono::high_resolution_clock::now();
+         WorkerStats& stats = workerStats[worker];
+         paths.clear();
+         pathPixels.clear();
+
+         // Camera rays of each 8x8 block are coherent enough to be intersected as one packet,
+         // the bounces after the first hit continue one ray at a time
+         for (uint32_t blockY = tile.y0; blockY < tile.y1; blockY += packetSize)
+         {
+            for (uint32_t blockX = tile.x0; blockX < tile.x1; blockX += packetSize)
+            {
+               packet->clear();
+               packetStreams.clear();
+               packetPixels.clear();
+
+               for (uint32_t y = blockY; y < glm::min(blockY + packetSize, tile.y1); y++)
+               {
+                  for (uint32_t x = blockX; x < glm::min(blockX + packetSize, tile.x1); x++)
+                  {
+                     const uint32_t pixelIndex = accumulation.index(x, y);
+                     const VarianceEstimator& estimator = accumulation.pixels[pixelIndex].estimator;
+                     if (!needsSample(estimator))
+                        continue;
+
+                     SampleStream stream(*sampler, x, y, image.width, estimator.count, settings.frameIndex);
+                     glm::vec2 jitter = stream.next2D();
+                     float u = ((float)x + jitter.x) / (image.width - 1);
+                     float v = ((float)y + jitter.y) / (image.height - 1);
+                     Ray ray = camera.getRay(u, v, stream);
+
+                     // Material sorting traces the whole tile as one batch below
+                     if (settings.sortMaterials)
+                     {
+                        paths.push_back({ ray, glm::vec3(1.0f), glm::vec3(0.0f), HitRecord(), stream });
+                        pathPixels.push_back(pixelIndex);
+                     }
+                     else if (settings.packetTracing)
+                     {
+                        packet->push(ray, maxRayDistance);
+                        packetStreams.push_back(stream);
+                        packetPixels.push_back(pixelIndex);
+                     }
+                     else
+                        addSample(pixelIndex, rayColor(ray, world, settings.maxDepth, stream, stats.rays), stats);
+                  }
+               }
+
+               if (packet->size == 0)
+                  continue;
+
+               packet->computeBounds();
+               world.hitPacket(*packet, shadowAcneConstant);
+               stats.rays += packet->size;
+
+               for (uint32_t i = 0; i < packet->size; i++)
+               {
+                  glm::vec3 sample = rayColor(packet->rays[i], packet->hits[i], packet->hitRecords[i], world, settings.maxDepth, packetStreams[i], stats.rays);
+                  addSample(packetPixels[i], sample, stats);
+               }
+            }
+         }
+
+         if (!paths.empty())
+         {
+            tracePathsSorted(paths, world, settings.maxDepth, stats.rays);
+
+            for (size_t i = 0; i < paths.size(); i++)
+               addSample(pathPixels[i], paths[i].radiance, stats);
+         }
+
+         stats.busySeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - tileStart).count();
+         stats.tilesRendered++;
+         stats.tilesStolen += stolen ? 1 : 0;
+      }
+   };
+
+   auto workWavefront = [&](uint32_t worker, TileScheduler& scheduler)
+   {
+      WavefrontIntegrator wavefront;
+      WorkerStats& stats = workerStats[worker];
+      std::vector<uint32_t> pixels;
+      Tile tile;
+      bool stolen;
+
+      while (true)
+      {
+         uint32_t numTiles = 0;
+         pixels.clear();
+
+         while (numTiles < settings.wavefrontTiles && scheduler.nextTile(worker, tile, stolen))
+         {
+            numTiles++;
+            stats.tilesStolen += stolen ? 1 : 0;
+
+            for (uint32_t y = tile.y0; y < tile.y1; y++)
+            {
+               for (uint32_t x = tile.x0; x < tile.x1; x++)
+               {
+                  uint32_t pixelIndex = y * image.width + x;
+                  if (needsSample(accumulation.at(x, y).estimator))
+                     pixels.push_back(pixelIndex);
+               }
+            }
+         }
+
+         if (numTiles == 0)
+            break;
+
+         auto batchStart = std::chrono::high_resolution_clock::now();
+         wavefront.generate(pixels, accumulation, camera, *sampler, settings.frameIndex);
+         wavefront.trace(world, settings.maxDepth, stats.rays);
+         stats.samples += wavefront.accumulate(accumulation);
+
+         stats.busySeconds += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - batchStart).count();
+         stats.tilesRendered += numTiles;
+      }
+   };
+
+   auto renderStart = std::chrono::high_resolution_clock::now();
+   auto elapsedSeconds = [&]()
+   {
+      return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - renderStart).count();
+   };
+
+   double checkpointSeconds = 0.0;
+   uint32_t checkpointPasses = passes;
+   auto saveCheckpoint = [&]()
+   {
+      if (!accumulation.saveCheckpoint(settings.checkpointFile, renderKey, settings.frameIndex, passes))
+         std::cout << std::endl << "Failed to write checkpoint " << settings.checkpointFile << std::endl;
+      checkpointSeconds = elapsedSeconds();
+      checkpointPasses = passes;
+   };
+
+   while (settings.timeBudgetSeconds <= 0.0 || elapsedSeconds() < settings.timeBudgetSeconds)
+   {
+      uint64_t samplesBefore = 0;
+      for (const WorkerStats& stats : workerStats)
+         samplesBefore += stats.samples;
+
+      TileScheduler scheduler(image.width, image.height, tileSize, numThreads);
+      std::vector<std::thread> workerThreads;
+
+      for (uint32_t i = 0; i < numThreads; i++)
+      {
+         if (settings.integrator == Integrator::Wavefront)
+            workerThreads.push_back(std::thread(workWavefront, i, std::ref(scheduler)));
+         else
+            workerThreads.push_back(std::thread(work, i, std::ref(scheduler)));
+      }
+
+      // Wait for all workers to finish
+      std::for_each(workerThreads.begin(), workerThreads.end(), [](std::thread& t) { t.join(); });
+
+      uint64_t samplesAfter = 0;
+      for (const WorkerStats& stats : workerStats)
+         samplesAfter += stats.samples;
+
+      // A pass without samples means every pixel is done
+      if (samplesAfter == samplesBefore)
+         break;
+
+      passes++;
+      if (!settings.checkpointFile.empty() && elapsedSeconds() - checkpointSeconds >= settings.checkpointIntervalSeconds)
+         saveCheckpoint();
+
+      if (!settings.quiet)
+         std::cout << "." << std::flush;
+   }
+
+   if (!settings.checkpointFile.empty() && checkpointPasses != passes)
+      saveCheckpoint();
+
+   accumulation.resolve(image);
+
+   RenderStats renderStats;
+   renderStats.seconds = elapsedSeconds();
+   renderStats.passes = passes;
+   for (const WorkerStats& stats : workerStats)
+   {
+      renderStats.primaryRays += stats.samples;
+      renderStats.totalRays += stats.rays;
+   }
+
+   if (settings.quiet)
+      return renderStats;
+
+   double renderSeconds = renderStats.seconds;
+   std::cout << std::endl << "Rendering done in " << renderSeconds << " s, " << passes << " passes" << std::endl;
+
+   uint64_t totalSamples = 0;
+   for (uint32_t count : image.sampleCounts)
+      totalSamples += count;
+
+   double averageSamples = (double)totalSamples / image.pixels.size();
+   std::cout << "   " << averageSamples << " samples per pixel on average, " << 100.0 * averageSamples / settings.samplesPerPixel << "% of the sample budget" << std::endl;
+   std::cout << "   " << renderStats.totalRays / renderSeconds / 1e6 << " Mrays/s, " << (double)renderStats.totalRays / renderStats.primaryRays << " rays per sample" << std::endl;
+
+   for (uint32_t i = 0; i < numThreads; i++)
+   {
+      const WorkerStats& stats = workerStats[i];
+      std::cout << "   thread " << i << ": busy " << stats.busySeconds << " s, idle " << glm::max(0.0, renderSeconds - stats.busySeconds) << " s, "
+                << stats.tilesRendered << " tiles (" << stats.tilesStolen << " stolen)" << std::endl;
+   }
+
+   return renderStats;
+}
+
+// gridExtent controls the number of small spheres, (2 * gridExtent)^2 at most. Spheres are
+// packed into a SphereGroup unless packSpheres is false, then each one is a separate Object.
+World createRandomScene(int32_t gridExtent = 11, bool packSpheres = true)
+{
+   World world;
+   RandomGenerator rng(42);
+   auto sphereGroup = std::make_shared<SphereGroup>();
+
+   auto addSphere = [&](glm::vec3 center, float radius, uint32_t materialId)
+   {
+      if (packSpheres)
+         sphereGroup->addSphere(center, radius, materialId);
+      else
+         world.addObject(std::make_shared<Sphere>(center, radius, materialId));
+   };
+
+   uint32_t groundMaterial = world.addMaterial(Lambertian(glm::vec3(0.5f, 0.5f, 0.5f)));
+   uint32_t lambertianMaterial = world.addMaterial(Lambertian(glm::vec3(0.4f, 0.2f, 0.1f)));
+   uint32_t dielectricMaterial = world.addMaterial(Dielectric(1.5f));
+   uint32_t metalMaterial = world.addMaterial(Metal(glm::vec3(0.7f, 0.6f, 0.5f), 0.0f));
+
+   addSphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, groundMaterial);
+   addSphere(glm::vec3(-4.0f, 1.0, 0.0), 1.0f, lambertianMaterial);
+   addSphere(glm::vec3(0.0f, 1.0, 0.0), 1.0f, dielectricMaterial);
+   addSphere(glm::vec3(4.0f, 1.0, 0.0), 1.0f, metalMaterial);
+   
+   for (int a = -gridExtent; a < gridExtent; a++)
+   {
+      for (int b = -gridExtent; b < gridExtent; b++)
+      {
+         float chooseMat = randomFloat(rng);
+         glm::vec3 center = glm::vec3(a + 0.9f * randomFloat(rng), 0.2f, b + 0.9f * randomFloat(rng));
+
+         if (glm::distance(center, glm::vec3(4.0f, 0.2f, 0.0f)) > 0.9f)
+         {
+            uint32_t material;
+
+            if (chooseMat < 0.8f)
+            {
+               glm::vec3 color1 = glm::vec3(randomFloat(rng), randomFloat(rng), randomFloat(rng));
+               glm::vec3 color2 = glm::vec3(randomFloat(rng), randomFloat(rng), randomFloat(rng));
+               glm::vec3 albedo = color1 * color2;
+               material = world.addMaterial(Lambertian(albedo));
+               addSphere(center, 0.2f, material);
+            }
+            else if (chooseMat < 0.95f)
+            {
+               glm::vec3 albedo = glm::vec3(randomFloat(rng, 0.5f, 1.0f), randomFloat(rng, 0.5f, 1.0f), randomFloat(rng, 0.5f, 1.0f));
+               float fuzz = randomFloat(rng, 0.0f, 0.5f);
+               material = world.addMaterial(Metal(albedo, fuzz));
+               addSphere(center, 0.2f, material);
+            }
+            else
+            {
+               material = world.addMaterial(Dielectric(1.5f));
+               addSphere(center, 0.2f, material);
+            }
+         }
+      }
+   }
+
+   if (packSpheres)
+      world.addObject(sphereGroup);
+
+   return world;
+}
+
+// Same layout as createRandomScene() but every sphere except the ground is glass, the
+// worst case for path length
+World createGlassScene(int32_t gridExtent = 11)
+{
+   World world;
+   RandomGenerator rng(42);
+   auto sphereGroup = std::make_shared<SphereGroup>();
+
+   uint32_t groundMaterial = world.addMaterial(Lambertian(glm::vec3(0.5f, 0.5f, 0.5f)));
+   uint32_t glassMaterial = world.addMaterial(Dielectric(1.5f));
+
+   sphereGroup->addSphere(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, groundMaterial);
+   sphereGroup->addSphere(glm::vec3(-4.0f, 1.0, 0.0), 1.0f, glassMaterial);
+   sphereGroup->addSphere(glm::vec3(0.0f, 1.0, 0.0), 1.0f, glassMaterial);
+   sphereGroup->addSphere(glm::vec3(4.0f, 1.0, 0.0), 1.0f, glassMaterial);
+
+   for (int a = -gridExtent; a < gridExtent; a++)
+   {
+      for (int b = -gridExtent; b < gridExtent; b++)
+      {
+         glm::vec3 center = glm::vec3(a + 0.9f * randomFloat(rng), 0.2f, b + 0.9f * randomFloat(rng));
+         if (glm::distance(center, glm::vec3(4.0f, 0.2f, 0.0f)) > 0.9f)
+            sphereGroup->addSphere(center, 0.2f, glassMaterial);
+      }
+   }
+
+   world.addObject(sphereGroup);
+   return world;
+}
+
+// Appends a torus around the y axis, transformed by objectToWorld
+void addTorus(TriangleMesh& mesh, const glm::mat4& objectToWorld, float majorRadius, float minorRadius, uint32_t rings, uint32_t sides)
+{
+   uint32_t first = mesh.numVertices();
+   for (uint32_t ring = 0; ring < rings; ring++)
+   {
+      float phi = 2.0f * glm::pi<float>() * ring / rings;
+      for (uint32_t side = 0; side < sides; side++)
+      {
+         float theta = 2.0f * glm::pi<float>() * side / sides;
+         float distance = majorRadius + minorRadius * glm::cos(theta);
+         glm::vec3 position(distance * glm::cos(phi), minorRadius * glm::sin(theta), distance * glm::sin(phi));
+         mesh.addVertex(glm::vec3(objectToWorld * glm::vec4(position, 1.0f)));
+      }
+   }
+
+   auto vertex = [&](uint32_t ring, uint32_t side) { return first + (ring % rings) * sides + side % sides; };
+   for (uint32_t ring = 0; ring < rings; ring++)
+   {
+      for (uint32_t side = 0; side < sides; side++)
+      {
+         mesh.addTriangle(vertex(ring, side), vertex(ring, side + 1), vertex(ring + 1, side + 1));
+         mesh.addTriangle(vertex(ring, side), vertex(ring + 1, side + 1), vertex(ring + 1, side));
+      }
+   }
+}
+
+// The random scene at night, lit only by a small sphere light and a thin torus light
+// hovering above the three large spheres
+World createLightScene(int32_t gridExtent = 11)
+{
+   World world = createRandomScene(gridExtent);
+   world.setSky(glm::vec3(0.0f));
+
+   uint32_t sphereLight = world.addMaterial(DiffuseLight(glm::vec3(120.0f, 96.0f, 72.0f)));
+   world.addObject(std::make_shared<Sphere>(glm::vec3(1.5f, 3.5f, 2.5f), 0.25f, sphereLight));
+
+   auto torus = std::make_shared<TriangleMesh>(world.addMaterial(DiffuseLight(glm::vec3(9.0f, 12.0f, 18.0f))));
+   addTorus(*torus, glm::translate(glm::mat4(1.0f), glm::vec3(-2.0f, 2.6f, 0.0f)), 0.8f, 0.05f, 64, 8);
+   world.addObject(torus);
+   return world;
+}
+
+// Everything needed to render an image, as stored in a scene file
+struct SceneDescription
+{
+   Camera camera() const
+   {
+      return Camera(lookFrom, lookAt, verticalFov, (float)width / height, aperture, focusDist);
+   }
+
+   World world;
+   uint32_t width = 1200;
+   uint32_t height = 800;
+   glm::vec3 lookFrom = glm::vec3(13.0f, 2.0f, 3.0f);
+   glm::vec3 lookAt = glm::vec3(0.0f);
+   float verticalFov = 20.0f;
+   float aperture = 0.1f;
+   float focusDist = 10.0f;
+   uint32_t samplesPerPixel = RenderSettings().samplesPerPixel;
+   int32_t maxDepth = RenderSettings().maxDepth;
+   uint32_t numThreads = RenderSettings().numThreads;
+};
+
+// Base of the text parsers. Files are streamed through one fixed buffer and lines are
+// tokenized in place, nothing is allocated per line.
+class LineParser
+{
+public:
+   static const size_t bufferSize = 1 << 20;
+
+protected:
+   // Streams the file through one fixed buffer and calls parseLine() for every line, with
+   // the tokenizer positioned at its start, until it fails. Prints the first error with its
+   // line number and returns false.
+   template<typename ParseLine>
+   bool parseFile(const std::string& filename, ParseLine&& parseLine)
+   {
+      FILE* file = std::fopen(filename.c_str(), "rb");
+      if (!file)
+      {
+         std::cout << "Cannot open " << filename << std::endl;
+         return false;
+      }
+
+      std::vector<char> buffer(bufferSize);
+      lineNumber = 0;
+      bool ok = true;
+      size_t pending = 0;
+
+      auto nextLine = [&](const char* begin, const char* end)
+      {
+         lineNumber++;
+         position = begin;
+         lineEnd = end;
+         return parseLine();
+      };
+
+      while (ok)
+      {
+         size_t read = std::fread(buffer.data() + pending, 1, buffer.size() - pending, file);
+         size_t filled = pending + read;
+         bool lastChunk = read == 0 || filled < buffer.size();
+
+         // Parse the complete lines and move the partial last one to the front
+         const char* begin = buffer.data();
+         const char* end = buffer.data() + filled;
+         const char* lineEnd;
+         while (ok && (lineEnd = (const char*)std::memchr(begin, '\n', end - begin)) != nullptr)
+         {
+            ok = nextLine(begin, lineEnd);
+            begin = lineEnd + 1;
+         }
+
+         pending = end - begin;
+         if (lastChunk)
+         {
+            if (ok && pending > 0)
+               ok = nextLine(begin, end);
+            break;
+         }
+
+         if (pending == buffer.size())
+         {
+            ok = fail("line longer than the read buffer");
+            break;
+         }
+         std::memmove(buffer.data(), begin, pending);
+      }
+
+      std::fclose(file);
+      if (!ok)
+         std::cout << filename << ":" << lineNumber << ": " << error << std::endl;
+      return ok;
+   }
+
+   // True if only whitespace or a comment is left on the line
+   bool atLineEnd()
+   {
+      std::string_view rest = nextWord();
+      return rest.empty() || rest[0] == '#';
+   }
+
+   std::string_view nextWord()
+   {
+      while (position < lineEnd && (*position == ' ' || *position == '\t' || *position == '\r'))
+         position++;
+      const char* begin = position;
+      while (position < lineEnd && *position != ' ' && *position != '\t' && *position != '\r')
+         position++;
+      return std::string_view(begin, position - begin);
+   }
+
+   template<typename T>
+   bool read(T& value)
+   {
+      std::string_view word = nextWord();
+      auto result = std::from_chars(word.data(), word.data() + word.size(), value);
+      return !word.empty() && result.ec == std::errc() && result.ptr == word.data() + word.size();
+   }
+
+   bool read(float& value)
+   {
+      std::string_view word = nextWord();
+      if (parseDecimal(word, value))
+         return true;
+
+      auto result = std::from_chars(word.data(), word.data() + word.size(), value);
+      return !word.empty() && result.ec == std::errc() && result.ptr == word.data() + word.size();
+   }
+
+   bool read(glm::vec3& value)
+   {
+      return read(value.x) && read(value.y) && read(value.z);
+   }
+
+   // Exact fast path for decimals like the ones SceneWriter emits. Up to 15 significant digits
+   // and powers of ten up to 1e22 are exact in a double, so the double result is correctly
+   // rounded. Rounding that to float can only go wrong when it lands exactly halfway between
+   // two floats, those and all other cases are left to std::from_chars.
+   static bool parseDecimal(std::string_view word, float& value)
+   {
+      static const double powersOfTen[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+      const char* position = word.data();
+      const char* end = position + word.size();
+      bool negative = position < end && *position == '-';
+      position += negative ? 1 : 0;
+
+      uint64_t mantissa = 0;
+      int32_t significantDigits = 0;
+      int32_t exponent = 0;
+      bool anyDigits = false;
+      bool fraction = false;
+      for (; position < end; position++)
+      {
+         if (*position == '.' && !fraction)
+         {
+            fraction = true;
+            continue;
+         }
+         if (*position < '0' || *position > '9')
+            break;
+
+         anyDigits = true;
+         mantissa = mantissa * 10 + (*position - '0');
+         significantDigits += mantissa > 0 ? 1 : 0;
+         exponent -= fraction ? 1 : 0;
+      }
+
+      if (position < end && (*position == 'e' || *position == 'E'))
+      {
+         int32_t explicitExponent;
+         auto result = std::from_chars(position + 1 + (position + 1 < end && *(position + 1) == '+' ? 1 : 0), end, explicitExponent);
+         if (result.ec != std::errc() || std::abs(explicitExponent) > 1000)
+            return false;
+         exponent += explicitExponent;
+         position = result.ptr;
+      }
+
+      if (!anyDigits || position != end || significantDigits > 15 || exponent < -22 || exponent > 22)
+         return false;
+
+      // A double halfway between two normal floats has a one followed by zeros in the 29
+      // mantissa bits that floats don't have
+      double exact = exponent < 0 ? (double)mantissa / powersOfTen[-exponent] : (double)mantissa * powersOfTen[exponent];
+      uint64_t bits;
+      std::memcpy(&bits, &exact, sizeof(bits));
+      if ((bits & 0x1fffffffull) == 0x10000000ull || exact > FLT_MAX)
+         return false;
+
+      value = negative ? -(float)exact : (float)exact;
+      return true;
+   }
+
+   bool fail(const char* message)
+   {
+      error = message;
+      return false;
+   }
+
+   const char* position = nullptr;
+   const char* lineEnd = nullptr;
+   uint64_t lineNumber = 0;
+   const char* error = "";
+};
+
+// Streaming Wavefront OBJ loader. Only vertex positions and faces are read, polygons are split
+// into triangle fans and everything else (normals, texture coordinates, groups, materials) is
+// skipped. Vertices and indices go straight into the mesh arrays.
+class ObjLoader : public LineParser
+{
+public:
+   bool load(const std::string& filename, TriangleMesh& mesh)
+   {
+      return parseFile(filename, [&]() { return parseLine(mesh); });
+   }
+
+private:
+   bool parseLine(TriangleMesh& mesh)
+   {
+      std::string_view keyword = nextWord();
+      if (keyword == "v")
+      {
+         glm::vec3 position;
+         if (!read(position))
+            return fail("invalid vertex");
+         mesh.addVertex(position);
+      }
+      else if (keyword == "f")
+      {
+         uint32_t first = 0, previous = 0;
+         uint32_t numCorners = 0;
+         for (std::string_view word = nextWord(); !word.empty() && word[0] != '#'; word = nextWord())
+         {
+            // Corners are v, v/vt, v//vn or v/vt/vn, negative indices count back from the last vertex
+            int64_t index;
+            auto result = std::from_chars(word.data(), word.data() + word.size(), index);
+            if (result.ec != std::errc() || (result.ptr != word.data() + word.size() && *result.ptr != '/'))
+               return fail("invalid face");
+
+            index = index < 0 ? mesh.numVertices() + index : index - 1;
+            if (index < 0 || index >= mesh.numVertices())
+               return fail("face refers to an undefined vertex");
+
+            if (numCorners == 0)
+               first = (uint32_t)index;
+            else if (numCorners >= 2)
+               mesh.addTriangle(first, previous, (uint32_t)index);
+            previous = (uint32_t)index;
+            numCorners++;
+         }
+
+         if (numCorners < 3)
+            return fail("face with less than three vertices");
+      }
+      return true;
+   }
+};
+
+// Scene files are plain text with one statement per line, '#' starts a comment:
+//
+//    resolution <width> <height>
+//    samples <spp>
+//    max-depth <depth>
+//    threads <count>
+//    camera <look from xyz> <look at xyz> <vertical fov> <aperture> <focus distance>
+//    lambertian <albedo rgb>
+//    metal <albedo rgb> <fuzz>
+//    dielectric <index of refraction>
+//    light <radiance rgb>
+//    sphere <center xyz> <radius> <material>
+//    mesh <OBJ file> <material>
+//    instance <OBJ file> <material> <object to world matrix, 3 rows of 4>
+//    reserve <materials> <spheres>
+//    sky <rgb>
+//
+// Materials are numbered in the order they appear, spheres and meshes refer to earlier
+// materials. Meshes and instances of the same file and material share one loaded mesh.
+// The optional reserve statement sizes the arrays up front instead of growing them.
+// Spheres are appended straight to the arrays of one SphereGroup.
+class SceneParser : public LineParser
+{
+public:
+   bool parse(const std::string& filename, SceneDescription& scene)
+   {
+      sphereGroup = std::make_shared<SphereGroup>();
+      meshes.clear();
+      if (!parseFile(filename, [&]() { return parseLine(scene); }))
+         return false;
+
+      if (sphereGroup->numSpheres() > 0)
+         scene.world.addObject(sphereGroup);
+      return true;
+   }
+
+private:
+   bool parseLine(SceneDescription& scene)
+   {
+      std::string_view keyword = nextWord();
+      if (keyword.empty() || keyword[0] == '#')
+         return true;
+
+      bool ok;
+      if (keyword == "sphere")
+      {
+         glm::vec3 center;
+         float radius;
+         uint32_t material;
+         ok = read(center) && read(radius) && read(material);
+         if (ok && material >= scene.world.numMaterials())
+            return fail("undefined material");
+         if (ok)
+            sphereGroup->addSphere(center, radius, material);
+      }
+      else if (keyword == "lambertian")
+      {
+         glm::vec3 albedo;
+         ok = read(albedo);
+         if (ok)
+            scene.world.addMaterial(Lambertian(albedo));
+      }
+      else if (keyword == "metal")
+      {
+         glm::vec3 albedo;
+         float fuzz;
+         ok = read(albedo) && read(fuzz);
+         if (ok)
+            scene.world.addMaterial(Metal(albedo, fuzz));
+      }
+      else if (keyword == "dielectric")
+      {
+         float indexOfRefraction;
+         ok = read(indexOfRefraction);
+         if (ok)
+            scene.world.addMaterial(Dielectric(indexOfRefraction));
+      }
+      else if (keyword == "light")
+      {
+         glm::vec3 radiance;
+         ok = read(radiance);
+         if (ok)
+            scene.world.addMaterial(DiffuseLight(radiance));
+      }
+      else if (keyword == "mesh" || keyword == "instance")
+      {
+         std::string_view path = nextWord();
+         uint32_t material;
+         ok = !path.empty() && read(material);
+         glm::mat4 objectToWorld(1.0f);
+         for (uint32_t row = 0; row < 3 && ok && keyword == "instance"; row++)
+         {
+            for (uint32_t column = 0; column < 4 && ok; column++)
+               ok = read(objectToWorld[column][row]);
+         }
+         if (ok && material >= scene.world.numMaterials())
+            return fail("undefined material");
+         if (ok)
+         {
+            // The error of the mesh file has been printed already
+            std::shared_ptr<TriangleMesh> mesh = loadMesh(path, material);
+            if (!mesh)
+               return fail("cannot load mesh");
+            if (keyword == "mesh")
+               scene.world.addObject(mesh);
+            else
+               scene.world.addObject(std::make_shared<Instance>(mesh, objectToWorld));
+         }
+      }
+      else if (keyword == "reserve")
+      {
+         uint32_t materials, spheres;
+         ok = read(materials) && read(spheres);
+         if (ok)
+         {
+            scene.world.reserveMaterials(materials);
+            sphereGroup->reserve(spheres);
+         }
+      }
+      else if (keyword == "camera")
+         ok = read(scene.lookFrom) && read(scene.lookAt) && read(scene.verticalFov) && read(scene.aperture) && read(scene.focusDist);
+      else if (keyword == "resolution")
+         ok = read(scene.width) && read(scene.height) && scene.width > 0 && scene.height > 0;
+      else if (keyword == "samples")
+         ok = read(scene.samplesPerPixel);
+      else if (keyword == "max-depth")
+         ok = read(scene.maxDepth);
+      else if (keyword == "threads")
+         ok = read(scene.numThreads) && scene.numThreads > 0;
+      else if (keyword == "sky")
+      {
+         glm::vec3 sky;
+         ok = read(sky);
+         if (ok)
+            scene.world.setSky(sky);
+      }
+      else
+         return fail("unknown statement");
+
+      if (!ok)
+         return fail("invalid or missing value");
+      return atLineEnd() ? true : fail("unexpected value");
+   }
+
+   std::shared_ptr<TriangleMesh> loadMesh(std::string_view path, uint32_t material)
+   {
+      for (const auto& mesh : meshes)
+      {
+         if (mesh->source == path && mesh->getMaterialId() == material)
+            return mesh;
+      }
+
+      auto mesh = std::make_shared<TriangleMesh>(material);
+      mesh->source = std::string(path);
+      if (!ObjLoader().load(mesh->source, *mesh))
+         return nullptr;
+      meshes.push_back(mesh);
+      return mesh;
+   }
+
+   std::shared_ptr<SphereGroup> sphereGroup;
+   std::vector<std::shared_ptr<TriangleMesh>> meshes;
+};
+
+// Writes scenes made of spheres, OBJ meshes and their instances in the format read by
+// SceneParser. Floats are written in their shortest form that parses back to the same
+// value, so a written scene renders identically.
+class SceneWriter
+{
+public:
+   bool write(const std::string& filename, const SceneDescription& scene)
+   {
+      file = std::fopen(filename.c_str(), "wb");
+      if (!file)
+         return false;
+
+      buffer.resize(bufferSize);
+      used = 0;
+      text("resolution");
+      value(scene.width);
+      value(scene.height);
+      text("\nsamples");
+      value(scene.samplesPerPixel);
+      text("\nmax-depth");
+      value(scene.maxDepth);
+      text("\nthreads");
+      value(scene.numThreads);
+      text("\ncamera");
+      value(scene.lookFrom);
+      value(scene.lookAt);
+      value(scene.verticalFov);
+      value(scene.aperture);
+      value(scene.focusDist);
+      text("\nsky");
+      value(scene.world.getSky());
+
+      const World& world = scene.world;
+      size_t numSpheres = 0;
+      for (const auto& object : world.getObjects())
+         numSpheres += std::dynamic_pointer_cast<const SphereGroup>(object) || std::dynamic_pointer_cast<const Sphere>(object) ? object->numPrimitives() : 0;
+      text("\nreserve");
+      value(world.numMaterials());
+      value((uint32_t)numSpheres);
+      text("\n");
+
+      for (uint32_t i = 0; i < world.numMaterials(); i++)
+      {
+         std::visit([&](const auto& material)
+         {
+            using Type = std::decay_t<decltype(material)>;
+            if constexpr (std::is_same_v<Type, Lambertian>)
+            {
+               text("lambertian");
+               value(material.albedo);
+            }
+            else if constexpr (std::is_same_v<Type, Metal>)
+            {
+               text("metal");
+               value(material.albedo);
+               value(material.fuzz);
+            }
+            else if constexpr (std::is_same_v<Type, Dielectric>)
+            {
+               text("dielectric");
+               value(material.ir);
+            }
+            else if constexpr (std::is_same_v<Type, DiffuseLight>)
+            {
+               text("light");
+               value(material.emitted);
+            }
+         }, world.getMaterial(i));
+         text("\n");
+      }
+
+      bool supported = true;
+      for (const auto& object : world.getObjects())
+      {
+         if (auto sphereGroup = std::dynamic_pointer_cast<const SphereGroup>(object))
+         {
+            SphereArrays spheres = sphereGroup->arrays();
+            const uint32_t* materialIds = sphereGroup->materialIdData();
+            for (uint32_t i = 0; i < sphereGroup->numSpheres(); i++)
+               sphere(glm::vec3(spheres.centerX[i], spheres.centerY[i], spheres.centerZ[i]), spheres.radius[i], materialIds[i]);
+         }
+         else if (auto sphereObject = std::dynamic_pointer_cast<const Sphere>(object))
+            sphere(sphereObject->center, sphereObject->radius, sphereObject->materialId);
+         else if (auto mesh = std::dynamic_pointer_cast<const TriangleMesh>(object); mesh && !mesh->source.empty())
+         {
+            text("mesh ");
+            text(mesh->source.c_str());
+            value(mesh->getMaterialId());
+            text("\n");
+         }
+         else if (auto instance = std::dynamic_pointer_cast<const Instance>(object))
+         {
+            auto instancedMesh = std::dynamic_pointer_cast<const TriangleMesh>(instance->getGeometry());
+            if (!instancedMesh || instancedMesh->source.empty())
+            {
+               supported = false;
+               continue;
+            }
+
+            text("instance ");
+            text(instancedMesh->source.c_str());
+            value(instancedMesh->getMaterialId());
+            const glm::mat4& transform = instance->getTransform();
+            for (uint32_t row = 0; row < 3; row++)
+            {
+               for (uint32_t column = 0; column < 4; column++)
+                  value(transform[column][row]);
+            }
+            text("\n");
+         }
+         else
+            supported = false;
+      }
+
+      flush();
+      bool ok = std::ferror(file) == 0;
+      std::fclose(file);
+      return ok && supported;
+   }
+
+private:
+   static const size_t bufferSize = 1 << 20;
+
+   void sphere(const glm::vec3& center, float radius, uint32_t materialId)
+   {
+      text("sphere");
+      value(center);
+      value(radius);
+      value(materialId);
+      text("\n");
+   }
+
+   void text(const char* string)
+   {
+      size_t length = std::strlen(string);
+      reserve(length);
+      std::memcpy(buffer.data() + used, string, length);
+      used += length;
+   }
+
+   // Appends a space and the number
+   template<typename T>
+   void value(T number)
+   {
+      reserve(32);
+      buffer[used++] = ' ';
+      used = std::to_chars(buffer.data() + used, buffer.data() + used + 31, number).ptr - buffer.data();
+   }
+
+   void value(const glm::vec3& vector)
+   {
+      value(vector.x);
+      value(vector.y);
+      value(vector.z);
+   }
+
+   void reserve(size_t size)
+   {
+      if (used + size > bufferSize)
+         flush();
+   }
+
+   void flush()
+   {
+      std::fwrite(buffer.data(), 1, used, file);
+      used = 0;
+   }
+
+   FILE* file = nullptr;
+   std::vector<char> buffer;
+   size_t used = 0;
+};
+
+const char* simdLevelName(SimdLevel level)
+{
+   return level == SimdLevel::AVX2 ? "avx2" : (level == SimdLevel::SSE41 ? "sse4.1" : "scalar");
+}
+
+// Seconds since start, as measured by the benchmarks
+double elapsedSeconds(std::chrono::high_resolution_clock::time_point start)
+{
+   return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// Camera of the random scene as rendered by default, shared by the benchmarks
+Camera benchmarkCamera(float aspectRatio)
+{
+   return Camera(glm::vec3(13.0f, 2.0f, 3.0f), glm::vec3(0.0f), 20.0f, aspectRatio, 0.1f, 10.0f);
+}
+
+// One ray through the corner of every pixel, with a fixed sequence of lens samples
+std::vector<Ray> cameraRays(const Camera& camera, uint32_t width, uint32_t height)
+{
+   RandomSampler sampler;
+   SampleStream stream(sampler, 0, 0, width, 0, 7);
+   std::vector<Ray> rays;
+   for (uint32_t y = 0; y < height; y++)
+   {
+      for (uint32_t x = 0; x < width; x++)
+         rays.push_back(camera.getRay((float)x / (width - 1), (float)y / (height - 1), stream));
+   }
+   return rays;
+}
+
+// Compares primary ray throughput of the linear scan, the BVH over individual sphere
+// objects and the packed SphereGroup with each SIMD kernel the CPU supports
+void benchmarkBVH()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> rays = cameraRays(camera, width, height);
+
+   auto timeBuild = [](World& world)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      world.build();
+      return elapsedSeconds(start) * 1000.0;
+   };
+
+   auto measure = [&](const World& world, bool linear, std::vector<float>& hitDistances)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < rays.size(); i++)
+      {
+         HitRecord hitRecord;
+         bool hit = linear ? world.hitLinear(rays[i], shadowAcneConstant, maxRayDistance, hitRecord) : world.hit(rays[i], shadowAcneConstant, maxRayDistance, hitRecord);
+         hitDistances[i] = hit ? hitRecord.t : -1.0f;
+      }
+      double seconds = elapsedSeconds(start);
+      return rays.size() / seconds;
+   };
+
+   auto countMismatches = [](const std::vector<float>& a, const std::vector<float>& b)
+   {
+      uint32_t mismatches = 0;
+      for (size_t i = 0; i < a.size(); i++)
+      {
+         if (a[i] != b[i])
+            mismatches++;
+      }
+      return mismatches;
+   };
+
+   for (int32_t gridExtent : { 11, 50, 100 })
+   {
+      World objectWorld = createRandomScene(gridExtent, false);
+      double objectBuildMs = timeBuild(objectWorld);
+
+      World packedWorld = createRandomScene(gridExtent);
+      double packedBuildMs = timeBuild(packedWorld);
+      auto sphereGroup = std::dynamic_pointer_cast<SphereGroup>(packedWorld.getObjects()[0]);
+
+      std::vector<float> linearHits(rays.size()), hits(rays.size());
+      double linearRate = measure(objectWorld, true, linearHits);
+      double bvhRate = measure(objectWorld, false, hits);
+
+      std::cout << objectWorld.numObjects() << " spheres" << std::endl;
+      std::cout << "   linear scan:       " << linearRate / 1e6 << " Mrays/s" << std::endl;
+      std::cout << "   bvh over objects:  " << bvhRate / 1e6 << " Mrays/s (" << bvhRate / linearRate << "x), built in " << objectBuildMs << " ms, "
+                << countMismatches(linearHits, hits) << " mismatching hits" << std::endl;
+
+      for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2 })
+      {
+         if (level > getSimdLevel())
+            break;
+
+         sphereGroup->setKernel(level);
+         double groupRate = measure(packedWorld, false, hits);
+         std::cout << "   sphere group " << simdLevelName(level) << ": " << groupRate / 1e6 << " Mrays/s (" << groupRate / linearRate << "x), built in "
+                   << packedBuildMs << " ms, " << countMismatches(linearHits, hits) << " mismatching hits" << std::endl;
+      }
+   }
+
+   // A sphere added after a build has to survive the next build
+   SphereGroup group;
+   group.addSphere(glm::vec3(0.0f), 1.0f, 0);
+   group.build(BVHBuildOptions());
+   group.addSphere(glm::vec3(4.0f, 0.0f, 0.0f), 1.0f, 0);
+   group.build(BVHBuildOptions());
+   HitRecord hitRecord;
+   bool rebuiltHit = group.hit(Ray(glm::vec3(4.0f, 0.0f, 10.0f), glm::vec3(0.0f, 0.0f, -1.0f)), shadowAcneConstant, maxRayDistance, hitRecord) && glm::abs(hitRecord.t - 9.0f) < 1e-4f;
+   std::cout << "sphere group rebuilt after adding a sphere: " << group.numSpheres() << " of 2 spheres, added sphere " << (rebuiltHit ? "hit" : "missed") << std::endl;
+}
+
+// Build time and tree quality of each BVH builder on growing random scenes, traced on one
+// thread so the ray rates only reflect the trees
+void benchmarkBuilders()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> rays = cameraRays(camera, width, height);
+
+   const std::pair<BVHBuilder, const char*> builders[] = { { BVHBuilder::SAH, "sah" }, { BVHBuilder::LBVH, "lbvh" }, { BVHBuilder::LBVHTreelets, "lbvh-treelets" } };
+   BVHBuildOptions options;
+   options.numThreads = glm::max(1u, std::thread::hardware_concurrency());
+
+   for (int32_t gridExtent : { 11, 50, 200, 500 })
+   {
+      World world = createRandomScene(gridExtent);
+      auto sphereGroup = std::dynamic_pointer_cast<SphereGroup>(world.getObjects()[0]);
+      std::cout << world.numPrimitives() << " spheres, " << options.numThreads << " build threads" << std::endl;
+
+      std::vector<float> sahHits(rays.size());
+      for (const auto& builder : builders)
+      {
+         options.builder = builder.first;
+         auto start = std::chrono::high_resolution_clock::now();
+         world.build(options);
+         double buildMs = elapsedSeconds(start) * 1000.0;
+
+         std::vector<float> hits(rays.size());
+         start = std::chrono::high_resolution_clock::now();
+         for (size_t i = 0; i < rays.size(); i++)
+         {
+            HitRecord hitRecord;
+            hits[i] = world.hit(rays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+         }
+         double seconds = elapsedSeconds(start);
+
+         if (builder.first == BVHBuilder::SAH)
+            sahHits = hits;
+         uint32_t mismatches = 0;
+         for (size_t i = 0; i < rays.size(); i++)
+            mismatches += hits[i] != sahHits[i] ? 1 : 0;
+
+         const BVH& bvh = sphereGroup->getBVH();
+         std::cout << "   " << builder.second << ": built in " << buildMs << " ms, " << bvh.nodes.size() << " nodes, SAH cost " << bvh.cost() << ", "
+                   << rays.size() / seconds / 1e6 << " Mrays/s, " << mismatches << " mismatching hits" << std::endl;
+      }
+   }
+}
+
+// Startup time of building the random scene against loading it from the scene cache, and
+// the hits of both against each other
+void benchmarkSceneCache()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   const std::string cacheFile = "scene_cache_bench.bin";
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> rays = cameraRays(camera, width, height);
+
+   auto trace = [&](const World& world, std::vector<float>& hitDistances)
+   {
+      for (size_t i = 0; i < rays.size(); i++)
+      {
+         HitRecord hitRecord;
+         hitDistances[i] = world.hit(rays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+      }
+   };
+
+   for (int32_t gridExtent : { 50, 200, 1118 })
+   {
+      std::vector<float> builtHits(rays.size()), loadedHits(rays.size());
+      uint64_t key = sceneCacheKey(gridExtent, BVHBuildOptions().builder);
+      double createMs, buildMs, saveMs;
+      size_t numSpheres;
+      {
+         auto start = std::chrono::high_resolution_clock::now();
+         World world = createRandomScene(gridExtent);
+         createMs = elapsedSeconds(start) * 1000.0;
+
+         start = std::chrono::high_resolution_clock::now();
+         world.build();
+         buildMs = elapsedSeconds(start) * 1000.0;
+
+         start = std::chrono::high_resolution_clock::now();
+         if (!saveSceneCache(cacheFile, world, key))
+         {
+            std::cout << "Failed to write " << cacheFile << std::endl;
+            return;
+         }
+         saveMs = elapsedSeconds(start) * 1000.0;
+         numSpheres = world.numPrimitives();
+         trace(world, builtHits);
+      }
+
+      auto start = std::chrono::high_resolution_clock::now();
+      World world;
+      bool loaded = loadSceneCache(cacheFile, key, world);
+      world.build();
+      double loadMs = elapsedSeconds(start) * 1000.0;
+
+      start = std::chrono::high_resolution_clock::now();
+      trace(world, loadedHits);
+      double traceMs = elapsedSeconds(start) * 1000.0;
+
+      uint32_t mismatches = 0;
+      for (size_t i = 0; i < rays.size(); i++)
+         mismatches += builtHits[i] != loadedHits[i] ? 1 : 0;
+
+      std::ifstream fin = std::ifstream(cacheFile, std::ios::binary | std::ios::ate);
+      std::cout << numSpheres << " spheres, " << fin.tellg() / (1024.0 * 1024.0) << " MB cache" << std::endl;
+      std::cout << "   create " << createMs << " ms + build " << buildMs << " ms, cache written in " << saveMs << " ms" << std::endl;
+      std::cout << "   " << (loaded ? "loaded in " : "failed to load in ") << loadMs << " ms, first " << width << "x" << height << " primary rays in " << traceMs
+                << " ms, " << mismatches << " mismatching hits" << std::endl;
+   }
+
+   std::remove(cacheFile.c_str());
+}
+
+// Throughput of writing and parsing scene files, against plain reads of the same file
+void benchmarkSceneFiles()
+{
+   const std::string sceneFile = "scene_bench.txt";
+
+   for (int32_t gridExtent : { 50, 200, 1118 })
+   {
+      SceneDescription generated;
+      generated.world = createRandomScene(gridExtent);
+
+      auto start = std::chrono::high_resolution_clock::now();
+      if (!SceneWriter().write(sceneFile, generated))
+      {
+         std::cout << "Failed to write " << sceneFile << std::endl;
+         return;
+      }
+      double writeSeconds = elapsedSeconds(start);
+
+      start = std::chrono::high_resolution_clock::now();
+      std::vector<char> buffer(SceneParser::bufferSize);
+      FILE* file = std::fopen(sceneFile.c_str(), "rb");
+      size_t fileSize = 0;
+      while (size_t read = std::fread(buffer.data(), 1, buffer.size(), file))
+         fileSize += read;
+      std::fclose(file);
+      double readSeconds = elapsedSeconds(start);
+
+      start = std::chrono::high_resolution_clock::now();
+      SceneDescription parsed;
+      bool ok = SceneParser().parse(sceneFile, parsed);
+      double parseSeconds = elapsedSeconds(start);
+
+      // Both scenes add the same spheres in the same order
+      uint32_t mismatches = 0;
+      auto generatedGroup = std::dynamic_pointer_cast<SphereGroup>(generated.world.getObjects()[0]);
+      auto parsedGroup = ok ? std::dynamic_pointer_cast<SphereGroup>(parsed.world.getObjects()[0]) : generatedGroup;
+      SphereArrays a = generatedGroup->arrays(), b = parsedGroup->arrays();
+      for (uint32_t i = 0; i < generatedGroup->numSpheres(); i++)
+      {
+         if (a.centerX[i] != b.centerX[i] || a.centerY[i] != b.centerY[i] || a.centerZ[i] != b.centerZ[i] || a.radius[i] != b.radius[i] ||
+             generatedGroup->materialIdData()[i] != parsedGroup->materialIdData()[i])
+            mismatches++;
+      }
+
+      double megabytes = fileSize / (1024.0 * 1024.0);
+      std::cout << generatedGroup->numSpheres() << " spheres, " << megabytes << " MB" << std::endl;
+      std::cout << "   write: " << writeSeconds * 1000.0 << " ms, " << megabytes / writeSeconds << " MB/s" << std::endl;
+      std::cout << "   read:  " << readSeconds * 1000.0 << " ms, " << megabytes / readSeconds << " MB/s" << std::endl;
+      std::cout << "   parse: " << parseSeconds * 1000.0 << " ms, " << megabytes / parseSeconds << " MB/s, " << parseSeconds / (generatedGroup->numSpheres() * 1e-9)
+                << " ns per sphere, " << mismatches << " mismatching spheres" << std::endl;
+   }
+
+   std::remove(sceneFile.c_str());
+}
+
+// Loads a closed UV sphere of about 1M triangles from an OBJ file and measures single-thread
+// primary ray throughput of each triangle kernel. Rays from the center towards random
+// directions and exactly towards the vertices test that no ray slips through the mesh.
+void benchmarkMesh()
+{
+   const uint32_t slices = 1000;
+   const uint32_t stacks = 500;
+   const float radius = 2.0f;
+   const std::string objFile = "mesh_bench.obj";
+
+   FILE* file = std::fopen(objFile.c_str(), "wb");
+   if (!file)
+   {
+      std::cout << "Failed to write " << objFile << std::endl;
+      return;
+   }
+
+   std::fprintf(file, "v 0 %.9g 0\n", radius);
+   for (uint32_t stack = 1; stack < stacks; stack++)
+   {
+      float theta = glm::pi<float>() * stack / stacks;
+      for (uint32_t slice = 0; slice < slices; slice++)
+      {
+         float phi = 2.0f * glm::pi<float>() * slice / slices;
+         std::fprintf(file, "v %.9g %.9g %.9g\n", radius * glm::sin(theta) * glm::cos(phi), radius * glm::cos(theta), radius * glm::sin(theta) * glm::sin(phi));
+      }
+   }
+   std::fprintf(file, "v 0 %.9g 0\n", -radius);
+
+   // Rings of quads between fans around the poles, written as polygons
+   auto ringVertex = [&](uint32_t ring, uint32_t slice) { return 2 + ring * slices + slice % slices; };
+   const uint32_t southPole = ringVertex(stacks - 1, 0);
+   for (uint32_t slice = 0; slice < slices; slice++)
+      std::fprintf(file, "f 1 %u %u\n", ringVertex(0, slice + 1), ringVertex(0, slice));
+   for (uint32_t ring = 0; ring + 1 < stacks - 1; ring++)
+   {
+      for (uint32_t slice = 0; slice < slices; slice++)
+         std::fprintf(file, "f %u %u %u %u\n", ringVertex(ring, slice), ringVertex(ring, slice + 1), ringVertex(ring + 1, slice + 1), ringVertex(ring + 1, slice));
+   }
+   for (uint32_t slice = 0; slice < slices; slice++)
+      std::fprintf(file, "f %u %u %u\n", southPole, ringVertex(stacks - 2, slice), ringVertex(stacks - 2, slice + 1));
+   std::fclose(file);
+
+   World world;
+   auto mesh = std::make_shared<TriangleMesh>(world.addMaterial(Lambertian(glm::vec3(0.5f))));
+   auto start = std::chrono::high_resolution_clock::now();
+   bool loaded = ObjLoader().load(objFile, *mesh);
+   double loadSeconds = elapsedSeconds(start);
+   std::ifstream fin = std::ifstream(objFile, std::ios::binary | std::ios::ate);
+   double megabytes = fin.tellg() / (1024.0 * 1024.0);
+   fin.close();
+   std::remove(objFile.c_str());
+   if (!loaded)
+      return;
+
+   world.addObject(mesh);
+   start = std::chrono::high_resolution_clock::now();
+   world.build();
+   double buildSeconds = elapsedSeconds(start);
+
+   std::cout << mesh->numTriangles() << " triangles, " << mesh->numVertices() << " vertices" << std::endl;
+   std::cout << "   loaded " << megabytes << " MB in " << loadSeconds * 1000.0 << " ms (" << megabytes / loadSeconds << " MB/s), built in " << buildSeconds * 1000.0 << " ms" << std::endl;
+
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> primaryRays = cameraRays(camera, width, height);
+
+   std::vector<Ray> insideRays;
+   RandomGenerator rng(11);
+   for (uint32_t i = 0; i < 1000000; i++)
+      insideRays.push_back(Ray(glm::vec3(0.0f), uniformSphere(glm::vec2(randomFloat(rng), randomFloat(rng)))));
+   TriangleArrays triangles = mesh->arrays();
+   for (uint32_t i = 0; i < mesh->numTriangles(); i += 2)
+      insideRays.push_back(Ray(glm::vec3(0.0f), glm::vec3(triangles.vertices[0][0][i], triangles.vertices[0][1][i], triangles.vertices[0][2][i])));
+
+   std::vector<float> scalarHits(primaryRays.size());
+   for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE41, SimdLevel::AVX2 })
+   {
+      if (level > getSimdLevel())
+         break;
+
+      mesh->setKernel(level);
+      std::vector<float> hits(primaryRays.size());
+      uint32_t numHits = 0;
+      start = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < primaryRays.size(); i++)
+      {
+         HitRecord hitRecord;
+         hits[i] = world.hit(primaryRays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+         numHits += hits[i] >= 0.0f ? 1 : 0;
+      }
+      double seconds = elapsedSeconds(start);
+
+      if (level == SimdLevel::Scalar)
+         scalarHits = hits;
+      uint32_t mismatches = 0;
+      for (size_t i = 0; i < hits.size(); i++)
+         mismatches += hits[i] != scalarHits[i] ? 1 : 0;
+
+      uint32_t escaped = 0;
+      for (const Ray& ray : insideRays)
+      {
+         HitRecord hitRecord;
+         escaped += world.hit(ray, 0.0f, maxRayDistance, hitRecord) ? 0 : 1;
+      }
+
+      // Consecutive rays point at neighbouring vertices, so most packets are coherent and culled
+      // by interval arithmetic
+      uint32_t packetEscaped = 0;
+      std::unique_ptr<RayPacket> packet = std::make_unique<RayPacket>();
+      for (size_t first = 0; first < insideRays.size(); first += RayPacket::maxSize)
+      {
+         packet->clear();
+         for (size_t i = first; i < glm::min(first + RayPacket::maxSize, insideRays.size()); i++)
+            packet->push(insideRays[i], maxRayDistance);
+         packet->computeBounds();
+         world.hitPacket(*packet, 0.0f);
+         for (uint32_t i = 0; i < packet->size; i++)
+            packetEscaped += packet->hits[i] ? 0 : 1;
+      }
+
+      std::cout << "   " << simdLevelName(level) << ": " << primaryRays.size() / seconds / 1e6 << " Mrays/s, " << numHits << " of " << primaryRays.size() << " rays hit, "
+                << mismatches << " mismatching hits, " << escaped << " of " << insideRays.size() << " rays from inside escaped, " << packetEscaped << " as packets" << std::endl;
+   }
+}
+
+// Fills a lattice in front of the camera with randomly rotated tori, once as instances of one
+// shared mesh and for the smallest count also as one mesh holding a transformed copy per
+// torus, and compares memory, build time and single-thread primary ray throughput.
+void benchmarkInstances()
+{
+   const uint32_t rings = 64;
+   const uint32_t sides = 32;
+
+   auto meshBytes = [](const TriangleMesh& mesh)
+   {
+      const BVH& bvh = mesh.getBVH();
+      return mesh.numVertices() * sizeof(glm::vec3) + mesh.numTriangles() * (3 * sizeof(uint32_t) + 9 * sizeof(float))
+         + bvh.numNodes() * sizeof(BVHNode) + bvh.primitiveIndices.size() * sizeof(uint32_t);
+   };
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> primaryRays = cameraRays(camera, width, height);
+
+   auto traceRays = [&](const World& world, std::vector<float>& hits)
+   {
+      hits.resize(primaryRays.size());
+      auto start = std::chrono::high_resolution_clock::now();
+      for (size_t i = 0; i < primaryRays.size(); i++)
+      {
+         HitRecord hitRecord;
+         hits[i] = world.hit(primaryRays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+      }
+      return primaryRays.size() / elapsedSeconds(start) / 1e6;
+   };
+
+   for (uint32_t lattice : { 8, 16, 40 })
+   {
+      const uint32_t numInstances = lattice * lattice * lattice;
+      const float spacing = 4.0f / lattice;
+      RandomGenerator rng(5);
+      std::vector<glm::mat4> transforms;
+      for (uint32_t x = 0; x < lattice; x++)
+      {
+         for (uint32_t y = 0; y < lattice; y++)
+         {
+            for (uint32_t z = 0; z < lattice; z++)
+            {
+               glm::vec3 position = (glm::vec3((float)x, (float)y, (float)z) - 0.5f * (lattice - 1)) * spacing;
+               glm::vec3 axis = uniformSphere(glm::vec2(randomFloat(rng), randomFloat(rng)));
+               glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+               transform = glm::rotate(transform, randomFloat(rng, 0.0f, 2.0f * glm::pi<float>()), axis);
+               transforms.push_back(glm::scale(transform, glm::vec3(0.3f * spacing)));
+            }
+         }
+      }
+
+      World instanced;
+      uint32_t material = instanced.addMaterial(Lambertian(glm::vec3(0.5f)));
+      auto torus = std::make_shared<TriangleMesh>(material);
+      addTorus(*torus, glm::mat4(1.0f), 1.0f, 0.4f, rings, sides);
+      for (const glm::mat4& transform : transforms)
+         instanced.addObject(std::make_shared<Instance>(torus, transform));
+
+      auto start = std::chrono::high_resolution_clock::now();
+      instanced.build();
+      double buildSeconds = elapsedSeconds(start);
+      size_t instancedBytes = meshBytes(*torus) + numInstances * (sizeof(Instance) + sizeof(std::shared_ptr<Object>))
+         + instanced.getBVH().numNodes() * sizeof(BVHNode) + instanced.getBVH().primitiveIndices.size() * sizeof(uint32_t);
+      std::vector<float> instancedHits;
+      double instancedRate = traceRays(instanced, instancedHits);
+
+      std::cout << numInstances << " instances of " << torus->numTriangles() << " triangles (" << instanced.numPrimitives() << " instanced):" << std::endl;
+      std::cout << "   instanced: " << instancedBytes / (1024.0 * 1024.0) << " MB, built in " << buildSeconds * 1000.0 << " ms, " << instancedRate << " Mrays/s" << std::endl;
+
+      // Copying the geometry costs the memory of the mesh per torus, only built for the smallest lattice
+      if (numInstances > 512)
+      {
+         std::cout << "   copied: " << numInstances * meshBytes(*torus) / (1024.0 * 1024.0) << " MB estimated" << std::endl;
+         continue;
+      }
+
+      World copied;
+      copied.addMaterial(Lambertian(glm::vec3(0.5f)));
+      auto copies = std::make_shared<TriangleMesh>(material);
+      copies->reserve(numInstances * torus->numVertices(), numInstances * torus->numTriangles());
+      for (const glm::mat4& transform : transforms)
+         addTorus(*copies, transform, 1.0f, 0.4f, rings, sides);
+      copied.addObject(copies);
+
+      start = std::chrono::high_resolution_clock::now();
+      copied.build();
+      buildSeconds = elapsedSeconds(start);
+      std::vector<float> copiedHits;
+      double copiedRate = traceRays(copied, copiedHits);
+
+      // The two transform paths round differently, hits only have to agree up to that
+      uint32_t mismatches = 0;
+      for (size_t i = 0; i < primaryRays.size(); i++)
+      {
+         bool bothMiss = instancedHits[i] < 0.0f && copiedHits[i] < 0.0f;
+         mismatches += bothMiss || glm::abs(instancedHits[i] - copiedHits[i]) <= 1e-3f * copiedHits[i] ? 0 : 1;
+      }
+
+      std::cout << "   copied: " << meshBytes(*copies) / (1024.0 * 1024.0) << " MB, built in " << buildSeconds * 1000.0 << " ms, " << copiedRate << " Mrays/s, "
+                << mismatches << " of " << primaryRays.size() << " rays hit differently" << std::endl;
+   }
+}
+
+// 16x16x16 randomly rotated instances of one 4096 triangle torus around the origin
+World createTorusCloud()
+{
+   World world;
+   auto torus = std::make_shared<TriangleMesh>(world.addMaterial(Lambertian(glm::vec3(0.5f))));
+   addTorus(*torus, glm::mat4(1.0f), 1.0f, 0.4f, 64, 32);
+   RandomGenerator rng(5);
+   for (uint32_t i = 0; i < 4096; i++)
+   {
+      glm::vec3 position = (glm::vec3((float)(i % 16), (float)(i / 16 % 16), (float)(i / 256)) - 7.5f) * 0.25f;
+      glm::mat4 transform = glm::rotate(glm::translate(glm::mat4(1.0f), position), randomFloat(rng, 0.0f, 6.0f), uniformSphere(glm::vec2(randomFloat(rng), randomFloat(rng))));
+      world.addObject(std::make_shared<Instance>(torus, glm::scale(transform, glm::vec3(0.075f))));
+   }
+   return world;
+}
+
+// Single-thread closest hit throughput of each BVH node layout, for camera rays and for the
+// incoherent diffuse bounce rays from their hits, on random scenes of up to 1M spheres and
+// on the instanced torus lattice
+void benchmarkLayouts()
+{
+   std::vector<std::pair<BVHLayout, const char*>> layouts = { { BVHLayout::Binary, "binary" }, { BVHLayout::Quantized4, "quantized4" }, { BVHLayout::Wide4, "wide4" } };
+   if (getSimdLevel() == SimdLevel::AVX2)
+      layouts.push_back({ BVHLayout::Wide8, "wide8" });
+
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> primaryRays = cameraRays(camera, width, height);
+
+   struct Scene
+   {
+      std::string name;
+      std::function<World()> create;
+   };
+   std::vector<Scene> scenes;
+   for (int32_t gridExtent : { 11, 100, 500 })
+      scenes.push_back({ "random " + std::to_string(gridExtent), [gridExtent]() { return createRandomScene(gridExtent); } });
+   scenes.push_back({ "4096 torus instances", []() { return createTorusCloud(); } });
+
+   for (const Scene& scene : scenes)
+   {
+      // One world per layout, so the timed runs can alternate between them
+      std::vector<World> worlds;
+      for (const auto& layout : layouts)
+      {
+         BVHBuildOptions options;
+         options.layout = layout.first;
+         worlds.push_back(scene.create());
+         worlds.back().build(options);
+      }
+      std::cout << scene.name << ": " << worlds[0].numPrimitives() << " primitives" << std::endl;
+
+      // Bounce rays leave the camera ray hits in cosine distributed directions
+      std::vector<Ray> bounceRays;
+      RandomSampler bounceSampler;
+      SampleStream bounceStream(bounceSampler, 0, 0, width, 0, 11);
+      for (const Ray& ray : primaryRays)
+      {
+         HitRecord hitRecord;
+         if (worlds[0].hit(ray, shadowAcneConstant, maxRayDistance, hitRecord))
+            bounceRays.push_back(Ray(hitRecord.pos, hitRecord.normal + randomUnitVector(bounceStream)));
+      }
+
+      // Best of five rounds over all layouts, hits compared against the binary tree
+      std::vector<double> rates(2 * layouts.size(), 0.0);
+      std::vector<uint32_t> mismatches(layouts.size(), 0);
+      for (uint32_t pass = 0; pass < 2; pass++)
+      {
+         const std::vector<Ray>& rays = pass == 0 ? primaryRays : bounceRays;
+         std::vector<float> referenceHits;
+         std::vector<float> hits(rays.size());
+         for (uint32_t round = 0; round < 5; round++)
+         {
+            for (size_t layout = 0; layout < layouts.size(); layout++)
+            {
+               auto start = std::chrono::high_resolution_clock::now();
+               for (size_t i = 0; i < rays.size(); i++)
+               {
+                  HitRecord hitRecord;
+                  hits[i] = worlds[layout].hit(rays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+               }
+               double seconds = elapsedSeconds(start);
+               rates[2 * layout + pass] = glm::max(rates[2 * layout + pass], rays.size() / seconds / 1e6);
+
+               if (round > 0)
+                  continue;
+               if (layout == 0)
+                  referenceHits = hits;
+               for (size_t i = 0; i < hits.size(); i++)
+                  mismatches[layout] += hits[i] != referenceHits[i] ? 1 : 0;
+            }
+         }
+      }
+
+      for (size_t layout = 0; layout < layouts.size(); layout++)
+      {
+         // Node memory of the world and of every primitive group it holds, in total and the part
+         // single rays traverse
+         const World& world = worlds[layout];
+         size_t bytes = world.getBVH().nodeBytes();
+         size_t traversedBytes = world.getBVH().traversedNodeBytes();
+         size_t numPrimitives = world.numObjects();
+         for (const auto& object : world.getObjects())
+         {
+            if (auto sphereGroup = std::dynamic_pointer_cast<const SphereGroup>(object))
+            {
+               bytes += sphereGroup->getBVH().nodeBytes();
+               traversedBytes += sphereGroup->getBVH().traversedNodeBytes();
+               numPrimitives += sphereGroup->numSpheres() - 1;
+            }
+         }
+         if (auto instance = std::dynamic_pointer_cast<const Instance>(world.getObjects()[0]))
+         {
+            const TriangleMesh& mesh = static_cast<const TriangleMesh&>(*instance->getGeometry());
+            bytes += mesh.getBVH().nodeBytes();
+            traversedBytes += mesh.getBVH().traversedNodeBytes();
+            numPrimitives += mesh.numTriangles();
+         }
+
+         std::cout << "   " << layouts[layout].second << ": " << (double)bytes / numPrimitives << " node bytes per primitive (" << (double)traversedBytes / numPrimitives
+                   << " traversed by single rays), camera " << rates[2 * layout] << " Mrays/s, bounce " << rates[2 * layout + 1] << " Mrays/s, " << mismatches[layout]
+                   << " mismatching hits" << std::endl;
+      }
+   }
+}
+
+// Shadow rays towards a point light and short ambient occlusion rays from the camera ray hits,
+// answered by the closest hit query and by the occlusion query
+void benchmarkOcclusion()
+{
+   std::vector<std::pair<BVHLayout, const char*>> layouts = { { BVHLayout::Binary, "binary" }, { BVHLayout::Wide4, "wide4" } };
+   if (getSimdLevel() == SimdLevel::AVX2)
+      layouts.push_back({ BVHLayout::Wide8, "wide8" });
+
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 240;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+   std::vector<Ray> primaryRays = cameraRays(camera, width, height);
+
+   struct Scene
+   {
+      std::string name;
+      std::function<World()> create;
+      glm::vec3 light;
+      float occlusionRadius;
+   };
+   std::vector<Scene> scenes;
+   for (int32_t gridExtent : { 11, 100 })
+      scenes.push_back({ "random " + std::to_string(gridExtent), [gridExtent]() { return createRandomScene(gridExtent); }, glm::vec3(4.0f, 10.0f, -3.0f), 1.0f });
+   scenes.push_back({ "4096 torus instances", []() { return createTorusCloud(); }, glm::vec3(4.0f, 10.0f, -3.0f), 0.25f });
+
+   for (const Scene& scene : scenes)
+   {
+      for (const auto& layout : layouts)
+      {
+         BVHBuildOptions options;
+         options.layout = layout.first;
+         World world = scene.create();
+         world.build(options);
+
+         // Shadow rays end at the light, their direction is not normalized so t_max is 1
+         std::vector<Ray> shadowRays;
+         std::vector<Ray> occlusionRays;
+         RandomSampler bounceSampler;
+         SampleStream bounceStream(bounceSampler, 0, 0, width, 0, 11);
+         for (const Ray& ray : primaryRays)
+         {
+            HitRecord hitRecord;
+            if (!world.hit(ray, shadowAcneConstant, maxRayDistance, hitRecord))
+               continue;
+            shadowRays.push_back(Ray(hitRecord.pos, scene.light - hitRecord.pos));
+            occlusionRays.push_back(Ray(hitRecord.pos, glm::normalize(hitRecord.normal + randomUnitVector(bounceStream))));
+         }
+
+         std::cout << scene.name << ", " << layout.second << ":" << std::endl;
+         for (uint32_t pass = 0; pass < 2; pass++)
+         {
+            const std::vector<Ray>& rays = pass == 0 ? shadowRays : occlusionRays;
+            float t_max = pass == 0 ? 1.0f : scene.occlusionRadius;
+
+            // Blocked rays are where the early exit pays off, clear ones visit the same nodes either way
+            std::vector<Ray> groups[2];
+            uint32_t mismatches = 0;
+            for (const Ray& ray : rays)
+            {
+               HitRecord hitRecord;
+               bool blocked = world.hit(ray, shadowAcneConstant, t_max, hitRecord);
+               mismatches += blocked != world.occluded(ray, shadowAcneConstant, t_max) ? 1 : 0;
+               groups[blocked ? 1 : 0].push_back(ray);
+            }
+
+            std::cout << "   " << (pass == 0 ? "shadow" : "ambient occlusion") << ", " << mismatches << " mismatches" << std::endl;
+            for (uint32_t blocked = 0; blocked < 2; blocked++)
+            {
+               // Best of five alternating rounds
+               const std::vector<Ray>& group = groups[blocked];
+               double closestRate = 0.0, anyRate = 0.0;
+               uint32_t count = 0;
+               for (uint32_t round = 0; round < 5; round++)
+               {
+                  auto start = std::chrono::high_resolution_clock::now();
+                  for (const Ray& ray : group)
+                  {
+                     HitRecord hitRecord;
+                     count += world.hit(ray, shadowAcneConstant, t_max, hitRecord) ? 1 : 0;
+                  }
+                  double seconds = elapsedSeconds(start);
+                  closestRate = glm::max(closestRate, group.size() / seconds / 1e6);
+
+                  start = std::chrono::high_resolution_clock::now();
+                  for (const Ray& ray : group)
+                     count += world.occluded(ray, shadowAcneConstant, t_max) ? 1 : 0;
+                  seconds = elapsedSeconds(start);
+                  anyRate = glm::max(anyRate, group.size() / seconds / 1e6);
+               }
+
+               std::cout << "      " << group.size() << (blocked ? " blocked" : " clear") << " rays: closest hit " << closestRate << " Mrays/s, occlusion " << anyRate << " Mrays/s ("
+                         << anyRate / closestRate << "x)" << (count == blocked * 10 * group.size() ? "" : ", inconsistent") << std::endl;
+            }
+         }
+      }
+   }
+}
+
+// Primary ray pass at full resolution, one ray at a time against packets of 4x4 and 8x8 pixels
+void benchmarkPackets()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 1200;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+
+   World world = createRandomScene();
+   world.build();
+
+   RandomSampler sampler;
+   SampleStream stream(sampler, 0, 0, width, 0, 7);
+   std::vector<Ray> rays(width * height);
+   for (uint32_t y = 0; y < height; y++)
+   {
+      for (uint32_t x = 0; x < width; x++)
+      {
+         glm::vec2 jitter = stream.next2D();
+         rays[y * width + x] = camera.getRay((x + jitter.x) / (width - 1), (y + jitter.y) / (height - 1), stream);
+      }
+   }
+
+   std::vector<float> singleHits(rays.size());
+   auto start = std::chrono::high_resolution_clock::now();
+   for (size_t i = 0; i < rays.size(); i++)
+   {
+      HitRecord hitRecord;
+      singleHits[i] = world.hit(rays[i], shadowAcneConstant, maxRayDistance, hitRecord) ? hitRecord.t : -1.0f;
+   }
+   double singleSeconds = elapsedSeconds(start);
+   std::cout << width << "x" << height << " primary rays, " << world.numPrimitives() << " spheres" << std::endl;
+   std::cout << "   single rays:  " << singleSeconds * 1000.0 << " ms, " << rays.size() / singleSeconds / 1e6 << " Mrays/s" << std::endl;
+
+   std::unique_ptr<RayPacket> packet = std::make_unique<RayPacket>();
+   for (uint32_t packetSize : { 4, 8 })
+   {
+      std::vector<float> packetHits(rays.size());
+      start = std::chrono::high_resolution_clock::now();
+      for (uint32_t blockY = 0; blockY < height; blockY += packetSize)
+      {
+         for (uint32_t blockX = 0; blockX < width; blockX += packetSize)
+         {
+            packet->clear();
+            for (uint32_t y = blockY; y < glm::min(blockY + packetSize, height); y++)
+            {
+               for (uint32_t x = blockX; x < glm::min(blockX + packetSize, width); x++)
+                  packet->push(rays[y * width + x], maxRayDistance);
+            }
+
+            packet->computeBounds();
+            world.hitPacket(*packet, shadowAcneConstant);
+
+            uint32_t i = 0;
+            for (uint32_t y = blockY; y < glm::min(blockY + packetSize, height); y++)
+            {
+               for (uint32_t x = blockX; x < glm::min(blockX + packetSize, width); x++, i++)
+                  packetHits[y * width + x] = packet->hits[i] ? packet->hitRecords[i].t : -1.0f;
+            }
+         }
+      }
+      double packetSeconds = elapsedSeconds(start);
+
+      uint32_t mismatches = 0;
+      for (size_t i = 0; i < rays.size(); i++)
+         mismatches += singleHits[i] != packetHits[i] ? 1 : 0;
+
+      std::cout << "   " << packetSize << "x" << packetSize << " packets: " << packetSeconds * 1000.0 << " ms, " << rays.size() / packetSeconds / 1e6 << " Mrays/s ("
+                << singleSeconds / packetSeconds << "x), " << mismatches << " mismatching hits" << std::endl;
+   }
+}
+
+// Closest hit over the spheres of the random scene, written the way World::hit filled records
+// before they carried an index: every closer hit goes to a temporary record with its material
+// handle, which is then copied into the result. Compares a shared_ptr handle against the index
+// on the same intersection work, with all threads sharing the materials.
+void benchmarkMaterialHandles()
+{
+   struct SharedPtrRecord
+   {
+      std::shared_ptr<Material> material;
+      glm::vec3 pos;
+      glm::vec3 normal;
+      float t;
+      bool frontFace;
+   };
+
+   struct SphereData
+   {
+      glm::vec3 center;
+      float radius;
+      uint32_t materialId;
+      std::shared_ptr<Material> material;
+   };
+
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 120;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   const uint32_t repetitions = 4;
+   Camera camera = benchmarkCamera(aspectRatio);
+
+   World world = createRandomScene(11, false);
+   std::vector<std::shared_ptr<Material>> sharedMaterials;
+   for (uint32_t i = 0; i < world.numMaterials(); i++)
+      sharedMaterials.push_back(std::make_shared<Material>(world.getMaterial(i)));
+
+   std::vector<SphereData> spheres;
+   for (const auto& object : world.getObjects())
+   {
+      if (auto sphere = dynamic_cast<const Sphere*>(object.get()))
+         spheres.push_back({ sphere->center, sphere->radius, sphere->materialId, sharedMaterials[sphere->materialId] });
+   }
+   std::vector<Ray> rays = cameraRays(camera, width, height);
+
+   auto closestHit = [&](const Ray& ray, auto& hitRecord, auto setMaterial)
+   {
+      bool hitAnything = false;
+      float closest = maxRayDistance;
+      for (const SphereData& sphere : spheres)
+      {
+         glm::vec3 originToCenter = ray.origin - sphere.center;
+         float a = glm::length2(ray.dir);
+         float half_b = glm::dot(originToCenter, ray.dir);
+         float c = glm::length2(originToCenter) - sphere.radius * sphere.radius;
+         float discriminant = half_b * half_b - a * c;
+         if (discriminant < 0)
+            continue;
+
+         float sqrtd = glm::sqrt(discriminant);
+         float root = (-half_b - sqrtd) / a;
+         if (root < shadowAcneConstant || root > closest)
+         {
+            root = (-half_b + sqrtd) / a;
+            if (root < shadowAcneConstant || root > closest)
+               continue;
+         }
+
+         std::decay_t<decltype(hitRecord)> tempRecord;
+         tempRecord.t = root;
+         tempRecord.pos = ray.at(root);
+         glm::vec3 outwardNormal = (tempRecord.pos - sphere.center) / sphere.radius;
+         tempRecord.frontFace = glm::dot(ray.dir, outwardNormal) < 0.0f;
+         tempRecord.normal = tempRecord.frontFace ? outwardNormal : -outwardNormal;
+         setMaterial(tempRecord, sphere);
+
+         hitRecord = tempRecord;
+         closest = root;
+         hitAnything = true;
+      }
+      return hitAnything;
+   };
+
+   // Both candidates return the hit distance plus the type of the hit material, so the handle
+   // has to be followed
+   auto measure = [&](uint32_t numThreads, auto candidateFunc)
+   {
+      std::vector<float> sinks(numThreads * 16);
+      auto start = std::chrono::high_resolution_clock::now();
+
+      std::vector<std::thread> threads;
+      for (uint32_t i = 0; i < numThreads; i++)
+      {
+         threads.push_back(std::thread([&, i]()
+         {
+            float sink = 0.0f;
+            for (uint32_t n = 0; n < repetitions; n++)
+            {
+               for (const Ray& ray : rays)
+                  sink += candidateFunc(ray);
+            }
+            sinks[i * 16] = sink;
+         }));
+      }
+      std::for_each(threads.begin(), threads.end(), [](std::thread& t) { t.join(); });
+
+      double seconds = elapsedSeconds(start);
+      return seconds * 1e9 / (repetitions * rays.size());
+   };
+
+   std::cout << spheres.size() << " spheres, " << rays.size() << " camera rays" << std::endl;
+   uint32_t maxThreads = glm::max(1u, std::thread::hardware_concurrency());
+   for (uint32_t numThreads : { 1u, maxThreads })
+   {
+      double sharedNs = measure(numThreads, [&](const Ray& ray)
+      {
+         SharedPtrRecord hitRecord;
+         if (!closestHit(ray, hitRecord, [](SharedPtrRecord& record, const SphereData& sphere) { record.material = sphere.material; }))
+            return 0.0f;
+         return hitRecord.t + (float)hitRecord.material->index();
+      });
+
+      double indexNs = measure(numThreads, [&](const Ray& ray)
+      {
+         HitRecord hitRecord;
+         if (!closestHit(ray, hitRecord, [](HitRecord& record, const SphereData& sphere) { record.materialId = sphere.materialId; }))
+            return 0.0f;
+         return hitRecord.t + (float)world.getMaterial(hitRecord.materialId).index();
+      });
+
+      std::cout << numThreads << " threads: shared_ptr " << sharedNs << " ns/ray, index " << indexNs << " ns/ray (" << sharedNs / indexNs << "x)" << std::endl;
+   }
+}
+
+// Shading cost per bounce on the random scene. Compares virtual calls, dispatching on the
+// variant for every hit, and binning hits by material type and shading each bin in one loop.
+void benchmarkShading()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 600;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   const int32_t capturedBounces = 4;
+   Camera camera = benchmarkCamera(aspectRatio);
+   World world = createRandomScene();
+   world.build();
+
+   // Capture the hits of the first few bounces of one path per pixel
+   RandomSampler sampler;
+   std::vector<PathState> hits;
+   for (uint32_t y = 0; y < height; y++)
+   {
+      for (uint32_t x = 0; x < width; x++)
+      {
+         SampleStream stream(sampler, x, y, width, 0, 0);
+         PathState path = { camera.getRay((x + 0.5f) / (width - 1), (y + 0.5f) / (height - 1), stream), glm::vec3(1.0f), glm::vec3(0.0f), HitRecord(), stream };
+
+         for (int32_t depth = 0; depth < capturedBounces; depth++)
+         {
+            if (!world.hit(path.ray, shadowAcneConstant, maxRayDistance, path.hitRecord))
+               break;
+
+            hits.push_back(path);
+            Ray scatteredRay;
+            glm::vec3 attenuation;
+            path.stream.startBounce(depth);
+            if (!scatter(world.getMaterial(path.hitRecord.materialId), path.ray, path.hitRecord, attenuation, scatteredRay, path.stream))
+               break;
+            path.ray = scatteredRay;
+         }
+      }
+   }
 
-   world.addObject(std::make_shared<Sphere>(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, groundMaterial));
-   world.addObject(std::make_shared<Sphere>(glm::vec3(-4.0f, 1.0, 0.0), 1.0f, lambertianMaterial));
-   world.addObject(std::make_shared<Sphere>(glm::vec3(0.0f, 1.0, 0.0), 1.0f, dielectricMaterial));
-   world.addObject(std::make_shared<Sphere>(glm::vec3(4.0f, 1.0, 0.0), 1.0f, metalMaterial));
-   
-   for (int a = -11; a < 11; a++)
+   // Virtual calls through heap allocated materials, the representation before the variant
+   struct VirtualMaterial
+   {
+      virtual ~VirtualMaterial() {}
+      virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const = 0;
+   };
+
+   std::vector<std::unique_ptr<VirtualMaterial>> virtualMaterials;
+   for (uint32_t i = 0; i < world.numMaterials(); i++)
    {
-      for (int b = -11; b < 11; b++)
+      std::visit([&](const auto& typedMaterial)
       {
-         float chooseMat = randomFloat();
-         glm::vec3 center = glm::vec3(a + 0.9f * randomFloat(), 0.2f, b + 0.9f * randomFloat());
+         using MaterialType = std::decay_t<decltype(typedMaterial)>;
+         struct TypedVirtualMaterial : VirtualMaterial
+         {
+            TypedVirtualMaterial(const MaterialType& material) : material(material) {}
 
-         if (glm::distance(center, glm::vec3(4.0f, 0.2f, 0.0f)) > 0.9f)
+            virtual bool scatter(const Ray& inputRay, const HitRecord& hitRecord, glm::vec3& attenuation, Ray& scatteredRay, SampleStream& stream) const override
+            {
+               return material.scatter(inputRay, hitRecord, attenuation, scatteredRay, stream);
+            }
+
+            MaterialType material;
+         };
+         virtualMaterials.push_back(std::make_unique<TypedVirtualMaterial>(typedMaterial));
+      }, world.getMaterial(i));
+   }
+
+   // Hits are shaded in tile sized batches like the renderer does
+   const uint32_t batchSize = 1024;
+   const uint32_t repetitions = 10;
+   std::vector<uint32_t> survivors;
+   std::vector<uint32_t> bins[numMaterialTypes];
+   double seconds[3] = {};
+   uint64_t rayCount = 0;
+
+   auto shadeUnsorted = [&](std::vector<PathState>& paths, auto scatterFunc)
+   {
+      for (uint32_t i = 0; i < paths.size(); i++)
+      {
+         PathState& path = paths[i];
+         Ray scatteredRay;
+         glm::vec3 attenuation;
+         if (!scatterFunc(path, attenuation, scatteredRay))
+            continue;
+
+         path.throughput *= attenuation;
+         path.ray = scatteredRay;
+         if (continuePath(0, path.throughput, path.stream))
+            survivors.push_back(i);
+      }
+   };
+
+   for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+   {
+      for (size_t first = 0; first < hits.size(); first += batchSize)
+      {
+         const std::vector<PathState> batch(hits.begin() + first, hits.begin() + glm::min(first + batchSize, hits.size()));
+
+         for (uint32_t method = 0; method < 3; method++)
          {
-            std::shared_ptr<Material> material;
+            std::vector<PathState> paths = batch;
+            survivors.clear();
+            auto start = std::chrono::high_resolution_clock::now();
 
-            if (chooseMat < 0.8f)
+            if (method == 0)
             {
-               glm::vec3 color1 = glm::vec3(randomFloat(), randomFloat(), randomFloat());
-               glm::vec3 color2 = glm::vec3(randomFloat(), randomFloat(), randomFloat());
-               glm::vec3 albedo = color1 * color2;
-               material = std::make_shared<Lambertian>(albedo);
-               world.addObject(std::make_shared<Sphere>(center, 0.2, material));
+               shadeUnsorted(paths, [&](PathState& path, glm::vec3& attenuation, Ray& scatteredRay)
+               {
+                  return virtualMaterials[path.hitRecord.materialId]->scatter(path.ray, path.hitRecord, attenuation, scatteredRay, path.stream);
+               });
             }
-            else if (chooseMat < 0.95f)
+            else if (method == 1)
             {
-               glm::vec3 albedo = glm::vec3(randomFloat(0.5f, 1.0f), randomFloat(0.5f, 1.0f), randomFloat(0.5f, 1.0f));
-               float fuzz = randomFloat(0.0f, 0.5f);
-               material = std::make_shared<Metal>(albedo, fuzz);
-               world.addObject(std::make_shared<Sphere>(center, 0.2, material));
+               shadeUnsorted(paths, [&](PathState& path, glm::vec3& attenuation, Ray& scatteredRay)
+               {
+                  return scatter(world.getMaterial(path.hitRecord.materialId), path.ray, path.hitRecord, attenuation, scatteredRay, path.stream);
+               });
             }
             else
             {
-               material = std::make_shared<Dielectric>(1.5f);
-               world.addObject(std::make_shared<Sphere>(center, 0.2, material));
+               // Binning is part of the measured cost
+               for (std::vector<uint32_t>& bin : bins)
+                  bin.clear();
+               for (uint32_t i = 0; i < paths.size(); i++)
+                  bins[world.getMaterial(paths[i].hitRecord.materialId).index()].push_back(i);
+               shadeBins(paths, bins, world, 0, survivors, rayCount, std::make_index_sequence<numMaterialTypes>());
             }
+
+            seconds[method] += elapsedSeconds(start);
          }
       }
    }
 
-   return world;
+   double shades = (double)hits.size() * repetitions;
+   std::cout << hits.size() << " hits from " << capturedBounces << " bounces" << std::endl;
+   std::cout << "   virtual calls:   " << seconds[0] * 1e9 / shades << " ns per shade" << std::endl;
+   std::cout << "   variant:         " << seconds[1] * 1e9 / shades << " ns per shade (" << seconds[0] / seconds[1] << "x)" << std::endl;
+   std::cout << "   material sorted: " << seconds[2] * 1e9 / shades << " ns per shade (" << seconds[0] / seconds[2] << "x)" << std::endl;
 }
 
-int main(void)
+// Renders a fixed set of fixed-seed scenes and writes primary and total rays/sec, the cost
+// of a World::hit call and the scaling from 1 to N threads to a JSON file
+void benchmarkRender(const std::string& outputFile)
 {
+   struct BenchmarkScene
+   {
+      std::string name;
+      std::function<World()> create;
+   };
+
+   const std::vector<BenchmarkScene> scenes =
+   {
+      { "random-11", []() { return createRandomScene(11); } },
+      { "random-50", []() { return createRandomScene(50); } },
+      { "random-200", []() { return createRandomScene(200); } },
+      { "glass-11", []() { return createGlassScene(11); } },
+      { "sky", []() { return World(); } },
+   };
+
    const float aspectRatio = 3.0f / 2.0f;
-   const uint32_t width = 1200;
+   const uint32_t width = 300;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   Camera camera = benchmarkCamera(aspectRatio);
+
+   RenderSettings settings;
+   settings.samplesPerPixel = 8;
+   settings.quiet = true;
+
+   const uint32_t maxThreads = glm::max(1u, std::thread::hardware_concurrency());
+   std::vector<uint32_t> threadCounts;
+   for (uint32_t numThreads = 1; numThreads < maxThreads; numThreads *= 2)
+      threadCounts.push_back(numThreads);
+   threadCounts.push_back(maxThreads);
+
+   std::ofstream json = std::ofstream(outputFile);
+   json << "{\n";
+   json << "  \"simd\": \"" << simdLevelName(getSimdLevel()) << "\",\n";
+   json << "  \"width\": " << width << ",\n";
+   json << "  \"height\": " << height << ",\n";
+   json << "  \"samplesPerPixel\": " << settings.samplesPerPixel << ",\n";
+   json << "  \"maxDepth\": " << settings.maxDepth << ",\n";
+   json << "  \"scenes\": [\n";
+
+   for (size_t sceneIndex = 0; sceneIndex < scenes.size(); sceneIndex++)
+   {
+      const BenchmarkScene& scene = scenes[sceneIndex];
+      World world = scene.create();
+
+      auto buildStart = std::chrono::high_resolution_clock::now();
+      world.build();
+      double buildMs = elapsedSeconds(buildStart) * 1000.0;
+
+      // World::hit cost over primary rays and their first bounce, on a single thread
+      std::vector<Ray> rays;
+      RandomSampler sampler;
+      SampleStream stream(sampler, 0, 0, width, 0, 7);
+      for (uint32_t y = 0; y < height; y++)
+      {
+         for (uint32_t x = 0; x < width; x++)
+         {
+            Ray ray = camera.getRay((x + 0.5f) / (width - 1), (y + 0.5f) / (height - 1), stream);
+            rays.push_back(ray);
+
+            HitRecord hitRecord;
+            glm::vec3 attenuation;
+            Ray scatteredRay;
+            if (world.hit(ray, shadowAcneConstant, maxRayDistance, hitRecord) && scatter(world.getMaterial(hitRecord.materialId), ray, hitRecord, attenuation, scatteredRay, stream))
+               rays.push_back(scatteredRay);
+         }
+      }
+
+      uint32_t numHits = 0;
+      auto hitStart = std::chrono::high_resolution_clock::now();
+      for (const Ray& ray : rays)
+      {
+         HitRecord hitRecord;
+         numHits += world.hit(ray, shadowAcneConstant, maxRayDistance, hitRecord) ? 1 : 0;
+      }
+      double nsPerHit = elapsedSeconds(hitStart) * 1e9 / rays.size();
+
+      std::cout << scene.name << ": " << world.numPrimitives() << " primitives, " << nsPerHit << " ns per World::hit" << std::endl;
+
+      json << "    {\n";
+      json << "      \"name\": \"" << scene.name << "\",\n";
+      json << "      \"primitives\": " << world.numPrimitives() << ",\n";
+      json << "      \"buildMs\": " << buildMs << ",\n";
+      json << "      \"hitRays\": " << rays.size() << ",\n";
+      json << "      \"hitRatio\": " << (double)numHits / rays.size() << ",\n";
+      json << "      \"nsPerHit\": " << nsPerHit << ",\n";
+      json << "      \"threads\": [\n";
+
+      double singleThreadSeconds = 0.0;
+      for (size_t i = 0; i < threadCounts.size(); i++)
+      {
+         Image image(width, height);
+         settings.numThreads = threadCounts[i];
+         RenderStats stats = render(image, world, camera, settings);
+         if (i == 0)
+            singleThreadSeconds = stats.seconds;
+
+         double efficiency = singleThreadSeconds / (stats.seconds * threadCounts[i]);
+         std::cout << "   " << threadCounts[i] << " threads: " << stats.seconds << " s, " << stats.primaryRays / stats.seconds / 1e6 << " Mprimary/s, "
+                   << stats.totalRays / stats.seconds / 1e6 << " Mrays/s, " << 100.0 * efficiency << "% efficiency" << std::endl;
+
+         json << "        { \"threads\": " << threadCounts[i] << ", \"seconds\": " << stats.seconds
+              << ", \"primaryRaysPerSecond\": " << stats.primaryRays / stats.seconds << ", \"totalRaysPerSecond\": " << stats.totalRays / stats.seconds
+              << ", \"raysPerSample\": " << (double)stats.totalRays / stats.primaryRays << ", \"scalingEfficiency\": " << efficiency << " }"
+              << (i + 1 < threadCounts.size() ? "," : "") << "\n";
+      }
+
+      json << "      ]\n";
+      json << "    }" << (sceneIndex + 1 < scenes.size() ? "," : "") << "\n";
+   }
+
+   json << "  ]\n";
+   json << "}\n";
+   std::cout << "Results written to " << outputFile << std::endl;
+}
+
+// Stand-in for perf c2c: counts the cache lines that more than one worker writes during a pass,
+// for the former linear pixel array against the tiled accumulation buffer, and for per-worker
+// counters with and without their own cache line. Tiles are assigned the way TileScheduler
+// deals them when all workers progress at the same rate.
+void benchmarkFalseSharing()
+{
+   const uint32_t numWorkers = 16;
+   const uintptr_t lineSize = 64;
+   const uint32_t noWorker = ~0u;
+
+   // Returns the number of lines written by more than one worker and the writes that hit them
+   auto countSharing = [&](uintptr_t base, size_t bytes, const std::vector<std::pair<uintptr_t, uint32_t>>& writes)
+   {
+      uintptr_t firstLine = base / lineSize;
+      std::vector<uint32_t> owners((bytes + 2 * lineSize) / lineSize, noWorker);
+      std::vector<bool> shared(owners.size(), false);
+      for (const auto& write : writes)
+      {
+         uint32_t line = (uint32_t)(write.first / lineSize - firstLine);
+         if (owners[line] == noWorker)
+            owners[line] = write.second;
+         else if (owners[line] != write.second)
+            shared[line] = true;
+      }
+
+      uint32_t sharedLines = (uint32_t)std::count(shared.begin(), shared.end(), true);
+      uint64_t sharedWrites = 0;
+      for (const auto& write : writes)
+         sharedWrites += shared[write.first / lineSize - firstLine] ? 1 : 0;
+      return std::make_pair(sharedLines, sharedWrites);
+   };
+
+   for (auto resolution : { std::make_pair(1200u, 800u), std::make_pair(1366u, 768u) })
+   {
+      const uint32_t width = resolution.first;
+      const uint32_t height = resolution.second;
+
+      TileScheduler scheduler(width, height, AccumulationBuffer::tileSize, numWorkers);
+      std::vector<std::pair<Tile, uint32_t>> assignments;
+      Tile tile;
+      bool stolen;
+      for (bool tilesLeft = true; tilesLeft;)
+      {
+         tilesLeft = false;
+         for (uint32_t worker = 0; worker < numWorkers; worker++)
+         {
+            if (scheduler.nextTile(worker, tile, stolen))
+            {
+               assignments.push_back({ tile, worker });
+               tilesLeft = true;
+            }
+         }
+      }
+
+      // First and last byte of every pixel written, a pixel may straddle two lines
+      auto gatherWrites = [&](uintptr_t base, auto offsetOf)
+      {
+         std::vector<std::pair<uintptr_t, uint32_t>> writes;
+         for (const auto& assignment : assignments)
+         {
+            for (uint32_t y = assignment.first.y0; y < assignment.first.y1; y++)
+            {
+               for (uint32_t x = assignment.first.x0; x < assignment.first.x1; x++)
+               {
+                  uintptr_t address = base + offsetOf(x, y) * sizeof(PixelAccumulator);
+                  writes.push_back({ address, assignment.second });
+                  writes.push_back({ address + sizeof(PixelAccumulator) - 1, assignment.second });
+               }
+            }
+         }
+         return writes;
+      };
+
+      std::vector<PixelAccumulator> linear(width * height);
+      AccumulationBuffer tiled(width, height);
+      auto linearSharing = countSharing((uintptr_t)linear.data(), linear.size() * sizeof(PixelAccumulator),
+                                        gatherWrites((uintptr_t)linear.data(), [&](uint32_t x, uint32_t y) { return (size_t)y * width + x; }));
+      auto tiledSharing = countSharing((uintptr_t)tiled.pixels.data(), tiled.pixels.size() * sizeof(PixelAccumulator),
+                                       gatherWrites((uintptr_t)tiled.pixels.data(), [&](uint32_t x, uint32_t y) { return (size_t)tiled.index(x, y); }));
+
+      std::cout << width << "x" << height << ", " << numWorkers << " workers, " << assignments.size() << " tiles" << std::endl;
+      std::cout << "   linear pixels: " << linearSharing.first << " shared lines, " << linearSharing.second << " writes to shared lines" << std::endl;
+      std::cout << "   tiled buffer:  " << tiledSharing.first << " shared lines, " << tiledSharing.second << " writes to shared lines" << std::endl;
+   }
+
+   // The per-worker counters of render(), packed and with a cache line each
+   struct PackedStats
+   {
+      double busySeconds;
+      uint32_t tilesRendered;
+      uint32_t tilesStolen;
+      uint64_t samples;
+      uint64_t rays;
+   };
+
+   struct alignas(64) PaddedStats
+   {
+      double busySeconds;
+      uint32_t tilesRendered;
+      uint32_t tilesStolen;
+      uint64_t samples;
+      uint64_t rays;
+   };
+
+   auto countStatsSharing = [&](auto& stats)
+   {
+      std::vector<std::pair<uintptr_t, uint32_t>> writes;
+      for (uint32_t worker = 0; worker < numWorkers; worker++)
+      {
+         writes.push_back({ (uintptr_t)&stats[worker], worker });
+         writes.push_back({ (uintptr_t)&stats[worker] + sizeof(stats[worker]) - 1, worker });
+      }
+      return countSharing((uintptr_t)stats.data(), stats.size() * sizeof(stats[0]), writes).first;
+   };
+
+   std::vector<PackedStats> packedStats(numWorkers);
+   std::vector<PaddedStats> paddedStats(numWorkers);
+   std::cout << "Worker counters, bumped for every ray" << std::endl;
+   std::cout << "   packed:              " << countStatsSharing(packedStats) << " shared lines" << std::endl;
+   std::cout << "   one line per worker: " << countStatsSharing(paddedStats) << " shared lines" << std::endl;
+}
+
+// Rejection sampling as used before the closed-form mappings, against the mappings one point
+// at a time and 8 at a time
+void benchmarkMappings()
+{
+   const uint32_t numPoints = 1 << 20;
+   const uint32_t repetitions = 10;
+   RandomGenerator rng(7);
+   uint64_t randomCalls = 0;
+
+   auto countedFloat = [&](float min, float max)
+   {
+      randomCalls++;
+      return randomFloat(rng, min, max);
+   };
+
+   auto rejectionSphere = [&]()
+   {
+      while (true)
+      {
+         float x = countedFloat(-1.0f, 1.0f);
+         float y = countedFloat(-1.0f, 1.0f);
+         glm::vec3 point = glm::vec3(x, y, countedFloat(-1.0f, 1.0f));
+         if (glm::length(point) < 1.0f)
+            return point;
+      }
+   };
+
+   auto rejectionDisc = [&]()
+   {
+      while (true)
+      {
+         float x = countedFloat(-1.0f, 1.0f);
+         glm::vec3 point = glm::vec3(x, countedFloat(-1.0f, 1.0f), 0.0f);
+         if (glm::length2(point) < 1.0f)
+            return point;
+      }
+   };
+
+   // Every variant draws its own random numbers, the sums keep the results alive
+   auto measure = [&](const char* name, auto pointFunc)
+   {
+      glm::vec3 sum = glm::vec3(0.0f);
+      randomCalls = 0;
+      auto start = std::chrono::high_resolution_clock::now();
+      for (uint32_t i = 0; i < numPoints; i++)
+         sum += pointFunc();
+      double ns = elapsedSeconds(start) * 1e9 / numPoints;
+      std::cout << "   " << name << ns << " ns, " << (double)randomCalls / numPoints << " random numbers per point (checksum " << sum.x + sum.y + sum.z << ")" << std::endl;
+   };
+
+   std::cout << "One point at a time, including random number generation" << std::endl;
+   measure("rejection ball:   ", rejectionSphere);
+   measure("closed-form ball: ", [&]()
+   {
+      float u = countedFloat(0.0f, 1.0f);
+      float v = countedFloat(0.0f, 1.0f);
+      return uniformSphere(glm::vec2(u, v)) * cubeRoot(countedFloat(0.0f, 1.0f));
+   });
+   measure("closed-form unit vector: ", [&]()
+   {
+      float u = countedFloat(0.0f, 1.0f);
+      return uniformSphere(glm::vec2(u, countedFloat(0.0f, 1.0f)));
+   });
+   measure("rejection disc:   ", rejectionDisc);
+   measure("concentric disc:  ", [&]()
+   {
+      float u = countedFloat(0.0f, 1.0f);
+      return glm::vec3(concentricDisc(glm::vec2(u, countedFloat(0.0f, 1.0f))), 0.0f);
+   });
+
+   // Mapping throughput alone over structure of arrays input
+   AlignedVector<float> u(numPoints), v(numPoints), x(numPoints), y(numPoints), z(numPoints);
+   for (uint32_t i = 0; i < numPoints; i++)
+   {
+      u[i] = randomFloat(rng);
+      v[i] = randomFloat(rng);
+   }
+
+   auto measureBatch = [&](auto batchFunc)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+         batchFunc();
+      return elapsedSeconds(start) * 1e9 / ((double)numPoints * repetitions);
+   };
+
+   std::cout << "Mapping only, " << numPoints << " points" << std::endl;
+   for (int32_t mapping = 0; mapping < 2; mapping++)
+   {
+      double scalarNs = measureBatch([&]()
+      {
+         for (uint32_t i = 0; i < numPoints; i++)
+         {
+            if (mapping == 0)
+            {
+               glm::vec3 direction = uniformSphere(glm::vec2(u[i], v[i]));
+               x[i] = direction.x; y[i] = direction.y; z[i] = direction.z;
+            }
+            else
+            {
+               glm::vec2 point = concentricDisc(glm::vec2(u[i], v[i]));
+               x[i] = point.x; y[i] = point.y;
+            }
+         }
+      });
+      std::vector<float> scalarX(x.begin(), x.end()), scalarY(y.begin(), y.end());
+
+      double batchNs = measureBatch([&]()
+      {
+         if (mapping == 0)
+            uniformSphereBatch(u.data(), v.data(), x.data(), y.data(), z.data(), numPoints);
+         else
+            concentricDiscBatch(u.data(), v.data(), x.data(), y.data(), numPoints);
+      });
+
+      uint32_t mismatches = 0;
+      for (uint32_t i = 0; i < numPoints; i++)
+         mismatches += (x[i] != scalarX[i] || y[i] != scalarY[i]) ? 1 : 0;
+
+      std::cout << "   " << (mapping == 0 ? "unit vector" : "concentric disc") << ": scalar " << scalarNs << " ns, " << simdLevelName(getSimdLevel()) << " batch " << batchNs
+                << " ns (" << scalarNs / batchNs << "x), " << mismatches << " mismatching points" << std::endl;
+   }
+}
+
+// Convergence of every sampler, RMSE against a high sample count reference at 1 to 256 spp
+void benchmarkSamplers()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 120;
    const uint32_t height = (uint32_t)(width / aspectRatio);
-   const uint32_t samplesPerPixel = 500;
-   const int32_t maxDepth = 50;
-   const uint32_t numThreads = 16;
+   const uint32_t referenceSamples = 4096;
+   const uint32_t maxSamples = 256;
+   Camera camera = benchmarkCamera(aspectRatio);
 
-   Image image(width, height);
-   Camera camera = Camera(glm::vec3(13.0f, 2.0f, 3.0f), glm::vec3(0.0f), 20.0f, aspectRatio, 0.1f, 10.0f);
    World world = createRandomScene();
+   world.build();
 
-   render(image, world, camera, samplesPerPixel, maxDepth, numThreads);
-   writeImage("image.ppm", image);
+   RenderSettings settings;
+   settings.quiet = true;
+   settings.numThreads = glm::max(1u, std::thread::hardware_concurrency());
 
-   return 0;
+   // The reference uses a different frame so that it is independent of the random sampler runs
+   Image reference(width, height);
+   settings.samplesPerPixel = referenceSamples;
+   settings.frameIndex = 1;
+   render(reference, world, camera, settings);
+   settings.frameIndex = 0;
+
+   auto rmse = [&](const Image& image)
+   {
+      double sum = 0.0;
+      for (size_t i = 0; i < image.pixels.size(); i++)
+      {
+         glm::vec3 difference = image.pixels[i] - reference.pixels[i];
+         sum += glm::dot(difference, difference) / 3.0;
+      }
+      return glm::sqrt(sum / image.pixels.size());
+   };
+
+   std::cout << width << "x" << height << ", RMSE against " << referenceSamples << " spp" << std::endl;
+   std::cout << "spp";
+   for (SamplerType type : samplerTypes)
+      std::cout << "\t" << samplerName(type);
+   std::cout << std::endl;
+
+   for (uint32_t samples = 1; samples <= maxSamples; samples *= 2)
+   {
+      std::cout << samples;
+      for (SamplerType type : samplerTypes)
+      {
+         Image image(width, height);
+         settings.sampler = type;
+         settings.samplesPerPixel = samples;
+         render(image, world, camera, settings);
+         std::cout << "\t" << rmse(image);
+      }
+      std::cout << std::endl;
+   }
 }
 
+// Equal-time noise on the small-light scene, with emitters only found by BSDF sampling and
+// with light sampling at diffuse hits. RMSE is measured against a light sampled reference,
+// once more without the 1% worst pixels. Those hold the caustics through glass and metal,
+// which only BSDF sampling can find.
+void benchmarkLights()
+{
+   const float aspectRatio = 3.0f / 2.0f;
+   const uint32_t width = 120;
+   const uint32_t height = (uint32_t)(width / aspectRatio);
+   const uint32_t referenceSamples = 2048;
+   Camera camera = benchmarkCamera(aspectRatio);
+
+   World bsdfWorld = createLightScene();
+   bsdfWorld.setLightSampling(false);
+   bsdfWorld.build();
+   World lightWorld = createLightScene();
+   lightWorld.build();
+
+   RenderSettings settings;
+   settings.quiet = true;
+   settings.numThreads = glm::max(1u, std::thread::hardware_concurrency());
+
+   // The reference uses a different frame so that it is independent of the timed runs
+   Image reference(width, height);
+   settings.samplesPerPixel = referenceSamples;
+   settings.frameIndex = 1;
+   render(reference, lightWorld, camera, settings);
+   settings.frameIndex = 0;
+
+   // Full and trimmed RMSE
+   auto rmse = [&](const Image& image)
+   {
+      std::vector<double> errors(image.pixels.size());
+      for (size_t i = 0; i < image.pixels.size(); i++)
+      {
+         glm::vec3 difference = image.pixels[i] - reference.pixels[i];
+         errors[i] = glm::dot(difference, difference) / 3.0;
+      }
+      std::sort(errors.begin(), errors.end());
+      size_t kept = errors.size() - errors.size() / 100;
+      double trimmed = std::accumulate(errors.begin(), errors.begin() + kept, 0.0);
+      double sum = std::accumulate(errors.begin() + kept, errors.end(), trimmed);
+      return glm::vec2((float)glm::sqrt(sum / errors.size()), (float)glm::sqrt(trimmed / kept));
+   };
+
+   std::cout << width << "x" << height << ", " << lightWorld.getLights().size() << " lights, RMSE against " << referenceSamples << " spp" << std::endl;
+   settings.samplesPerPixel = 1 << 20;
+   for (double budget : { 1.0, 4.0 })
+   {
+      settings.timeBudgetSeconds = budget;
+      glm::vec2 errors[2];
+      for (uint32_t method = 0; method < 2; method++)
+      {
+         Image image(width, height);
+         RenderStats stats = render(image, method == 0 ? bsdfWorld : lightWorld, camera, settings);
+         errors[method] = rmse(image);
+         std::cout << "   " << budget << " s, " << (method == 0 ? "BSDF sampling:  " : "light sampling: ") << stats.passes << " spp, " << stats.totalRays / stats.seconds / 1e6
+                   << " Mrays/s, RMSE " << errors[method].x << ", without the worst 1% " << errors[method].y << std::endl;
+      }
+      glm::vec2 ratio = glm::vec2(errors[0].x / errors[1].x, errors[0].y / errors[1].y);
+      std::cout << "   " << ratio.x << "x lower error, " << ratio.y << "x without the worst 1%, " << ratio.y * ratio.y << "x fewer samples for the same error there" << std::endl;
+   }
+}
+
+int main(int argc, char* argv[])
+{
+   std::string benchmark;
+   std::string benchmarkOutput = "benchmark.json";
+   ImageFormat format = ImageFormat::PPM;
+   RenderSettings settings;
+   BVHBuildOptions buildOptions;
+   int32_t gridExtent = 11;
+   std::string sceneCache;
+   std::string sceneDump;
+   SceneDescription scene;
+   bool sceneLoaded = false;
+   bool lightSampling = true;
+   for (int i = 1; i < argc; i++)
+   {
+      std::string arg = argv[i];
+      if (arg == "--bench" && i + 1 < argc)
+         benchmark = argv[++i];
+      else if (arg == "--bench-output" && i + 1 < argc)
+         benchmarkOutput = argv[++i];
+      else if (arg == "--format" && i + 1 < argc)
+      {
+         std::string name = argv[++i];
+         if (name != "ppm" && name != "pfm")
+         {
+            std::cout << "Unknown image format " << name << ", expected ppm or pfm" << std::endl;
+            return 1;
+         }
+         format = name == "pfm" ? ImageFormat::PFM : ImageFormat::PPM;
+      }
+      else if (arg == "--spp" && i + 1 < argc)
+         settings.samplesPerPixel = std::stoi(argv[++i]);
+      else if (arg == "--max-depth" && i + 1 < argc)
+         settings.maxDepth = std::stoi(argv[++i]);
+      else if (arg == "--adaptive")
+         settings.adaptive = true;
+      else if (arg == "--min-spp" && i + 1 < argc)
+         settings.minSamples = std::stoi(argv[++i]);
+      else if (arg == "--error-threshold" && i + 1 < argc)
+         settings.errorThreshold = std::stof(argv[++i]);
+      else if (arg == "--time-budget" && i + 1 < argc)
+         settings.timeBudgetSeconds = std::stod(argv[++i]);
+      else if (arg == "--checkpoint" && i + 1 < argc)
+         settings.checkpointFile = argv[++i];
+      else if (arg == "--checkpoint-interval" && i + 1 < argc)
+         settings.checkpointIntervalSeconds = std::stod(argv[++i]);
+      else if (arg == "--resume")
+         settings.resume = true;
+      else if (arg == "--sampler" && i + 1 < argc)
+      {
+         std::string name = argv[++i];
+         auto match = std::find_if(std::begin(samplerTypes), std::end(samplerTypes), [&](SamplerType type) { return name == samplerName(type); });
+         if (match == std::end(samplerTypes))
+         {
+            std::cout << "Unknown sampler " << name << ", expected random, stratified, halton, sobol or bluenoise" << std::endl;
+            return 1;
+         }
+         settings.sampler = *match;
+      }
+      else if (arg == "--no-packets")
+         settings.packetTracing = false;
+      else if (arg == "--no-light-sampling")
+         lightSampling = false;
+      else if (arg == "--sort-materials")
+         settings.sortMaterials = true;
+      else if (arg == "--integrator" && i + 1 < argc)
+      {
+         std::string name = argv[++i];
+         if (name != "megakernel" && name != "wavefront")
+         {
+            std::cout << "Unknown integrator " << name << ", expected megakernel or wavefront" << std::endl;
+            return 1;
+         }
+         settings.integrator = name == "wavefront" ? Integrator::Wavefront : Integrator::Megakernel;
+      }
+      else if (arg == "--builder" && i + 1 < argc)
+      {
+         std::string name = argv[++i];
+         if (name != "sah" && name != "lbvh" && name != "lbvh-treelets")
+         {
+            std::cout << "Unknown BVH builder " << name << ", expected sah, lbvh or lbvh-treelets" << std::endl;
+            return 1;
+         }
+         buildOptions.builder = name == "lbvh" ? BVHBuilder::LBVH : name == "lbvh-treelets" ? BVHBuilder::LBVHTreelets : BVHBuilder::SAH;
+      }
+      else if (arg == "--bvh-layout" && i + 1 < argc)
+      {
+         std::string name = argv[++i];
+         if (name != "binary" && name != "quantized" && name != "wide4" && name != "wide8")
+         {
+            std::cout << "Unknown BVH layout " << name << ", expected binary, quantized, wide4 or wide8" << std::endl;
+            return 1;
+         }
+         buildOptions.layout = name == "quantized" ? BVHLayout::Quantized4 : name == "wide4" ? BVHLayout::Wide4 : name == "wide8" ? BVHLayout::Wide8 : BVHLayout::Binary;
+      }
+      else if (arg == "--grid-extent" && i + 1 < argc)
+         gridExtent = std::stoi(argv[++i]);
+      else if (arg == "--scene-cache" && i + 1 < argc)
+         sceneCache = argv[++i];
+      else if (arg == "--dump-scene" && i + 1 < argc)
+         sceneDump = argv[++i];
+      else if (arg == "--scene" && i + 1 < argc)
+      {
+         // Render settings from the file apply like flags at this position
+         if (!SceneParser().parse(argv[++i], scene))
+            return 1;
+         settings.samplesPerPixel = scene.samplesPerPixel;
+         settings.maxDepth = scene.maxDepth;
+         settings.numThreads = scene.numThreads;
+         sceneLoaded = true;
+      }
+   }
+   buildOptions.numThreads = settings.numThreads;
+
+   if (benchmark == "bvh")
+   {
+      benchmarkBVH();
+      return 0;
+   }
+   else if (benchmark == "builders")
+   {
+      benchmarkBuilders();
+      return 0;
+   }
+   else if (benchmark == "cache")
+   {
+      benchmarkSceneCache();
+      return 0;
+   }
+   else if (benchmark == "scene")
+   {
+      benchmarkSceneFiles();
+      return 0;
+   }
+   else if (benchmark == "mesh")
+   {
+      benchmarkMesh();
+      return 0;
+   }
+   else if (benchmark == "instances")
+   {
+      benchmarkInstances();
+      return 0;
+   }
+   else if (benchmark == "layouts")
+   {
+      benchmarkLayouts();
+      return 0;
+   }
+   else if (benchmark == "occlusion")
+   {
+      benchmarkOcclusion();
+      return 0;
+   }
+   else if (benchmark == "packets")
+   {
+      benchmarkPackets();
+      return 0;
+   }
+   else if (benchmark == "sharing")
+   {
+      benchmarkFalseSharing();
+      return 0;
+   }
+   else if (benchmark == "mappings")
+   {
+      benchmarkMappings();
+      return 0;
+   }
+   else if (benchmark == "samplers")
+   {
+      benchmarkSamplers();
+      return 0;
+   }
+   else if (benchmark == "lights")
+   {
+      benchmarkLights();
+      return 0;
+   }
+   else if (benchmark == "materials")
+   {
+      benchmarkMaterialHandles();
+      return 0;
+   }
+   else if (benchmark == "shading")
+   {
+      benchmarkShading();
+      return 0;
+   }
+   else if (benchmark == "render")
+   {
+      benchmarkRender(benchmarkOutput);
+      return 0;
+   }
+   else if (!benchmark.empty())
+   {
+      std::cout << "Unknown benchmark " << benchmark << ", expected bvh, builders, cache, scene, mesh, instances, layouts, occlusion, packets, "
+                << "sharing, mappings, samplers, lights, materials, shading or render" << std::endl;
+      return 1;
+   }
+
+   if (!sceneDump.empty())
+   {
+      if (!sceneLoaded)
+      {
+         scene.world = createRandomScene(gridExtent);
+         scene.samplesPerPixel = settings.samplesPerPixel;
+         scene.maxDepth = settings.maxDepth;
+         scene.numThreads = settings.numThreads;
+      }
+
+      if (!SceneWriter().write(sceneDump, scene))
+      {
+         std::cout << "Failed to write scene " << sceneDump << std::endl;
+         return 1;
+      }
+      return 0;
+   }
+
+   // The cache only covers the generated scene, its key covers everything the scene and its
+   // BVH are created from. Scene files are parsed directly.
+   if (!sceneLoaded)
+   {
+      auto start = std::chrono::high_resolution_clock::now();
+      uint64_t sceneKey = sceneCacheKey(gridExtent, buildOptions.builder);
+      bool cached = !sceneCache.empty() && loadSceneCache(sceneCache, sceneKey, scene.world);
+      if (!cached)
+         scene.world = createRandomScene(gridExtent);
+      scene.world.setLightSampling(lightSampling);
+      scene.world.build(buildOptions);
+      if (!sceneCache.empty() && !cached && !saveSceneCache(sceneCache, scene.world, sceneKey))
+         std::cout << "Failed to write scene cache " << sceneCache << std::endl;
+      if (!sceneCache.empty())
+         std::cout << (cached ? "Scene loaded from " : "Scene built and written to ") << sceneCache << " in "
+                   << elapsedSeconds(start) * 1000.0 << " ms" << std::endl;
+   }
+   else
+   {
+      scene.world.setLightSampling(lightSampling);
+      scene.world.build(buildOptions);
+   }
+
+   Image image(scene.width, scene.height);
+   render(image, scene.world, scene.camera(), settings);
+   writeImage(format == ImageFormat::PFM ? "image.pfm" : "image.ppm", image, format);
+
+   if (settings.adaptive)
+      writeSampleHeatmap("samples.ppm", image, settings.samplesPerPixel);
+
+   return 0;
+}